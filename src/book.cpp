@@ -25,6 +25,14 @@
 #include "usi.hpp"
 #include "thread.hpp"
 #include "search.hpp"
+#include <queue>
+#include <sys/stat.h>
+
+#if !defined _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 MT64bit Book::mt64bit_; // 定跡のhash生成用なので、seedは固定でデフォルト値を使う。
 Key Book::ZobPiece[PieceNone][SquareNum];
@@ -92,6 +100,138 @@ void Book::binary_search(const Key key) {
     seekg(low * sizeof(BookEntry), std::ios_base::beg);
 }
 
+namespace {
+    // sorted を中間順で辿りながら、Eytzinger 順の k 番目の要素に入れていく。
+    void buildEytzinger(std::vector<Key>& keys, std::vector<u32>& firsts,
+                        const std::vector<std::pair<Key, u32> >& sorted, size_t& i, const size_t k)
+    {
+        if (sorted.size() < k)
+            return;
+        buildEytzinger(keys, firsts, sorted, i, 2 * k);
+        keys[k] = sorted[i].first;
+        firsts[k] = sorted[i].second;
+        ++i;
+        buildEytzinger(keys, firsts, sorted, i, 2 * k + 1);
+    }
+
+    // ファイルの大きさと更新時刻を得る。同じ名前のファイルが差し替えられたかの判定に使う。
+    bool getFileStamp(const std::string& fName, u64& size, s64& mtime) {
+        struct stat st;
+        if (stat(fName.c_str(), &st) != 0)
+            return false;
+        size = static_cast<u64>(st.st_size);
+        mtime = static_cast<s64>(st.st_mtime);
+        return true;
+    }
+}
+
+bool Book::load(const std::string& fName) {
+    u64 fileSize;
+    s64 fileTime;
+    if (!getFileStamp(fName, fileSize, fileTime)) {
+        unload();
+        return false;
+    }
+    // 同じ名前でも、大きさか更新時刻が変わっていれば作り直されたファイルとして読み直す。
+    if (loadedFileName_ == fName && loadedFileSize_ == fileSize && loadedFileTime_ == fileTime)
+        return true;
+    unload();
+#if defined _WIN32
+    std::ifstream ifs(fName.c_str(), std::ios::binary | std::ios::ate);
+    if (!ifs)
+        return false;
+    loadedEntries_.resize(static_cast<size_t>(ifs.tellg()) / sizeof(BookEntry));
+    ifs.seekg(0, std::ios::beg);
+    ifs.read(reinterpret_cast<char*>(loadedEntries_.data()), loadedEntries_.size() * sizeof(BookEntry));
+    if (!ifs) {
+        std::cerr << "Failed to read book file " << fName << std::endl;
+        loadedEntries_.clear();
+        return false;
+    }
+    entries_ = loadedEntries_.data();
+    entryNum_ = loadedEntries_.size();
+#else
+    const int fd = ::open(fName.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    entryNum_ = static_cast<size_t>(st.st_size) / sizeof(BookEntry);
+    if (entryNum_ != 0) {
+        mappingSize_ = static_cast<size_t>(st.st_size);
+        mapping_ = mmap(nullptr, mappingSize_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping_ == MAP_FAILED) {
+            std::cerr << "Failed to map book file " << fName << std::endl;
+            mapping_ = nullptr;
+            mappingSize_ = 0;
+            entryNum_ = 0;
+            ::close(fd);
+            return false;
+        }
+        entries_ = static_cast<const BookEntry*>(mapping_);
+    }
+    ::close(fd);
+#endif
+    if (std::numeric_limits<u32>::max() < entryNum_) {
+        std::cerr << "Book file " << fName << " is too large to index" << std::endl;
+        unload();
+        return false;
+    }
+    // 異なる key ごとに、最初のエントリーの位置を集める。
+    std::vector<std::pair<Key, u32> > sorted;
+    for (size_t i = 0; i < entryNum_; ++i) {
+        if (i != 0 && entries_[i].key < entries_[i-1].key) {
+            std::cerr << "Book file " << fName << " is not sorted" << std::endl;
+            unload();
+            return false;
+        }
+        if (i == 0 || entries_[i].key != entries_[i-1].key)
+            sorted.push_back(std::make_pair(entries_[i].key, static_cast<u32>(i)));
+    }
+    indexKeys_.assign(sorted.size() + 1, 0);
+    indexFirsts_.assign(sorted.size() + 1, 0);
+    size_t i = 0;
+    buildEytzinger(indexKeys_, indexFirsts_, sorted, i, 1);
+    loadedFileName_ = fName;
+    loadedFileSize_ = fileSize;
+    loadedFileTime_ = fileTime;
+    return true;
+}
+
+void Book::unload() {
+#if !defined _WIN32
+    if (mapping_ != nullptr)
+        munmap(mapping_, mappingSize_);
+#endif
+    mapping_ = nullptr;
+    mappingSize_ = 0;
+    std::vector<BookEntry>().swap(loadedEntries_);
+    entries_ = nullptr;
+    entryNum_ = 0;
+    std::vector<Key>().swap(indexKeys_);
+    std::vector<u32>().swap(indexFirsts_);
+    loadedFileName_ = "";
+    loadedFileSize_ = 0;
+    loadedFileTime_ = 0;
+}
+
+size_t Book::findEntries(const Key key) const {
+    const size_t n = indexKeys_.size() - 1;
+    size_t k = 1;
+    while (k <= n) {
+        // 4 段先の 16 要素は 1 つのキャッシュラインに収まるので、先読みしておく。
+        if (16 * k <= n)
+            prefetch(const_cast<Key*>(&indexKeys_[16 * k]));
+        k = 2 * k + (indexKeys_[k] < key);
+    }
+    // 最後に左の子に進んだ所まで戻ると、key 以上の最小の要素になる。
+    k >>= firstOneFromLSB(~static_cast<u64>(k)) + 1;
+    return (k != 0 && indexKeys_[k] == key ? indexFirsts_[k] : entryNum_);
+}
+
 Key Book::bookKey(const Position& pos) {
     Key key = 0;
     Bitboard bb = pos.occupiedBB();
@@ -117,13 +257,29 @@ std::tuple<Move, Score> Book::probe(const Position& pos, const std::string& fNam
     const Score min_book_score = static_cast<Score>(static_cast<int>(pos.searcher()->options["Min_Book_Score"]));
     Score score = ScoreZero;
 
-    if (fileName_ != fName && !open(fName.c_str()))
-        return std::make_tuple(Move::moveNone(), ScoreNone);
-
-    binary_search(key);
+    // load() したファイルならメモリ上のエントリーを、そうでなければファイルから順に読む。
+    const bool loaded = (loadedFileName_ == fName);
+    size_t idx = 0;
+    if (loaded)
+        idx = findEntries(key);
+    else {
+        if (fileName_ != fName && !open(fName.c_str()))
+            return std::make_tuple(Move::moveNone(), ScoreNone);
+        binary_search(key);
+    }
+    auto next = [&] {
+        if (loaded) {
+            if (entryNum_ <= idx)
+                return false;
+            entry = entries_[idx++];
+            return entry.key == key;
+        }
+        read(reinterpret_cast<char*>(&entry), sizeof(entry));
+        return entry.key == key && good();
+    };
 
     // 現在の局面における定跡手の数だけループする。
-    while (read(reinterpret_cast<char*>(&entry), sizeof(entry)), entry.key == key && good()) {
+    while (next()) {
         best = std::max(best, entry.count);
         sum += entry.count;
 
@@ -160,6 +316,37 @@ inline bool countCompare(const BookEntry& b1, const BookEntry& b2) {
 }
 
 #if !defined MINIMUL
+namespace {
+    // 棋譜から取り出した定跡手。点数付けの為に局面も持っておく。
+    struct BookMoveRecord {
+        Key key;
+        u16 fromToPro;
+        u16 count;
+#if defined MAKE_SEARCHED_BOOK
+        HuffmanCodedPos hcp; // 点数付けの探索にしか使わない。
+#endif
+    };
+
+    // key と指し手で並べて、同じものを 1 つにまとめて出現回数を足し合わせる。
+    // 局面は最初に出現したものだけを残す。
+    void compactBookMoveRecords(std::vector<BookMoveRecord>& records) {
+        std::sort(std::begin(records), std::end(records), [](const BookMoveRecord& a, const BookMoveRecord& b) {
+                return (a.key != b.key ? a.key < b.key : a.fromToPro < b.fromToPro);
+            });
+        size_t uniqueNum = 0;
+        for (size_t i = 0; i < records.size(); ++i) {
+            if (uniqueNum != 0 && records[uniqueNum-1].key == records[i].key && records[uniqueNum-1].fromToPro == records[i].fromToPro) {
+                // 数えられる数の上限を超えたら増やさない。
+                const u32 count = static_cast<u32>(records[uniqueNum-1].count) + records[i].count;
+                records[uniqueNum-1].count = static_cast<u16>(std::min<u32>(count, std::numeric_limits<u16>::max()));
+            }
+            else
+                records[uniqueNum++] = records[i];
+        }
+        records.resize(uniqueNum);
+    }
+}
+
 // 以下のようなフォーマットが入力される。
 // <棋譜番号> <日付> <先手名> <後手名> <0:引き分け, 1:先手勝ち, 2:後手勝ち> <総手数> <棋戦名前> <戦形>
 // <CSA1行形式の指し手>
@@ -172,123 +359,446 @@ inline bool countCompare(const BookEntry& b1, const BookEntry& b2) {
 // 出現回数がそのまま定跡として使う確率となる。
 // 基本的には棋譜を丁寧に選別した上で定跡を作る必要がある。
 // MAKE_SEARCHED_BOOK を on にしていると、定跡生成に非常に時間が掛かる。
+// b <kifu_file> [threads <n>] [byoyomi <msec> | nodes <n>]
+// 棋譜の読み込みと、定跡手の点数付けの探索を threads 個のスレッドで行う。
+// 点数付けの探索は byoyomi (既定は 1000) の時間か、nodes の探索局面数で打ち切る。
+// 探索を複数同時に行うには Searcher が複数必要なので、USE_GLOBAL の場合は点数付けを 1 スレッドで行う。
 void makeBook(Position& pos, std::istringstream& ssCmd) {
     std::string fileName;
     ssCmd >> fileName;
+    int threadNum = 1;
+    int byoyomi = 1000;
+    s64 nodes = 0;
+    std::string token;
+    while (ssCmd >> token) {
+        if (token == "threads")
+            ssCmd >> threadNum;
+        else if (token == "byoyomi")
+            ssCmd >> byoyomi;
+        else if (token == "nodes")
+            ssCmd >> nodes;
+        else {
+            std::cout << "unknown option " << token << std::endl;
+            return;
+        }
+    }
+    if (threadNum <= 0) {
+        std::cout << "thread num = " << threadNum << std::endl;
+        return;
+    }
     std::ifstream ifs(fileName.c_str(), std::ios::binary);
     if (!ifs) {
         std::cout << "I cannot open " << fileName << std::endl;
         return;
     }
+    // 棋譜は 2 行で 1 局なので、先に全て読み込んでおいてスレッドに分ける。
+    std::vector<std::pair<std::string, std::string> > games;
     std::string line;
-    std::map<Key, std::vector<BookEntry> > bookMap;
-
     while (std::getline(ifs, line)) {
-        std::string elem;
-        std::stringstream ss(line);
-        ss >> elem; // 棋譜番号を飛ばす。
-        ss >> elem; // 対局日を飛ばす。
-        ss >> elem; // 先手
-        const std::string sente = elem;
-        ss >> elem; // 後手
-        const std::string gote = elem;
-        ss >> elem; // (0:引き分け,1:先手の勝ち,2:後手の勝ち)
-        const Color winner = (elem == "1" ? Black : elem == "2" ? White : ColorNum);
-        // 勝った方の指し手を記録していく。
-        // 又は稲庭戦法側を記録していく。
-        const Color saveColor = winner;
-
-        if (!std::getline(ifs, line)) {
+        std::string moves;
+        if (!std::getline(ifs, moves)) {
             std::cout << "!!! header only !!!" << std::endl;
             return;
         }
-        pos.set(DefaultStartPositionSFEN, pos.searcher()->threads.main());
-        StateListPtr states = StateListPtr(new std::deque<StateInfo>(1));
-        while (!line.empty()) {
-            const std::string moveStrCSA = line.substr(0, 6);
-            const Move move = csaToMove(pos, moveStrCSA);
-            if (!move) {
-                pos.print();
-                std::cout << "!!! Illegal move = " << moveStrCSA << " !!!" << std::endl;
-                break;
-            }
-            line.erase(0, 6); // 先頭から6文字削除
-            if (pos.turn() == saveColor) {
-                // 先手、後手の内、片方だけを記録する。
-                const Key key = Book::bookKey(pos);
-                bool isFind = false;
-                if (bookMap.find(key) != bookMap.end()) {
-                    for (std::vector<BookEntry>::iterator it = bookMap[key].begin();
-                         it != bookMap[key].end();
-                         ++it)
-                    {
-                        if (it->fromToPro == move.proFromAndTo()) {
-                            ++it->count;
-                            if (it->count < 1)
-                                --it->count; // 数えられる数の上限を超えたので元に戻す。
-                            isFind = true;
-                        }
-                    }
+        games.emplace_back(line, moves);
+    }
+
+    // 1. 各スレッドで棋譜を並べて、勝った方の指し手を集める。
+    Mutex outputMutex;
+    std::vector<std::vector<BookMoveRecord> > threadRecords(threadNum);
+    auto parseFunc = [&](const int threadID) {
+        Position tpos(DefaultStartPositionSFEN, pos.searcher()->threads.main(), pos.searcher());
+        std::vector<BookMoveRecord>& records = threadRecords[threadID];
+        // 同じ序盤の局面は何度も出てくるので、溜まってきたらスレッド内で重複をまとめてメモリを抑える。
+        const size_t MinCompactNum = 1 << 20;
+        size_t compactNum = MinCompactNum;
+        std::deque<StateInfo> states; // 1 局ごとに clear() して使い回す。
+        for (size_t gameIdx = threadID; gameIdx < games.size(); gameIdx += threadNum) {
+            std::string elem;
+            std::stringstream ss(games[gameIdx].first);
+            ss >> elem; // 棋譜番号を飛ばす。
+            ss >> elem; // 対局日を飛ばす。
+            ss >> elem; // 先手
+            ss >> elem; // 後手
+            ss >> elem; // (0:引き分け,1:先手の勝ち,2:後手の勝ち)
+            const Color winner = (elem == "1" ? Black : elem == "2" ? White : ColorNum);
+            // 勝った方の指し手を記録していく。
+            // 又は稲庭戦法側を記録していく。
+            const Color saveColor = winner;
+
+            std::string movesStr = games[gameIdx].second;
+            tpos.set(DefaultStartPositionSFEN, pos.searcher()->threads.main());
+            states.clear();
+            while (!movesStr.empty()) {
+                const std::string moveStrCSA = movesStr.substr(0, 6);
+                const Move move = csaToMove(tpos, moveStrCSA);
+                if (!move) {
+                    std::unique_lock<Mutex> lock(outputMutex);
+                    tpos.print();
+                    std::cout << "!!! Illegal move = " << moveStrCSA << " !!!" << std::endl;
+                    break;
                 }
-                if (isFind == false) {
+                movesStr.erase(0, 6); // 先頭から6文字削除
+                if (tpos.turn() == saveColor) {
+                    // 先手、後手の内、片方だけを記録する。
+                    BookMoveRecord record;
+                    record.key = Book::bookKey(tpos);
+                    record.fromToPro = static_cast<u16>(move.proFromAndTo());
+                    record.count = 1;
 #if defined MAKE_SEARCHED_BOOK
-                    states->push_back(StateInfo());
-                    pos.doMove(move, states->back());
-
-                    std::istringstream ssCmd("byoyomi 1000");
-                    go(pos, ssCmd);
-
-                    pos.undoMove(move);
-                    states->pop_back();
-
-                    // doMove してから search してるので点数が反転しているので直す。
-                    const Score score = -pos.thisThread()->rootMoves[0].score;
-#else
-                    const Score score = ScoreZero;
+                    record.hcp = tpos.toHuffmanCodedPos();
 #endif
-                    // 未登録の手
-                    BookEntry be;
-                    be.score = score;
-                    be.key = key;
-                    be.fromToPro = static_cast<u16>(move.proFromAndTo());
-                    be.count = 1;
-                    bookMap[key].push_back(be);
+                    records.push_back(record);
+                    if (compactNum <= records.size()) {
+                        compactBookMoveRecords(records);
+                        compactNum = std::max(MinCompactNum, records.size() * 2);
+                    }
                 }
+                states.emplace_back();
+                tpos.doMove(move, states.back());
             }
-            states->push_back(StateInfo());
-            pos.doMove(move, states->back());
         }
+        compactBookMoveRecords(records);
+    };
+    {
+        std::vector<std::thread> threads(threadNum);
+        for (int i = 0; i < threadNum; ++i)
+            threads[i] = std::thread([&parseFunc, i] { parseFunc(i); });
+        for (auto& th : threads)
+            th.join();
     }
 
-    // BookEntry::count の値で降順にソート
-    for (auto& elem : bookMap) {
-        std::sort(elem.second.rbegin(), elem.second.rend(), countCompare);
+    // 2. スレッドごとにまとめた定跡手を合わせて、同じものの出現回数を足し合わせる。
+    std::vector<BookMoveRecord> records;
+    {
+        size_t totalNum = 0;
+        for (auto& r : threadRecords)
+            totalNum += r.size();
+        records.reserve(totalNum);
+    }
+    for (auto& r : threadRecords) {
+        records.insert(std::end(records), std::begin(r), std::end(r));
+        std::vector<BookMoveRecord>().swap(r);
+    }
+    compactBookMoveRecords(records);
+    std::cout << "parsed " << games.size() << " games, " << records.size() << " book moves" << std::endl;
+
+    // 3. 定跡手ごとに探索して点数を付ける。
+    std::vector<BookEntry> entries(records.size());
+    for (size_t i = 0; i < records.size(); ++i) {
+        entries[i].key = records[i].key;
+        entries[i].fromToPro = records[i].fromToPro;
+        entries[i].count = records[i].count;
+        entries[i].score = ScoreZero;
+    }
+#if defined MAKE_SEARCHED_BOOK
+#if defined USE_GLOBAL
+    const int searcherNum = 1;
+#else
+    const int searcherNum = threadNum;
+    std::vector<Searcher> searchers(searcherNum);
+    for (auto& s : searchers) {
+        s.init();
+        const std::string options[] = {"name Threads value 1",
+                                       "name MultiPV value 1",
+                                       "name OwnBook value false",
+                                       "name Max_Random_Score_Diff value 0"};
+        for (auto& str : options) {
+            std::istringstream is(str);
+            s.setOption(is);
+        }
+    }
+#endif
+    std::atomic<size_t> nextRecord(0);
+    auto scoreFunc = [&](const int threadID) {
+#if defined USE_GLOBAL
+        (void)threadID;
+        Searcher* s = pos.searcher();
+#else
+        Searcher* s = searchers[threadID].thisptr;
+#endif
+        Position spos(DefaultStartPositionSFEN, s->threads.main(), s);
+        size_t i;
+        while ((i = nextRecord++) < records.size()) {
+            if (!setPosition(spos, records[i].hcp))
+                continue;
+            const Move move = move16toMove(Move(records[i].fromToPro), spos);
+            StateInfo st;
+            spos.doMove(move, st);
+            LimitsType limits;
+            limits.startTime.restart();
+            if (nodes != 0)
+                limits.nodes = nodes;
+            else
+                limits.moveTime = byoyomi - s->options["Byoyomi_Margin"]; // go byoyomi と同じにする。
+#if defined LEARN
+            // 学習用の探索では探索の開始時に設定しないので、ここで設定する。
+            s->alpha = -ScoreInfinite;
+            s->beta  =  ScoreInfinite;
+            s->timeManager.init(limits, spos.turn(), spos.gamePly(), spos, s);
+#endif
+            s->threads.startThinking(spos, limits, s->states);
+            s->threads.main()->waitForSearchFinished();
+            // doMove してから search してるので点数が反転しているので直す。
+            entries[i].score = -s->threads.main()->rootMoves[0].score;
+        }
+    };
+    {
+        std::vector<std::thread> threads(searcherNum);
+        for (int i = 0; i < searcherNum; ++i)
+            threads[i] = std::thread([&scoreFunc, i] { scoreFunc(i); });
+        for (auto& th : threads)
+            th.join();
     }
+#endif
+    std::vector<BookMoveRecord>().swap(records);
+
+    // key ごとに BookEntry::count の値で降順にソート
+    std::sort(std::begin(entries), std::end(entries), [](const BookEntry& a, const BookEntry& b) {
+            return (a.key != b.key ? a.key < b.key : countCompare(b, a));
+        });
 
 #if 0
     // 2 回以上棋譜に出現していない手は削除する。
-    for (auto& elem : bookMap) {
-        auto& second = elem.second;
-        auto erase_it = std::find_if(second.begin(), second.end(), [](decltype(*second.begin())& second_elem) { return second_elem.count < 2; });
-        second.erase(erase_it, second.end());
-    }
+    entries.erase(std::remove_if(std::begin(entries), std::end(entries), [](const BookEntry& e) { return e.count < 2; }), std::end(entries));
 #endif
 
 #if 0
     // narrow book
-    for (auto& elem : bookMap) {
-        auto& second = elem.second;
-        auto erase_it = std::find_if(second.begin(), second.end(), [&](decltype(*second.begin())& second_elem) { return second_elem.count < second[0].count / 2; });
-        second.erase(erase_it, second.end());
+    {
+        size_t num = 0;
+        u16 bestCount = 0;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (i == 0 || entries[i].key != entries[i-1].key)
+                bestCount = entries[i].count;
+            if (bestCount / 2 <= entries[i].count)
+                entries[num++] = entries[i];
+        }
+        entries.resize(num);
     }
 #endif
 
     std::ofstream ofs("book.bin", std::ios::binary);
-    for (auto& elem : bookMap) {
-        for (auto& elel : elem.second)
-            ofs.write(reinterpret_cast<char*>(&(elel)), sizeof(BookEntry));
-    }
+    ofs.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(BookEntry));
 
     std::cout << "book making was done" << std::endl;
 }
+
+namespace {
+    // 名前が同じか、(Windows 以外では) 同じ実体を指していれば同じファイルとみなす。
+    bool isSameFile(const std::string& a, const std::string& b) {
+        if (a == b)
+            return true;
+#if defined _WIN32
+        return false;
+#else
+        struct stat sa, sb;
+        return stat(a.c_str(), &sa) == 0 && stat(b.c_str(), &sb) == 0
+            && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+#endif
+    }
+
+    // key の順に並んだ定跡ファイルを、先頭から一定数ずつ読み込む。
+    class BookFileStream {
+    public:
+        static const size_t BufferEntryNum = 1 << 16;
+
+        bool open(const std::string& fileName) {
+            fileName_ = fileName;
+            ifs_.open(fileName.c_str(), std::ios::binary);
+            if (!ifs_) {
+                std::cout << "I cannot open " << fileName << std::endl;
+                return false;
+            }
+            buffer_.resize(BufferEntryNum);
+            pos_ = num_ = 0;
+            return fill();
+        }
+        bool empty() const { return pos_ == num_; }
+        const BookEntry& front() const { return buffer_[pos_]; }
+        // 次のエントリーに進む。key の順に並んでいなければ false を返す。
+        bool pop() {
+            const Key key = front().key;
+            if (++pos_ == num_ && !fill())
+                return false;
+            if (!empty() && front().key < key) {
+                std::cout << fileName_ << " is not sorted" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+    private:
+        bool fill() {
+            ifs_.read(reinterpret_cast<char*>(buffer_.data()), buffer_.size() * sizeof(BookEntry));
+            num_ = static_cast<size_t>(ifs_.gcount()) / sizeof(BookEntry);
+            pos_ = 0;
+            if (ifs_.bad() || static_cast<size_t>(ifs_.gcount()) % sizeof(BookEntry) != 0) {
+                std::cout << "I cannot read " << fileName_ << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        std::string fileName_;
+        std::ifstream ifs_;
+        std::vector<BookEntry> buffer_;
+        size_t pos_;
+        size_t num_;
+    };
+}
+
+// key の順に並んだ複数の定跡ファイルを、全体を読み込まずにヒープで k-way マージする。
+// 同じ局面の同じ指し手の出現回数と点数は、それぞれ指定した方法でまとめる。
+//   count: sum (合計、既定), max (最大), first (先に指定したファイルの値)
+//   score: first (先に指定したファイルの値、既定), max (最大), min (最小), weighted (出現回数で重み付けした平均)
+// 出力は <output>.tmp に書いてから rename するので、失敗した時に途中までの <output> が残ることは無い。
+// merge_book <output> [count <sum|max|first>] [score <first|max|min|weighted>] <input1> <input2> ...
+void mergeBook(std::istringstream& ssCmd) {
+    enum CountPolicy { CountSum, CountMax, CountFirst };
+    enum ScorePolicy { ScoreFirst, ScoreMax, ScoreMin, ScoreWeighted };
+    std::string outputFileName;
+    ssCmd >> outputFileName;
+    CountPolicy countPolicy = CountSum;
+    ScorePolicy scorePolicy = ScoreFirst;
+    std::vector<std::string> inputFileNames;
+    std::string token;
+    while (ssCmd >> token) {
+        if (token == "count") {
+            ssCmd >> token;
+            if      (token == "sum"  ) countPolicy = CountSum;
+            else if (token == "max"  ) countPolicy = CountMax;
+            else if (token == "first") countPolicy = CountFirst;
+            else {
+                std::cout << "unknown count policy " << token << std::endl;
+                return;
+            }
+        }
+        else if (token == "score") {
+            ssCmd >> token;
+            if      (token == "first"   ) scorePolicy = ScoreFirst;
+            else if (token == "max"     ) scorePolicy = ScoreMax;
+            else if (token == "min"     ) scorePolicy = ScoreMin;
+            else if (token == "weighted") scorePolicy = ScoreWeighted;
+            else {
+                std::cout << "unknown score policy " << token << std::endl;
+                return;
+            }
+        }
+        else
+            inputFileNames.push_back(token);
+    }
+    if (inputFileNames.empty()) {
+        std::cout << "no input book" << std::endl;
+        return;
+    }
+    for (auto& name : inputFileNames) {
+        if (isSameFile(name, outputFileName)) {
+            std::cout << "output " << outputFileName << " is also an input" << std::endl;
+            return;
+        }
+    }
+    std::vector<std::unique_ptr<BookFileStream> > streams;
+    for (auto& name : inputFileNames) {
+        streams.emplace_back(new BookFileStream);
+        if (!streams.back()->open(name))
+            return;
+    }
+    const std::string tmpFileName = outputFileName + ".tmp";
+    std::ofstream ofs(tmpFileName.c_str(), std::ios::binary);
+    if (!ofs) {
+        std::cout << "I cannot open " << tmpFileName << std::endl;
+        return;
+    }
+    // 途中で失敗したら書きかけの一時ファイルを消す。
+    auto discardOutput = [&] {
+        ofs.close();
+        std::remove(tmpFileName.c_str());
+    };
+
+    // 各ファイルの先頭の key が小さい順に取り出す。同じ key ならファイルの順。
+    using HeapElem = std::pair<Key, size_t>;
+    std::priority_queue<HeapElem, std::vector<HeapElem>, std::greater<HeapElem> > heap;
+    for (size_t i = 0; i < streams.size(); ++i) {
+        if (!streams[i]->empty())
+            heap.push(std::make_pair(streams[i]->front().key, i));
+    }
+    // 1 つの key の指し手をまとめる為の作業領域。
+    struct Merged {
+        BookEntry entry;
+        u64 count;
+        u64 weight; // 点数の重み付けに使う出現回数の合計
+        double weightedScore;
+    };
+    std::vector<Merged> merged;
+    std::vector<BookEntry> output;
+    output.reserve(BookFileStream::BufferEntryNum);
+    u64 inputNum = 0;
+    u64 outputNum = 0;
+    while (!heap.empty()) {
+        const Key key = heap.top().first;
+        merged.clear();
+        // この key のエントリーを、全てのファイルから取り出す。
+        while (!heap.empty() && heap.top().first == key) {
+            const size_t i = heap.top().second;
+            heap.pop();
+            BookFileStream& stream = *streams[i];
+            for (; !stream.empty() && stream.front().key == key; ++inputNum) {
+                const BookEntry& e = stream.front();
+                auto it = std::find_if(std::begin(merged), std::end(merged), [&e](const Merged& m) { return m.entry.fromToPro == e.fromToPro; });
+                if (it == std::end(merged))
+                    merged.push_back({e, e.count, e.count, static_cast<double>(e.score) * e.count});
+                else {
+                    switch (countPolicy) {
+                    case CountSum  : it->count += e.count; break;
+                    case CountMax  : it->count = std::max<u64>(it->count, e.count); break;
+                    case CountFirst: break;
+                    default: UNREACHABLE;
+                    }
+                    switch (scorePolicy) {
+                    case ScoreFirst   : break;
+                    case ScoreMax     : it->entry.score = std::max(it->entry.score, e.score); break;
+                    case ScoreMin     : it->entry.score = std::min(it->entry.score, e.score); break;
+                    case ScoreWeighted: it->weightedScore += static_cast<double>(e.score) * e.count; it->weight += e.count; break;
+                    default: UNREACHABLE;
+                    }
+                }
+                if (!stream.pop()) {
+                    discardOutput();
+                    return;
+                }
+            }
+            if (!stream.empty())
+                heap.push(std::make_pair(stream.front().key, i));
+        }
+        for (auto& m : merged) {
+            if (scorePolicy == ScoreWeighted && m.weight != 0)
+                m.entry.score = static_cast<Score>(static_cast<int>(std::round(m.weightedScore / m.weight)));
+            // 数えられる数の上限を超えたら上限にしておく。
+            m.entry.count = static_cast<u16>(std::min<u64>(m.count, std::numeric_limits<u16>::max()));
+        }
+        // BookEntry::count の値で降順にソート
+        std::stable_sort(std::begin(merged), std::end(merged), [](const Merged& a, const Merged& b) { return countCompare(b.entry, a.entry); });
+        for (auto& m : merged) {
+            output.push_back(m.entry);
+            if (output.size() == output.capacity()) {
+                ofs.write(reinterpret_cast<const char*>(output.data()), output.size() * sizeof(BookEntry));
+                output.clear();
+            }
+        }
+        outputNum += merged.size();
+    }
+    ofs.write(reinterpret_cast<const char*>(output.data()), output.size() * sizeof(BookEntry));
+    ofs.close();
+    if (!ofs) {
+        std::cout << "I cannot write " << tmpFileName << std::endl;
+        std::remove(tmpFileName.c_str());
+        return;
+    }
+    if (!replaceFile(tmpFileName, outputFileName)) {
+        std::remove(tmpFileName.c_str());
+        return;
+    }
+    std::cout << "merged " << inputNum << " entries into " << outputNum << " entries" << std::endl;
+}
 #endif
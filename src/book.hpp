@@ -35,24 +35,47 @@ struct BookEntry {
 class Book : private std::ifstream {
 public:
     Book() : random_(std::chrono::system_clock::now().time_since_epoch().count()) {}
+    ~Book() { unload(); }
     std::tuple<Move, Score> probe(const Position& pos, const std::string& fName, const bool pickBest);
+    // 定跡ファイルをメモリにマップして、key の索引を作る。
+    // 以降の fName に対する probe() はファイルを読まずに、索引を引いてメモリ上のエントリーを読む。
+    // 既に読み込んだファイルと名前、大きさ、更新時刻が同じなら読み直さない。
+    bool load(const std::string& fName);
+    void unload();
     static void init();
     static Key bookKey(const Position& pos);
 
 private:
     bool open(const char* fName);
     void binary_search(const Key key);
+    // key のエントリーの先頭の位置を索引から引く。無ければ entryNum_ を返す。
+    size_t findEntries(const Key key) const;
 
     static MT64bit mt64bit_; // 定跡のhash生成用なので、seedは固定でデフォルト値を使う。
     MT64bit random_; // 時刻をseedにして色々指すようにする。
     std::string fileName_;
     size_t size_;
 
+    // load() したファイル
+    std::string loadedFileName_;
+    u64 loadedFileSize_ = 0;
+    s64 loadedFileTime_ = 0; // 読み込んだ時点の更新時刻
+    void* mapping_ = nullptr;
+    size_t mappingSize_ = 0;
+    std::vector<BookEntry> loadedEntries_; // mmap を使わない環境では、ファイルを全て読み込む。
+    const BookEntry* entries_ = nullptr;
+    size_t entryNum_ = 0;
+    // 異なる key を Eytzinger 順 (二分探索木を幅優先で並べた順) に並べた索引。[0] は使わない。
+    // 探索の上位の段が先頭に固まるのでキャッシュに載りやすく、次に読む位置を先読み出来る。
+    std::vector<Key> indexKeys_;
+    std::vector<u32> indexFirsts_; // indexKeys_ の key のエントリーの先頭の位置
+
     static Key ZobPiece[PieceNone][SquareNum];
     static Key ZobHand[HandPieceNum][19];
     static Key ZobTurn;
 };
 
 void makeBook(Position& pos, std::istringstream& ssCmd);
+void mergeBook(std::istringstream& ssCmd);
 
 #endif // #ifndef APERY_BOOK_HPP
@@ -28,6 +28,35 @@ Eraser SYNCENDL;
 
 std::mt19937_64 g_randomTimeSeed(std::chrono::system_clock::now().time_since_epoch().count());
 
+bool writeFileAtomically(const std::string& fileName, const void* data, const size_t size) {
+    const std::string tmpFileName = fileName + ".tmp";
+    {
+        std::ofstream ofs(tmpFileName.c_str(), std::ios::binary);
+        if (!ofs) {
+            std::cerr << "Error: cannot open " << tmpFileName << std::endl;
+            return false;
+        }
+        ofs.write(static_cast<const char*>(data), size);
+        ofs.close();
+        if (!ofs) {
+            std::cerr << "Error: cannot write " << tmpFileName << std::endl;
+            return false;
+        }
+    }
+    return replaceFile(tmpFileName, fileName);
+}
+
+bool replaceFile(const std::string& tmpFileName, const std::string& fileName) {
+#if defined _WIN32
+    std::remove(fileName.c_str()); // Windows では置き換え先があると rename() が失敗する。
+#endif
+    if (std::rename(tmpFileName.c_str(), fileName.c_str()) != 0) {
+        std::cerr << "Error: cannot rename " << tmpFileName << " to " << fileName << std::endl;
+        return false;
+    }
+    return true;
+}
+
 std::ostream& operator << (std::ostream& os, SyncCout sc) {
     static Mutex m;
     if (sc == IOLock  ) m.lock();
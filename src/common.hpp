@@ -306,6 +306,12 @@ private:
 
 extern std::mt19937_64 g_randomTimeSeed;
 
+// size byte の data を fileName.tmp に書き出してから fileName に rename する。
+// 書き出し中に落ちたり、同時に読まれたりしても、fileName が途中までしか書かれていない状態にはならない。(Windows 以外)
+bool writeFileAtomically(const std::string& fileName, const void* data, const size_t size);
+// 書き終えた tmpFileName を fileName に rename して置き換える。
+bool replaceFile(const std::string& tmpFileName, const std::string& fileName);
+
 #if defined _WIN32 && !defined _MSC_VER
 #ifndef NOMINMAX
 #define NOMINMAX
@@ -336,8 +342,9 @@ template <typename ElementType, typename KeyType, size_t Size_i, size_t Size_j>
 struct TriangularArray {
     static constexpr KeyType index(const KeyType i, const KeyType j) { return i * (i + 1)/2 + j; }
     static constexpr size_t Size = index(Size_i - 1, Size_j - 1) + 1;
-    const ElementType& at(const KeyType i, const KeyType j) const { return (i < j ? data_[index(i, j)] : data_[index(j, i)]); }
-    ElementType& at(const KeyType i, const KeyType j) { return (i < j ? data_[index(i, j)] : data_[index(j, i)]); }
+    // index(i, j) は j <= i の時だけ有効なので、大きい方を i に渡す。
+    const ElementType& at(const KeyType i, const KeyType j) const { return (i < j ? data_[index(j, i)] : data_[index(i, j)]); }
+    ElementType& at(const KeyType i, const KeyType j) { return (i < j ? data_[index(j, i)] : data_[index(i, j)]); }
     const ElementType* begin() const { return data_; }
     ElementType* begin() { return data_; }
     const ElementType* end() const { return data_ + Size; }
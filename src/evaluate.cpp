@@ -26,10 +26,110 @@
 
 KPPBoardIndexStartToPiece g_kppBoardIndexStartToPiece;
 
-KPPType Evaluator::KPP[SquareNum][fe_end][fe_end];
-KKPType Evaluator::KKP[SquareNum][SquareNum][fe_end];
-KKType  Evaluator::KK[SquareNum][SquareNum];
+namespace {
+    // 最初に使うテーブル。静的な領域に置くので、触るまではメモリを使わない。
+    SearchEvalTable g_initialEvalTable;
+    // load_eval で初めて使った時に確保する、もう 1 つのテーブル。
+    std::unique_ptr<SearchEvalTable> g_allocatedEvalTable;
+    // loadSpareTable() で読み込んで、次の switchTable() で切り替えるテーブル。
+    SearchEvalTable* g_pendingEvalTable = nullptr;
+}
+
+SearchKPPType (*Evaluator::KPP)[fe_end][fe_end] = g_initialEvalTable.KPP;
+#if defined EVAL_KPP_INT8
+QuantizedKPPTable::ShiftType (*Evaluator::KPPShift)[fe_end] = g_initialEvalTable.KPPShift;
+#endif
+KKPType (*Evaluator::KKP)[SquareNum][fe_end] = g_initialEvalTable.KKP;
+KKType  (*Evaluator::KK)[SquareNum] = g_initialEvalTable.KK;
+SearchEvalTable* Evaluator::table_ = &g_initialEvalTable;
 EvaluateHashTable g_evalTable;
+std::atomic<u32> g_evalGeneration(1); // KingKPPCache をゼロ初期化した時に無効になるように 1 から始める。
+
+bool Evaluator::loadSpareTable(const std::string& dirName) {
+    if (table_ == &g_initialEvalTable && !g_allocatedEvalTable)
+        g_allocatedEvalTable.reset(new SearchEvalTable);
+    SearchEvalTable& spare = (table_ == &g_initialEvalTable ? *g_allocatedEvalTable : g_initialEvalTable);
+    g_pendingEvalTable = nullptr;
+    // 合成後のファイルが無ければ、一時オブジェクトに次元下げした評価関数を読み込んで合成する。
+    if (!std::unique_ptr<Evaluator>(new Evaluator)->synthesize(dirName, spare, true, true))
+        return false;
+    g_pendingEvalTable = &spare;
+    return true;
+}
+
+bool Evaluator::switchTable() {
+    if (g_pendingEvalTable == nullptr)
+        return false;
+    table_ = g_pendingEvalTable;
+    g_pendingEvalTable = nullptr;
+    KPP = table_->KPP;
+#if defined EVAL_KPP_INT8
+    KPPShift = table_->KPPShift;
+#endif
+    KKP = table_->KKP;
+    KK = table_->KK;
+    g_evalTable.clear(); // 世代も進むので、KingKPPCache も使われなくなる。
+    return true;
+}
+
+void QuantizedKPPTable::quantize(const KPPType (&kpp)[SquareNum][fe_end][fe_end]) {
+    const int MaxValue = std::numeric_limits<s8>::max();
+#if defined _OPENMP
+#pragma omp parallel for
+#endif
+    for (int ksq = SQ11; ksq < SquareNum; ++ksq) {
+        // 行ごとに、要素が s8 に収まる最小のシフト量を求める。
+        for (int i = 0; i < fe_end; ++i) {
+            for (int c = 0; c < 2; ++c) {
+                int maxAbs = 0;
+                for (int j = 0; j < fe_end; ++j)
+                    maxAbs = std::max(maxAbs, std::abs(static_cast<int>(kpp[ksq][i][j][c])));
+                u8 shift = 0;
+                while ((maxAbs >> shift) > MaxValue)
+                    ++shift;
+                KPPShift[ksq][i][c] = shift;
+            }
+        }
+        // KPP[ksq][i][j] と KPP[ksq][j][i] を同じ値にする為に、2 つの行のシフト量の大きい方で丸めてから、それぞれの行のシフト量に直す。
+        // シフト量の小さい方の行で s8 に収まるように、値の絶対値を制限する。
+        for (int i = 0; i < fe_end; ++i) {
+            for (int j = 0; j <= i; ++j) {
+                for (int c = 0; c < 2; ++c) {
+                    const int shiftI = KPPShift[ksq][i][c];
+                    const int shiftJ = KPPShift[ksq][j][c];
+                    const int shift = std::max(shiftI, shiftJ);
+                    const int limit = MaxValue >> (shift - std::min(shiftI, shiftJ));
+                    const int value = kpp[ksq][i][j][c];
+                    // 偏りが出ないように、丁度半分の時は偶数の方に丸める。
+                    int rounded = value >> shift;
+                    const int rem = value - rounded * (1 << shift);
+                    if (shift != 0 && (rem > (1 << (shift - 1)) || (rem == (1 << (shift - 1)) && (rounded & 1))))
+                        ++rounded;
+                    rounded = std::min(std::max(rounded, -limit), limit);
+                    KPP[ksq][i][j][c] = static_cast<s8>(rounded * (1 << (shift - shiftI)));
+                    KPP[ksq][j][i][c] = static_cast<s8>(rounded * (1 << (shift - shiftJ)));
+                }
+            }
+        }
+    }
+}
+
+bool QuantizedKPPTable::read(const std::string& dirName) {
+    std::ifstream ifs((Evaluator::addSlashIfNone(dirName) + "KPP_int8.bin").c_str(), std::ios::binary);
+    std::ifstream ifsShift((Evaluator::addSlashIfNone(dirName) + "KPP_int8_shift.bin").c_str(), std::ios::binary);
+    return ifs.read(reinterpret_cast<char*>(KPP), sizeof(KPP))
+        && ifsShift.read(reinterpret_cast<char*>(KPPShift), sizeof(KPPShift));
+}
+
+bool QuantizedKPPTable::write(const std::string& dirName) const {
+    return writeFileAtomically(Evaluator::addSlashIfNone(dirName) + "KPP_int8.bin", KPP, sizeof(KPP))
+        && writeFileAtomically(Evaluator::addSlashIfNone(dirName) + "KPP_int8_shift.bin", KPPShift, sizeof(KPPShift));
+}
+
+void QuantizedKPPTable::remove(const std::string& dirName) {
+    std::remove((Evaluator::addSlashIfNone(dirName) + "KPP_int8.bin").c_str());
+    std::remove((Evaluator::addSlashIfNone(dirName) + "KPP_int8_shift.bin").c_str());
+}
 
 const int kppArray[31] = {
     0,        f_pawn,   f_lance,  f_knight,
@@ -51,6 +151,62 @@ const int kppHandArray[ColorNum][HandPieceNum] = {
 };
 
 namespace {
+    // 玉の位置 ksq から見た駒リスト list の KPP の和。
+    // 同じ玉の位置で前回計算した時から駒リストの変化が少なければ、変化した要素の分だけ差分計算する。
+    std::array<s32, 2> kingKPPSum(const Position& pos, const Color c, const Square ksq, const int* list) {
+        const auto* ppkpp = Evaluator::KPP[ksq];
+        const int nlist = pos.nlist();
+        const u32 generation = g_evalGeneration.load(std::memory_order_relaxed);
+        KingKPPCache::Entry* entry = (pos.thisThread() != nullptr ? &pos.thisThread()->kingKPPCache.entries[c][ksq] : nullptr);
+        std::array<s32, 2> sum = {{0, 0}};
+
+        if (entry != nullptr && entry->generation == generation) {
+            int changed[EvalList::ListSize];
+            int changedNum = 0;
+            for (int i = 0; i < nlist; ++i) {
+                if (entry->list[i] != list[i])
+                    changed[changedNum++] = i;
+            }
+            // 1 要素の差分計算は全て計算し直す時の 4/nlist 程度の計算量になる。
+            if (changedNum * 4 < nlist) {
+                sum = entry->sum;
+                for (int n = 0; n < changedNum; ++n) {
+                    const int i = changed[n];
+                    const auto* pkppOld = ppkpp[entry->list[i]];
+                    const auto* pkppNew = ppkpp[list[i]];
+                    std::array<s32, 2> sumOld = {{0, 0}};
+                    std::array<s32, 2> sumNew = {{0, 0}};
+                    for (int j = 0; j < nlist; ++j) {
+                        if (j == i)
+                            continue;
+                        sumNew += pkppNew[entry->list[j]];
+                        sumOld += pkppOld[entry->list[j]];
+                    }
+                    sum += kppRowSum(ksq, list[i], sumNew);
+                    sum -= kppRowSum(ksq, entry->list[i], sumOld);
+                    entry->list[i] = static_cast<u16>(list[i]);
+                }
+                entry->sum = sum;
+                return sum;
+            }
+        }
+
+        for (int i = 1; i < nlist; ++i) {
+            const auto* pkpp = ppkpp[list[i]];
+            std::array<s32, 2> rowSum = {{0, 0}};
+            for (int j = 0; j < i; ++j)
+                rowSum += pkpp[list[j]];
+            sum += kppRowSum(ksq, list[i], rowSum);
+        }
+        if (entry != nullptr) {
+            entry->generation = generation;
+            entry->sum = sum;
+            for (int i = 0; i < nlist; ++i)
+                entry->list[i] = static_cast<u16>(list[i]);
+        }
+        return sum;
+    }
+
     EvalSum doapc(const Position& pos, const int index[2]) {
         const Square sq_bk = pos.kingSquare(Black);
         const Square sq_wk = pos.kingSquare(White);
@@ -62,7 +218,7 @@ namespace {
         sum.p[2][1] = Evaluator::KKP[sq_bk][sq_wk][index[0]][1];
         const auto* pkppb = Evaluator::KPP[sq_bk         ][index[0]];
         const auto* pkppw = Evaluator::KPP[inverse(sq_wk)][index[1]];
-#if defined USE_AVX2_EVAL || defined USE_SSE_EVAL
+#if (defined USE_AVX2_EVAL || defined USE_SSE_EVAL) && !defined EVAL_KPP_INT8
         sum.m[0] = _mm_set_epi32(0, 0, *reinterpret_cast<const s32*>(&pkppw[list1[0]][0]), *reinterpret_cast<const s32*>(&pkppb[list0[0]][0]));
         sum.m[0] = _mm_cvtepi16_epi32(sum.m[0]);
         for (int i = 1; i < pos.nlist(); ++i) {
@@ -72,14 +228,14 @@ namespace {
             sum.m[0] = _mm_add_epi32(sum.m[0], tmp);
         }
 #else
-        sum.p[0][0] = pkppb[list0[0]][0];
-        sum.p[0][1] = pkppb[list0[0]][1];
-        sum.p[1][0] = pkppw[list1[0]][0];
-        sum.p[1][1] = pkppw[list1[0]][1];
+        std::array<s32, 2> sumb = {{pkppb[list0[0]][0], pkppb[list0[0]][1]}};
+        std::array<s32, 2> sumw = {{pkppw[list1[0]][0], pkppw[list1[0]][1]}};
         for (int i = 1; i < pos.nlist(); ++i) {
-            sum.p[0] += pkppb[list0[i]];
-            sum.p[1] += pkppw[list1[i]];
+            sumb += pkppb[list0[i]];
+            sumw += pkppw[list1[i]];
         }
+        sum.p[0] = kppRowSum(sq_bk         , index[0], sumb);
+        sum.p[1] = kppRowSum(inverse(sq_wk), index[1], sumw);
 #endif
 
         return sum;
@@ -94,7 +250,7 @@ namespace {
             sum[0] += pkppb[list0[i]][0];
             sum[1] += pkppb[list0[i]][1];
         }
-        return sum;
+        return kppRowSum(sq_bk, index[0], sum);
     }
     std::array<s32, 2> doawhite(const Position& pos, const int index[2]) {
         const Square sq_wk = pos.kingSquare(White);
@@ -106,7 +262,7 @@ namespace {
             sum[0] += pkppw[list1[i]][0];
             sum[1] += pkppw[list1[i]][1];
         }
-        return sum;
+        return kppRowSum(inverse(sq_wk), index[1], sum);
     }
 
 #if defined INANIWA_SHIFT
@@ -177,17 +333,10 @@ namespace {
             diff.p[2][1] = Evaluator::KK[sq_bk][sq_wk][1];
             diff.p[2][0] += pos.material() * FVScale;
             if (pos.turn() == Black) {
-                const auto* ppkppw = Evaluator::KPP[inverse(sq_wk)];
                 const int* list1 = pos.plist1();
-                diff.p[1][0] = 0;
-                diff.p[1][1] = 0;
+                diff.p[1] = kingKPPSum(pos, White, inverse(sq_wk), list1);
                 for (int i = 0; i < pos.nlist(); ++i) {
                     const int k1 = list1[i];
-                    const auto* pkppw = ppkppw[k1];
-                    for (int j = 0; j < i; ++j) {
-                        const int l1 = list1[j];
-                        diff.p[1] += pkppw[l1];
-                    }
                     diff.p[2][0] -= Evaluator::KKP[inverse(sq_wk)][inverse(sq_bk)][k1][0];
                     diff.p[2][1] += Evaluator::KKP[inverse(sq_wk)][inverse(sq_bk)][k1][1];
                 }
@@ -201,17 +350,10 @@ namespace {
                 }
             }
             else {
-                const auto* ppkppb = Evaluator::KPP[sq_bk         ];
                 const int* list0 = pos.plist0();
-                diff.p[0][0] = 0;
-                diff.p[0][1] = 0;
+                diff.p[0] = kingKPPSum(pos, Black, sq_bk, list0);
                 for (int i = 0; i < pos.nlist(); ++i) {
                     const int k0 = list0[i];
-                    const auto* pkppb = ppkppb[k0];
-                    for (int j = 0; j < i; ++j) {
-                        const int l0 = list0[j];
-                        diff.p[0] += pkppb[l0];
-                    }
                     diff.p[2] += Evaluator::KKP[sq_bk][sq_wk][k0];
                 }
 
@@ -236,8 +378,8 @@ namespace {
             else {
                 assert(pos.cl().size == 2);
                 diff += doapc(pos, pos.cl().clistpair[1].newlist);
-                diff.p[0] -= Evaluator::KPP[pos.kingSquare(Black)         ][pos.cl().clistpair[0].newlist[0]][pos.cl().clistpair[1].newlist[0]];
-                diff.p[1] -= Evaluator::KPP[inverse(pos.kingSquare(White))][pos.cl().clistpair[0].newlist[1]][pos.cl().clistpair[1].newlist[1]];
+                diff.p[0] -= kppValue(pos.kingSquare(Black)         , pos.cl().clistpair[0].newlist[0], pos.cl().clistpair[1].newlist[0]);
+                diff.p[1] -= kppValue(inverse(pos.kingSquare(White)), pos.cl().clistpair[0].newlist[1], pos.cl().clistpair[1].newlist[1]);
                 const int listIndex_cap = pos.cl().listindex[1];
                 pos.plist0()[listIndex_cap] = pos.cl().clistpair[1].oldlist[0];
                 pos.plist1()[listIndex_cap] = pos.cl().clistpair[1].oldlist[1];
@@ -247,8 +389,8 @@ namespace {
                 diff -= doapc(pos, pos.cl().clistpair[0].oldlist);
 
                 diff -= doapc(pos, pos.cl().clistpair[1].oldlist);
-                diff.p[0] += Evaluator::KPP[pos.kingSquare(Black)         ][pos.cl().clistpair[0].oldlist[0]][pos.cl().clistpair[1].oldlist[0]];
-                diff.p[1] += Evaluator::KPP[inverse(pos.kingSquare(White))][pos.cl().clistpair[0].oldlist[1]][pos.cl().clistpair[1].oldlist[1]];
+                diff.p[0] += kppValue(pos.kingSquare(Black)         , pos.cl().clistpair[0].oldlist[0], pos.cl().clistpair[1].oldlist[0]);
+                diff.p[1] += kppValue(inverse(pos.kingSquare(White)), pos.cl().clistpair[0].oldlist[1], pos.cl().clistpair[1].oldlist[1]);
                 pos.plist0()[listIndex_cap] = pos.cl().clistpair[1].newlist[0];
                 pos.plist1()[listIndex_cap] = pos.cl().clistpair[1].newlist[1];
             }
@@ -314,7 +456,7 @@ namespace {
         EvalSum sum;
         sum.p[2][0] = Evaluator::KK[sq_bk][sq_wk][0];
         sum.p[2][1] = Evaluator::KK[sq_bk][sq_wk][1];
-#if defined USE_AVX2_EVAL || defined USE_SSE_EVAL
+#if (defined USE_AVX2_EVAL || defined USE_SSE_EVAL) && !defined EVAL_KPP_INT8
         sum.m[0] = _mm_setzero_si128();
         for (int i = 0; i < pos.nlist(); ++i) {
             const int k0 = list0[i];
@@ -343,12 +485,16 @@ namespace {
             const int k1 = list1[i];
             const auto* pkppb = ppkppb[k0];
             const auto* pkppw = ppkppw[k1];
+            std::array<s32, 2> sumb = {{0, 0}};
+            std::array<s32, 2> sumw = {{0, 0}};
             for (int j = 0; j < i; ++j) {
                 const int l0 = list0[j];
                 const int l1 = list1[j];
-                sum.p[0] += pkppb[l0];
-                sum.p[1] += pkppw[l1];
+                sumb += pkppb[l0];
+                sumw += pkppw[l1];
             }
+            sum.p[0] += kppRowSum(sq_bk         , k0, sumb);
+            sum.p[1] += kppRowSum(inverse(sq_wk), k1, sumw);
             sum.p[2] += Evaluator::KKP[sq_bk][sq_wk][k0];
         }
 #endif
@@ -415,12 +561,16 @@ func(handB, HPawn  , f_hand_pawn  , e_hand_pawn  );
         const int k1 = list1[i];
         const auto* pkppb = ppkppb[k0];
         const auto* pkppw = ppkppw[k1];
+        std::array<s32, 2> sumb = {{0, 0}};
+        std::array<s32, 2> sumw = {{0, 0}};
         for (int j = 0; j < i; ++j) {
             const int l0 = list0[j];
             const int l1 = list1[j];
-            score.p[0] += pkppb[l0];
-            score.p[1] += pkppw[l1];
+            sumb += pkppb[l0];
+            sumw += pkppw[l1];
         }
+        score.p[0] += kppRowSum(sq_bk         , k0, sumb);
+        score.p[1] += kppRowSum(inverse(sq_wk), k1, sumw);
         score.p[2] += Evaluator::KKP[sq_bk][sq_wk][k0];
     }
 
@@ -433,6 +583,123 @@ func(handB, HPawn  , f_hand_pawn  , e_hand_pawn  );
     return static_cast<Score>(score.sum(pos.turn()));
 }
 
+namespace {
+    // 玉の位置 ksq から見た駒リスト lists[0..num) の KPP の和を sums に書き込む。
+    void kppSumBatch(const Square ksq, const int* const lists[], const size_t num, std::array<s32, 2>* const sums[]) {
+        const int nlist = Position::nlist();
+        size_t n = 0;
+#if defined USE_AVX2_EVAL
+        // 8 局面の駒リストを添字ごとに並べ替えて、8 局面分の KPP の要素を 1 回の gather で読む。
+        const s32* base = reinterpret_cast<const s32*>(&Evaluator::KPP[ksq][0][0]);
+#if defined EVAL_KPP_INT8
+        // 要素が 2 byte なので、2 byte 単位の添字で 4 byte ずつ読んで下位 2 byte を使う。
+        // 末尾の要素を読む時は KPP の後ろの 2 byte まで読むが、SearchEvalTable の中なので問題無い。行のシフト量も同様に読む。
+        const s32* shiftBase = reinterpret_cast<const s32*>(&Evaluator::KPPShift[ksq][0]);
+        const __m256i byteMask = _mm256_set1_epi32(0xff);
+#endif
+        const __m256i feEnd = _mm256_set1_epi32(fe_end);
+        alignas(32) s32 transposed[EvalList::ListSize][8];
+        for (; n + 8 <= num; n += 8) {
+            for (int i = 0; i < nlist; ++i) {
+                for (int k = 0; k < 8; ++k)
+                    transposed[i][k] = lists[n + k][i];
+            }
+            __m256i sum0 = _mm256_setzero_si256();
+            __m256i sum1 = _mm256_setzero_si256();
+            for (int i = 1; i < nlist; ++i) {
+                const __m256i piece = _mm256_load_si256(reinterpret_cast<const __m256i*>(transposed[i]));
+                const __m256i row = _mm256_mullo_epi32(piece, feEnd);
+#if defined EVAL_KPP_INT8
+                __m256i rowSum0 = _mm256_setzero_si256();
+                __m256i rowSum1 = _mm256_setzero_si256();
+                for (int j = 0; j < i; ++j) {
+                    const __m256i index = _mm256_add_epi32(row, _mm256_load_si256(reinterpret_cast<const __m256i*>(transposed[j])));
+                    const __m256i kpp = _mm256_i32gather_epi32(base, index, 2);
+                    // [0] が下位 8bit, [1] がその上の 8bit に入っている。
+                    rowSum0 = _mm256_add_epi32(rowSum0, _mm256_srai_epi32(_mm256_slli_epi32(kpp, 24), 24));
+                    rowSum1 = _mm256_add_epi32(rowSum1, _mm256_srai_epi32(_mm256_slli_epi32(kpp, 16), 24));
+                }
+                const __m256i shift = _mm256_i32gather_epi32(shiftBase, piece, 2);
+                sum0 = _mm256_add_epi32(sum0, _mm256_sllv_epi32(rowSum0, _mm256_and_si256(shift, byteMask)));
+                sum1 = _mm256_add_epi32(sum1, _mm256_sllv_epi32(rowSum1, _mm256_and_si256(_mm256_srli_epi32(shift, 8), byteMask)));
+#else
+                for (int j = 0; j < i; ++j) {
+                    const __m256i index = _mm256_add_epi32(row, _mm256_load_si256(reinterpret_cast<const __m256i*>(transposed[j])));
+                    const __m256i kpp = _mm256_i32gather_epi32(base, index, 4);
+                    // KPPType の [0] が下位 16bit, [1] が上位 16bit に入っている。
+                    sum0 = _mm256_add_epi32(sum0, _mm256_srai_epi32(_mm256_slli_epi32(kpp, 16), 16));
+                    sum1 = _mm256_add_epi32(sum1, _mm256_srai_epi32(kpp, 16));
+                }
+#endif
+            }
+            alignas(32) s32 result[2][8];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(result[0]), sum0);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(result[1]), sum1);
+            for (int k = 0; k < 8; ++k) {
+                (*sums[n + k])[0] = result[0][k];
+                (*sums[n + k])[1] = result[1][k];
+            }
+        }
+#endif
+        const auto* ppkpp = Evaluator::KPP[ksq];
+        for (; n < num; ++n) {
+            const int* list = lists[n];
+            std::array<s32, 2> sum = {{0, 0}};
+            for (int i = 1; i < nlist; ++i) {
+                const auto* pkpp = ppkpp[list[i]];
+                std::array<s32, 2> rowSum = {{0, 0}};
+                for (int j = 0; j < i; ++j)
+                    rowSum += pkpp[list[j]];
+                sum += kppRowSum(ksq, list[i], rowSum);
+            }
+            *sums[n] = sum;
+        }
+    }
+}
+
+void evaluateBatch(const Position positions[], const size_t num, EvalSum sums[]) {
+    // KK, KKP と駒割りは局面ごとに足す。
+    for (size_t n = 0; n < num; ++n) {
+        const Position& pos = positions[n];
+        const Square sq_bk = pos.kingSquare(Black);
+        const Square sq_wk = pos.kingSquare(White);
+        const int* list0 = pos.cplist0();
+        EvalSum& sum = sums[n];
+        sum.p[2][0] = Evaluator::KK[sq_bk][sq_wk][0];
+        sum.p[2][1] = Evaluator::KK[sq_bk][sq_wk][1];
+        for (int i = 0; i < pos.nlist(); ++i)
+            sum.p[2] += Evaluator::KKP[sq_bk][sq_wk][list0[i]];
+        sum.p[2][0] += pos.material() * FVScale;
+#if defined INANIWA_SHIFT
+        sum.p[2][0] += inaniwaScore(pos);
+#endif
+    }
+
+    // 先手玉の KPP (p[0]) と後手玉の KPP (p[1]) を、それぞれ玉の位置の順に並べて計算する。
+    std::vector<std::pair<Square, u32> > order(num);
+    std::vector<const int*> lists(num);
+    std::vector<std::array<s32, 2>*> results(num);
+    for (Color c = Black; c < ColorNum; ++c) {
+        for (size_t n = 0; n < num; ++n) {
+            const Square ksq = (c == Black ? positions[n].kingSquare(Black) : inverse(positions[n].kingSquare(White)));
+            order[n] = std::make_pair(ksq, static_cast<u32>(n));
+        }
+        std::sort(std::begin(order), std::end(order));
+        for (size_t n = 0; n < num; ++n) {
+            const Position& pos = positions[order[n].second];
+            lists[n] = (c == Black ? pos.cplist0() : pos.cplist1());
+            results[n] = &sums[order[n].second].p[c];
+        }
+        for (size_t begin = 0; begin < num;) {
+            size_t end = begin + 1;
+            while (end < num && order[end].first == order[begin].first)
+                ++end;
+            kppSumBatch(order[begin].first, &lists[begin], end - begin, &results[begin]);
+            begin = end;
+        }
+    }
+}
+
 Score evaluate(Position& pos, SearchStack* ss) {
     if (ss->staticEvalRaw.p[0][0] != ScoreNotEvaluated) {
         const Score score = static_cast<Score>(ss->staticEvalRaw.sum(pos.turn()));
@@ -441,9 +708,10 @@ Score evaluate(Position& pos, SearchStack* ss) {
     }
 
     const Key keyExcludeTurn = pos.getKeyExcludeTurn();
+    const Key entryKey = EvaluateHashTable::entryKey(keyExcludeTurn);
     EvaluateHashEntry entry = *g_evalTable[keyExcludeTurn]; // atomic にデータを取得する必要がある。
     entry.decode();
-    if (entry.key == keyExcludeTurn) {
+    if (entry.key == entryKey) {
         ss->staticEvalRaw = entry;
         assert(static_cast<Score>(ss->staticEvalRaw.sum(pos.turn())) == evaluateUnUseDiff(pos));
         return static_cast<Score>(entry.sum(pos.turn())) / FVScale;
@@ -451,7 +719,7 @@ Score evaluate(Position& pos, SearchStack* ss) {
 
     evaluateBody(pos, ss);
 
-    ss->staticEvalRaw.key = keyExcludeTurn;
+    ss->staticEvalRaw.key = entryKey;
     ss->staticEvalRaw.encode();
     *g_evalTable[keyExcludeTurn] = ss->staticEvalRaw;
     return static_cast<Score>(ss->staticEvalRaw.sum(pos.turn())) / FVScale;
@@ -213,6 +213,12 @@ template <typename KPPType, typename KKPType, typename KKType> struct EvaluatorB
     KPPType* oneArrayKPP(const u64 i) { return reinterpret_cast<KPPType*>(&kpps) + i; }
     KKPType* oneArrayKKP(const u64 i) { return reinterpret_cast<KKPType*>(&kkps) + i; }
     KKType* oneArrayKK(const u64 i) { return reinterpret_cast<KKType*>(&kks) + i; }
+    // kpps, kkps, kks の要素の型が全て同じ時は、隙間無く並んでいるので、まとめて一つの一次元配列として扱える。
+    KPPType* oneArray(const u64 i) {
+        static_assert(std::is_same<KPPType, KKPType>::value && std::is_same<KPPType, KKType>::value, "");
+        return reinterpret_cast<KPPType*>(&kpps) + i;
+    }
+    constexpr size_t oneArraySize() const { return kpps_end_index() + kkps_end_index() + kks_end_index(); }
 
     // todo: これらややこしいし汚いので使わないようにする。
     //       型によっては kkps_begin_index などの値が異なる。
@@ -388,11 +394,66 @@ template <typename KPPType, typename KKPType, typename KKType> struct EvaluatorB
 using KPPType = std::array<s16, 2>;
 using KKPType = std::array<s16, 2>;
 using KKType = std::array<s16, 2>;
+
+// 探索で使う評価関数のテーブルの世代。テーブルを書き換えたら進める。
+// 評価関数のテーブルから計算した値を保持しているキャッシュは、世代が変わったら使わない。
+extern std::atomic<u32> g_evalGeneration;
+
+// 合成後の評価関数のテーブル。
+struct SynthesizedEvalTable {
+    KPPType KPP[SquareNum][fe_end][fe_end];
+    KKPType KKP[SquareNum][SquareNum][fe_end];
+    KKType KK[SquareNum][SquareNum];
+};
+
+// 合成後の KPP の要素を 1 byte に量子化したもの。
+// 要素の値は KPP[ksq][i][j] * 2^KPPShift[ksq][i] で、(玉の位置, 駒) の行ごとに倍率を持つ。
+// KPP[ksq][i][j] と KPP[ksq][j][i] は同じ値を表すので、差分計算と全計算の結果は一致する。
+struct QuantizedKPPTable {
+    using EntryType = std::array<s8, 2>;
+    using ShiftType = std::array<u8, 2>;
+
+    EntryType KPP[SquareNum][fe_end][fe_end];
+    ShiftType KPPShift[SquareNum][fe_end];
+
+    void quantize(const KPPType (&kpp)[SquareNum][fe_end][fe_end]);
+    // KPP_int8.bin, KPP_int8_shift.bin を読み書きする。
+    bool read(const std::string& dirName);
+    bool write(const std::string& dirName) const;
+    // KPP_int8.bin, KPP_int8_shift.bin を消す。量子化前の KPP_synthesized.bin を書き換えた時に、古い量子化結果を使わないようにする。
+    static void remove(const std::string& dirName);
+};
+
+#if defined EVAL_KPP_INT8
+// 探索で使う評価関数のテーブル。KKP, KK は量子化しない。
+struct SearchEvalTable : public QuantizedKPPTable {
+    KKPType KKP[SquareNum][SquareNum][fe_end];
+    KKType KK[SquareNum][SquareNum];
+};
+using SearchKPPType = QuantizedKPPTable::EntryType;
+#else
+using SearchEvalTable = SynthesizedEvalTable;
+using SearchKPPType = KPPType;
+#endif
+
 struct Evaluator : public EvaluatorBase<KPPType, KKPType, KKType> {
     using Base = EvaluatorBase<KPPType, KKPType, KKType>;
-    static KPPType KPP[SquareNum][fe_end][fe_end];
-    static KKPType KKP[SquareNum][SquareNum][fe_end];
-    static KKType KK[SquareNum][SquareNum];
+    // 探索で使っている table() の KPP, KKP, KK を指す。
+    // 探索中は指す先を変えないので、評価関数を入れ替える時は使っていない方のテーブルに読み込んでおき、探索の合間に switchTable() で切り替える。
+    static SearchKPPType (*KPP)[fe_end][fe_end];
+#if defined EVAL_KPP_INT8
+    static QuantizedKPPTable::ShiftType (*KPPShift)[fe_end];
+#endif
+    static KKPType (*KKP)[SquareNum][fe_end];
+    static KKType (*KK)[SquareNum];
+
+    static SearchEvalTable& table() { return *table_; }
+    // dirName の評価関数を、探索で使っていない方のテーブルに読み込む。探索中に呼んでも良い。
+    // 読み込めれば次の switchTable() で切り替わる。ファイルが足りなければ false を返す。
+    static bool loadSpareTable(const std::string& dirName);
+    // loadSpareTable() で読み込んだテーブルがあれば、それを探索で使うように切り替えて true を返す。
+    // 評価関数のハッシュテーブルも消して世代を進める。探索していない時に呼ぶこと。
+    static bool switchTable();
 
     static std::string addSlashIfNone(const std::string& str) {
         std::string ret = str;
@@ -403,7 +464,7 @@ struct Evaluator : public EvaluatorBase<KPPType, KKPType, KKType> {
         return ret;
     }
 
-    void setEvaluate() {
+    void setEvaluate(SynthesizedEvalTable& table) {
 #if !defined LEARN
         SYNCCOUT << "info string start setting eval table" << SYNCENDL;
 #endif
@@ -438,7 +499,7 @@ struct Evaluator : public EvaluatorBase<KPPType, KKPType, KKType> {
                         EvaluatorBase<KPPType, KKPType, KKType>::kppIndices(indices, static_cast<Square>(ksq), i, j);
                         std::array<s64, 2> sum = {{}};
                         FOO(indices, Base::oneArrayKPP, sum);
-                        KPP[ksq][i][j] += sum;
+                        table.KPP[ksq][i][j] += sum;
                     }
                 }
             }
@@ -455,7 +516,7 @@ struct Evaluator : public EvaluatorBase<KPPType, KKPType, KKType> {
                         EvaluatorBase<KPPType, KKPType, KKType>::kkpIndices(indices, static_cast<Square>(ksq0), ksq1, i);
                         std::array<s64, 2> sum = {{}};
                         FOO(indices, Base::oneArrayKKP, sum);
-                        KKP[ksq0][ksq1][i] += sum;
+                        table.KKP[ksq0][ksq1][i] += sum;
                     }
                 }
             }
@@ -471,8 +532,8 @@ struct Evaluator : public EvaluatorBase<KPPType, KKPType, KKType> {
                     EvaluatorBase<KPPType, KKPType, KKType>::kkIndices(indices, static_cast<Square>(ksq0), ksq1);
                     std::array<s64, 2> sum = {{}};
                     FOO(indices, Base::oneArrayKK, sum);
-                    KK[ksq0][ksq1][0] += sum[0] / 2;
-                    KK[ksq0][ksq1][1] += sum[1] / 2;
+                    table.KK[ksq0][ksq1][0] += sum[0] / 2;
+                    table.KK[ksq0][ksq1][1] += sum[1] / 2;
                 }
             }
         }
@@ -484,60 +545,101 @@ struct Evaluator : public EvaluatorBase<KPPType, KKPType, KKType> {
     }
 
     void init(const std::string& dirName, const bool Synthesized, const bool readBase = true) {
+        synthesize(dirName, table(), Synthesized, readBase);
+        ++g_evalGeneration;
+    }
+    // dirName の評価関数から table を作る。readBase でなければ今持っている次元下げした評価関数を使う。
+    // readBase で次元下げした評価関数のファイルが足りなければ false を返す。
+    bool synthesize(const std::string& dirName, SynthesizedEvalTable& table, const bool Synthesized, const bool readBase) {
         // 合成された評価関数バイナリがあればそちらを使う。
-        if (Synthesized) {
-            if (readSynthesized(dirName))
-                return;
-        }
+        if (Synthesized && readSynthesized(dirName, table))
+            return true;
         if (readBase)
             clear();
-        readSomeSynthesized(dirName);
-        if (readBase)
-            read(dirName);
-        setEvaluate();
+        readSomeSynthesized(dirName, table);
+        const bool ok = (!readBase || read(dirName));
+        setEvaluate(table);
+        return ok;
+    }
+#if defined EVAL_KPP_INT8
+    // 量子化した KPP が無ければ、合成後の評価関数を作ってから量子化する。
+    bool synthesize(const std::string& dirName, SearchEvalTable& table, const bool Synthesized, const bool readBase) {
+        if (Synthesized && readSynthesized(dirName, table))
+            return true;
+        std::unique_ptr<SynthesizedEvalTable> synthesized(new SynthesizedEvalTable);
+        const bool ok = synthesize(dirName, *synthesized, Synthesized, readBase);
+        table.quantize(synthesized->KPP);
+        memcpy(table.KKP, synthesized->KKP, sizeof(table.KKP));
+        memcpy(table.KK, synthesized->KK, sizeof(table.KK));
+        return ok;
     }
+#endif
 
 #define ALL_SYNTHESIZED_EVAL {                  \
         FOO(KPP);                               \
         FOO(KKP);                               \
         FOO(KK);                                \
     }
-    static bool readSynthesized(const std::string& dirName) {
+    static bool readSynthesized(const std::string& dirName, SynthesizedEvalTable& table) {
 #define FOO(x) {                                                        \
             std::ifstream ifs((addSlashIfNone(dirName) + #x "_synthesized.bin").c_str(), std::ios::binary); \
-            if (ifs) ifs.read(reinterpret_cast<char*>(x), sizeof(x));   \
+            if (ifs) ifs.read(reinterpret_cast<char*>(table.x), sizeof(table.x)); \
             else     return false;                                      \
         }
         ALL_SYNTHESIZED_EVAL;
 #undef FOO
         return true;
     }
-    static void writeSynthesized(const std::string& dirName) {
-#define FOO(x) {                                                        \
-            std::ofstream ofs((addSlashIfNone(dirName) + #x "_synthesized.bin").c_str(), std::ios::binary); \
-            ofs.write(reinterpret_cast<char*>(x), sizeof(x));           \
-        }
+    static bool writeSynthesized(const std::string& dirName, const SynthesizedEvalTable& table) {
+        // 書き出す前に量子化した KPP を消しておけば、途中で落ちても EVAL_KPP_INT8 で古い KPP と新しい KKP, KK を組み合わせない。
+        // 量子化した KPP が無ければ、EVAL_KPP_INT8 では KPP_synthesized.bin を読み込んでから量子化する。
+        QuantizedKPPTable::remove(dirName);
+        bool ok = true;
+#define FOO(x) ok &= writeFileAtomically(addSlashIfNone(dirName) + #x "_synthesized.bin", table.x, sizeof(table.x))
         ALL_SYNTHESIZED_EVAL;
 #undef FOO
+        return ok;
     }
-    static void readSomeSynthesized(const std::string& dirName) {
+    static void readSomeSynthesized(const std::string& dirName, SynthesizedEvalTable& table) {
 #define FOO(x) {                                                        \
             std::ifstream ifs((addSlashIfNone(dirName) + #x "_some_synthesized.bin").c_str(), std::ios::binary); \
-            if (ifs) ifs.read(reinterpret_cast<char*>(x), sizeof(x));   \
-            else     memset(x, 0, sizeof(x));                           \
+            if (ifs) ifs.read(reinterpret_cast<char*>(table.x), sizeof(table.x)); \
+            else     memset(table.x, 0, sizeof(table.x));               \
         }
         ALL_SYNTHESIZED_EVAL;
 #undef FOO
     }
-    static void writeSomeSynthesized(const std::string& dirName) {
-#define FOO(x) {                                                        \
-            std::ofstream ofs((addSlashIfNone(dirName) + #x "_some_synthesized.bin").c_str(), std::ios::binary); \
-            ofs.write(reinterpret_cast<char*>(x), sizeof(x));           \
-        }
+    static bool writeSomeSynthesized(const std::string& dirName, const SynthesizedEvalTable& table) {
+        bool ok = true;
+#define FOO(x) ok &= writeFileAtomically(addSlashIfNone(dirName) + #x "_some_synthesized.bin", table.x, sizeof(table.x))
         ALL_SYNTHESIZED_EVAL;
 #undef FOO
+        return ok;
     }
 #undef ALL_SYNTHESIZED_EVAL
+#if defined EVAL_KPP_INT8
+    static bool readSynthesized(const std::string& dirName, SearchEvalTable& table) {
+        if (!table.QuantizedKPPTable::read(dirName))
+            return false;
+#define FOO(x) {                                                        \
+            std::ifstream ifs((addSlashIfNone(dirName) + #x "_synthesized.bin").c_str(), std::ios::binary); \
+            if (ifs) ifs.read(reinterpret_cast<char*>(table.x), sizeof(table.x)); \
+            else     return false;                                      \
+        }
+        FOO(KKP);
+        FOO(KK);
+#undef FOO
+        return true;
+    }
+    static bool writeSynthesized(const std::string& dirName, const SearchEvalTable& table) {
+        bool ok = table.QuantizedKPPTable::write(dirName);
+#define FOO(x) ok &= writeFileAtomically(addSlashIfNone(dirName) + #x "_synthesized.bin", table.x, sizeof(table.x))
+        FOO(KKP);
+        FOO(KK);
+#undef FOO
+        return ok;
+    }
+#endif
 
 #if defined EVAL_PHASE1
 #define BASE_PHASE1 {                           \
@@ -626,26 +728,48 @@ struct Evaluator : public EvaluatorBase<KPPType, KKPType, KKType> {
         BASE_PHASE4;                            \
         BASE_ONLINE;                            \
     }
-    void read(const std::string& dirName) {
+    // ファイルが無いか足りない要素があれば false を返す。
+    bool read(const std::string& dirName) {
+        bool ok = true;
 #define FOO(x) {                                                        \
             std::ifstream ifs((addSlashIfNone(dirName) + #x ".bin").c_str(), std::ios::binary); \
-            ifs.read(reinterpret_cast<char*>(x), sizeof(x));            \
+            ok &= static_cast<bool>(ifs.read(reinterpret_cast<char*>(x), sizeof(x))); \
         }
         READ_BASE_EVAL;
 #undef FOO
+        return ok;
     }
-    void write(const std::string& dirName) {
-#define FOO(x) {                                                        \
-            std::ofstream ofs((addSlashIfNone(dirName) + #x ".bin").c_str(), std::ios::binary); \
-            ofs.write(reinterpret_cast<char*>(x), sizeof(x));           \
-        }
+    bool write(const std::string& dirName) const {
+        bool ok = true;
+#define FOO(x) ok &= writeFileAtomically(addSlashIfNone(dirName) + #x ".bin", x, sizeof(x))
         WRITE_BASE_EVAL;
 #undef FOO
+        return ok;
     }
 #undef READ_BASE_EVAL
 #undef WRITE_BASE_EVAL
+
+private:
+    static SearchEvalTable* table_;
 };
 
+// KPP[ksq][i] の行の要素を足し合わせた rowSum を、評価値の単位に直す。
+inline std::array<s32, 2> kppRowSum(const Square ksq, const int i, const std::array<s32, 2>& rowSum) {
+#if defined EVAL_KPP_INT8
+    const auto& shift = Evaluator::KPPShift[ksq][i];
+    return {{rowSum[0] * (1 << shift[0]), rowSum[1] * (1 << shift[1])}};
+#else
+    (void)ksq;
+    (void)i;
+    return rowSum;
+#endif
+}
+// KPP の要素 1 つの値
+inline std::array<s32, 2> kppValue(const Square ksq, const int i, const int j) {
+    const auto& kpp = Evaluator::KPP[ksq][i][j];
+    return kppRowSum(ksq, i, {{kpp[0], kpp[1]}});
+}
+
 extern const int kppArray[31];
 extern const int kkpArray[15];
 extern const int kppHandArray[ColorNum][HandPieceNum];
@@ -745,10 +869,46 @@ const size_t EvaluateTableSize = 0x400000; // 134MB
 //const size_t EvaluateTableSize = 0x20000000; // 17GB
 
 using EvaluateHashEntry = EvalSum;
-struct EvaluateHashTable : HashTable<EvaluateHashEntry, EvaluateTableSize> {};
+struct EvaluateHashTable : HashTable<EvaluateHashEntry, EvaluateTableSize> {
+    // 評価関数のテーブルを書き換えた時に呼ばれるので、世代も進める。
+    void clear() {
+        HashTable<EvaluateHashEntry, EvaluateTableSize>::clear();
+        ++g_evalGeneration;
+    }
+    // 世代を進めて、これまでの要素を使わないようにする。
+    // 要素の key には世代を混ぜてあるので、clear() と違ってテーブルを書き換えず、探索中に呼んでも良い。
+    void invalidate() { ++g_evalGeneration; }
+    // 要素に入れる key。局面の key に世代を混ぜる。
+    static Key entryKey(const Key keyExcludeTurn) {
+        return keyExcludeTurn ^ (g_evalGeneration.load(std::memory_order_relaxed) * UINT64_C(0x9e3779b97f4a7c15));
+    }
+};
 extern EvaluateHashTable g_evalTable;
 
+// 玉が動いた時の KPP の和を差分計算する為に、玉の位置ごとに前回計算した駒リストと KPP の和を持っておく。
+// 同じ位置に玉が戻った時は、駒リストの変化した要素の分だけ計算し直せば良い。
+// 駒リストの添字は駒ごとに固定なので、添字ごとに比較して変化した要素を見つける。
+// スレッドごとに持つ。
+struct KingKPPCache {
+    struct Entry {
+        u32 generation; // g_evalGeneration と一致しなければ無効
+        std::array<s32, 2> sum;
+        u16 list[EvalList::ListSize];
+    };
+    static_assert(fe_end <= std::numeric_limits<u16>::max(), "");
+
+    KingKPPCache() { clear(); }
+    void clear() { memset(entries, 0, sizeof(entries)); }
+    // 先手玉は list0 と玉の位置、後手玉は list1 と玉の位置を反転したもので引く。
+    Entry entries[ColorNum][SquareNum];
+};
+
 Score evaluateUnUseDiff(const Position& pos);
 Score evaluate(Position& pos, SearchStack* ss);
+// num 局面の差分計算を使わない評価値の内訳を sums に書き込む。評価値は sums[i].sum(positions[i].turn()) / FVScale で得られる。
+// 学習や局面の一括解析の為に、evaluate() と違って SearchStack も評価関数のハッシュテーブルも使わない。
+// KPP は玉の位置ごとに局面をまとめて計算するので、同じ玉の位置の KPP のテーブルを続けて引く。
+// AVX2 が使える場合は、同じ玉の位置の 8 局面ずつ、KPP の要素を gather して同時に足し込む。
+void evaluateBatch(const Position positions[], const size_t num, EvalSum sums[]);
 
 #endif // #ifndef APERY_EVALUATE_HPP
@@ -56,6 +56,24 @@
 #endif
 #endif
 
+#if 0 && !defined LEARN
+// 探索で使う KPP を 1 byte に量子化して、テーブルのメモリと帯域を半分にする。
+// (玉の位置, 駒) の行ごとに 2 のべき乗の倍率を持つ。KKP, KK は s16 のまま。
+// 量子化したファイル (KPP_int8.bin, KPP_int8_shift.bin) が無ければ、読み込む時に量子化する。
+// 誤差は quantize_eval コマンドで確認出来る。
+#define EVAL_KPP_INT8
+#endif
+#if defined EVAL_KPP_INT8 && defined LEARN
+#error "EVAL_KPP_INT8 cannot be used with LEARN"
+#endif
+
+#if 0
+// 各マスに利いている駒の数を StateInfo に持ち、doMove() で差分更新する。
+// 1 手詰め判定などの attackersToIsAny() と、駒打ちの SEE がこれを引くようになる。
+// 差分更新の分だけ doMove() が重くなり、手元では NPS が 1 割ほど下がったので無効にしてある。
+#define USE_ATTACK_MAP
+#endif
+
 #if 1
 // 定跡作成時に探索を用いて定跡に点数を付ける。
 #define MAKE_SEARCHED_BOOK
@@ -94,4 +112,13 @@
 #define FIND_MAGIC
 #endif
 
+#if 0
+// use_teacher で gradient やパラメータを保持する配列を double ではなく float にしてメモリを半分にする。
+// 丸めは確率的に行うので、小さな値を足し続けても期待値は変わらない。
+#define LEARN_STORAGE_FLOAT
+#elif 0
+// 上に加えて、AdaGrad の二乗和を bfloat16 で保持する。
+#define LEARN_STORAGE_BF16
+#endif
+
 #endif // #ifndef APERY_IFDEF_HPP
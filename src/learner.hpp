@@ -34,6 +34,133 @@
 #define PRINT_PV(x)
 #endif
 
+// 上位 16bit だけを残した float。AdaGrad の二乗和のように、相対誤差が大きくても問題ない値を保持する為に使う。
+struct BFloat16 {
+    u16 bits;
+    operator float() const {
+        const u32 u = static_cast<u32>(bits) << 16;
+        float f;
+        memcpy(&f, &u, sizeof(f));
+        return f;
+    }
+};
+
+// 確率的丸め用の乱数。スレッドごとに独立した xorshift64*
+inline u64 stochasticRoundingRandom() {
+    static std::atomic<u64> seed(UINT64_C(0x9e3779b97f4a7c15));
+    thread_local u64 state = seed.fetch_add(UINT64_C(0x9e3779b97f4a7c15)) | 1;
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * UINT64_C(2685821657736338717);
+}
+// x を T 型に丸める。T で表せない分は、近い方の値との距離に応じた確率で切り上げるか切り捨てるので、期待値は x になる。
+template <typename T> inline T roundStochastically(const double x);
+template <> inline double roundStochastically<double>(const double x) { return x; }
+template <> inline float roundStochastically<float>(const double x) {
+    float lo = static_cast<float>(x);
+    float hi;
+    if (x < lo) {
+        hi = lo;
+        lo = std::nextafter(lo, -std::numeric_limits<float>::infinity());
+    }
+    else
+        hi = std::nextafter(lo, std::numeric_limits<float>::infinity());
+    if (!(lo < hi) || x <= lo)
+        return lo;
+    const double p = (x - lo) / (static_cast<double>(hi) - lo);
+    return (static_cast<double>(stochasticRoundingRandom() >> 11) * (1.0 / (UINT64_C(1) << 53)) < p ? hi : lo);
+}
+template <> inline BFloat16 roundStochastically<BFloat16>(const double x) {
+    const float f = static_cast<float>(x);
+    u32 u;
+    memcpy(&u, &f, sizeof(u));
+    // 切り捨てる下位 16bit に乱数を足してから切り捨てる。
+    if ((u & 0x7f800000) != 0x7f800000) // inf, nan はそのまま
+        u += static_cast<u32>(stochasticRoundingRandom() >> 48);
+    return BFloat16{static_cast<u16>(u >> 16)};
+}
+
+#if defined HAVE_AVX2
+// double, float, BFloat16 の配列から 4 つ読み込んで double に直す。
+inline __m256d loadAsDouble4(const double* p) { return _mm256_loadu_pd(p); }
+inline __m256d loadAsDouble4(const float* p) { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+inline __m256d loadAsDouble4(const BFloat16* p) {
+    const __m128i u = _mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)));
+    return _mm256_cvtps_pd(_mm_castsi128_ps(_mm_slli_epi32(u, 16)));
+}
+template <typename T> inline __m256d loadAsDouble4(const std::atomic<T>* p) {
+    static_assert(sizeof(std::atomic<T>) == sizeof(T), "");
+    return loadAsDouble4(reinterpret_cast<const T*>(p));
+}
+
+// roundStochastically() を double 4 つずつまとめて行う。
+// 乱数は xorshift128+ を 4 本並べたもの。スレッドごとに作って使うこと。
+class StochasticRounder4 {
+public:
+    StochasticRounder4() {
+        alignas(32) u64 seeds[8];
+        for (auto& seed : seeds)
+            seed = stochasticRoundingRandom() | 1;
+        s0_ = _mm256_load_si256(reinterpret_cast<const __m256i*>(&seeds[0]));
+        s1_ = _mm256_load_si256(reinterpret_cast<const __m256i*>(&seeds[4]));
+    }
+    // x を丸めて p に 4 つ書き込み、書き込んだ値を返す。
+    __m256d store(double* p, const __m256d x) {
+        _mm256_storeu_pd(p, x);
+        return x;
+    }
+    __m256d store(float* p, const __m256d x) {
+        // float で表せない double の仮数部の下位 29bit に乱数を足してから切り捨てる。inf, nan はそのまま
+        constexpr int TruncatedBits = 52 - 23;
+        const __m256i expMask = _mm256_set1_epi64x(INT64_C(0x7ff0000000000000));
+        const __m256i u = _mm256_castpd_si256(x);
+        const __m256i finite = _mm256_xor_si256(_mm256_cmpeq_epi64(_mm256_and_si256(u, expMask), expMask), _mm256_set1_epi64x(-1));
+        const __m256i r = _mm256_srli_epi64(next(), 64 - TruncatedBits);
+        const __m256i truncated = _mm256_andnot_si256(_mm256_set1_epi64x((INT64_C(1) << TruncatedBits) - 1), _mm256_add_epi64(u, r));
+        const __m128 f = _mm256_cvtpd_ps(_mm256_castsi256_pd(_mm256_blendv_epi8(u, truncated, finite)));
+        _mm_storeu_ps(p, f);
+        return _mm256_cvtps_pd(f);
+    }
+    __m256d store(BFloat16* p, const __m256d x) {
+        // roundStochastically<BFloat16>() と同じく、float の下位 16bit に乱数を足してから切り捨てる。
+        const __m128i expMask = _mm_set1_epi32(0x7f800000);
+        const __m128i u = _mm_castps_si128(_mm256_cvtpd_ps(x));
+        const __m128i finite = _mm_xor_si128(_mm_cmpeq_epi32(_mm_and_si128(u, expMask), expMask), _mm_set1_epi32(-1));
+        const __m128i r = _mm_and_si128(_mm_srli_epi32(_mm256_castsi256_si128(next()), 16), finite);
+        const __m128i bits = _mm_srli_epi32(_mm_add_epi32(u, r), 16);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_packus_epi32(bits, bits));
+        return _mm256_cvtps_pd(_mm_castsi128_ps(_mm_slli_epi32(bits, 16)));
+    }
+
+private:
+    __m256i next() {
+        __m256i x = s0_;
+        const __m256i y = s1_;
+        s0_ = y;
+        x = _mm256_xor_si256(x, _mm256_slli_epi64(x, 23));
+        s1_ = _mm256_xor_si256(_mm256_xor_si256(x, y), _mm256_xor_si256(_mm256_srli_epi64(x, 17), _mm256_srli_epi64(y, 26)));
+        return _mm256_add_epi64(s1_, y);
+    }
+
+    __m256i s0_;
+    __m256i s1_;
+};
+#endif
+
+// use_teacher で gradient, パラメータを保持する型。ifdef.hpp の LEARN_STORAGE_FLOAT, LEARN_STORAGE_BF16 で選ぶ。
+#if defined LEARN_STORAGE_FLOAT || defined LEARN_STORAGE_BF16
+using LearnFloat = float;
+#else
+using LearnFloat = double;
+#endif
+// AdaGrad の二乗和を保持する型
+#if defined LEARN_STORAGE_BF16
+using LearnMeanSquareFloat = BFloat16;
+#else
+using LearnMeanSquareFloat = LearnFloat;
+#endif
+
 struct EvaluatorGradient {
     std::array<float, 2> kpp_grad[SquareNum][fe_end][fe_end];
     std::array<float, 2> kkp_grad[SquareNum][SquareNum][fe_end];
@@ -95,6 +222,206 @@ struct TriangularEvaluatorGradient {
     void clear() { memset(this, 0, sizeof(*this)); } // double 型とかだと規格的に 0 は保証されなかった気がするが実用上問題ないだろう。
 };
 
+// TriangularEvaluatorGradient と同じ値を、触れた部分だけ確保して保持するもの。
+// 1 イテレーション分の教師局面では KPP の一部にしか触れないので、メモリ使用量と集約、次元下げの時間を抑えられる。
+// KPP は (ksq, i) ごと、KKP は (sq_bk, sq_wk) ごとの行を BlockSize 要素のブロックに分け、初めて触れた時にブロックを確保する。
+// KPP は j <= i の三角部分のみ使う。KK は小さいので全て確保しておく。
+struct SparseEvaluatorGradient {
+    static const int BlockSize = 16;
+    static const int RowBlockNum = (fe_end + BlockSize - 1) / BlockSize;
+    static const u32 KPPRowNum = static_cast<u32>(SquareNum) * fe_end;
+    static const u32 KKPRowNum = static_cast<u32>(SquareNum) * static_cast<u32>(SquareNum);
+    using Element = std::array<LearnFloat, 2>;
+    using Block = std::array<Element, BlockSize>;
+
+    SparseEvaluatorGradient() : pageIdx_(0), pageUsed_(0) {
+        memset(kppRows_, 0, sizeof(kppRows_));
+        memset(kkpRows_, 0, sizeof(kkpRows_));
+        memset(kk_grad, 0, sizeof(kk_grad));
+    }
+
+    Element& kpp(const Square ksq, int i, int j) {
+        if (i < j) std::swap(i, j);
+        return element(kppRows_, kppTouched_, static_cast<u32>(ksq) * fe_end + i, j);
+    }
+    Element& kkp(const Square sq_bk, const Square sq_wk, const int i) {
+        return element(kkpRows_, kkpTouched_, static_cast<u32>(sq_bk) * static_cast<u32>(SquareNum) + static_cast<u32>(sq_wk), i);
+    }
+
+    void incParam(const Position& pos, const std::array<double, 2>& dinc) {
+        const Square sq_bk = pos.kingSquare(Black);
+        const Square sq_wk = pos.kingSquare(White);
+        const Square sq_wki = inverse(sq_wk);
+        const int* list0 = pos.cplist0();
+        const int* list1 = pos.cplist1();
+        const std::array<double, 2> f = {{dinc[0] / FVScale, dinc[1] / FVScale}};
+        // double 以外で保持する場合、小さな値を足した時に消えてしまわないように確率的に丸める。
+        auto add = [](Element& e, const double f0, const double f1) {
+            e[0] = roundStochastically<LearnFloat>(e[0] + f0);
+            e[1] = roundStochastically<LearnFloat>(e[1] + f1);
+        };
+
+        add(kk_grad[sq_bk][sq_wk], f[0], f[1]);
+        for (int i = 0; i < pos.nlist(); ++i) {
+            const int k0 = list0[i];
+            const int k1 = list1[i];
+            for (int j = 0; j < i; ++j) {
+                const int l0 = list0[j];
+                const int l1 = list1[j];
+                add(kpp(sq_bk, k0, l0), f[0], f[1]);
+                add(kpp(sq_wki, k1, l1), -f[0], f[1]);
+            }
+            add(kkp(sq_bk, sq_wk, k0), f[0], f[1]);
+        }
+    }
+
+    // 全て 0 に戻す。確保した領域は解放せずに再利用する。
+    void clear() {
+        for (const u32 idx : kppTouched_)
+            kppRows_[idx / RowBlockNum] = nullptr;
+        for (const u32 idx : kkpTouched_)
+            kkpRows_[idx / RowBlockNum] = nullptr;
+        kppTouched_.clear();
+        kkpTouched_.clear();
+        memset(kk_grad, 0, sizeof(kk_grad));
+        pageIdx_ = 0;
+        pageUsed_ = 0;
+    }
+    // 確保している領域の大きさ [byte]
+    size_t allocatedBytes() const { return pages_.size() * PageSize; }
+
+    // 触れたブロックの一覧。ブロックの通し番号は 行の番号 * RowBlockNum + 列 / BlockSize
+    // KPP の行の番号は ksq * fe_end + i, KKP の行の番号は sq_bk * SquareNum + sq_wk
+    const std::vector<u32>& kppTouched() const { return kppTouched_; }
+    const std::vector<u32>& kkpTouched() const { return kkpTouched_; }
+    const Block& kppBlock(const u32 idx) const { return *kppRows_[idx / RowBlockNum][idx % RowBlockNum]; }
+    const Block& kkpBlock(const u32 idx) const { return *kkpRows_[idx / RowBlockNum][idx % RowBlockNum]; }
+
+    SparseEvaluatorGradient& operator += (const SparseEvaluatorGradient& rhs) {
+        for (const u32 idx : rhs.kppTouched_)
+            addBlock(kppRows_, kppTouched_, idx, rhs.kppBlock(idx));
+        for (const u32 idx : rhs.kkpTouched_)
+            addBlock(kkpRows_, kkpTouched_, idx, rhs.kkpBlock(idx));
+        const Element* rit = &(** std::begin(rhs.kk_grad));
+        for (auto lit = &(** std::begin(kk_grad)); lit != &(** std::end(kk_grad)); ++lit, ++rit)
+            *lit += *rit;
+        return *this;
+    }
+
+    // 触れた部分だけをバイト列にする。別のプロセスに送って集約する為のもの。
+    // [KPP のブロック数 (u32)][KKP のブロック数 (u32)][kk_grad][KPP のブロックの通し番号 ...][KKP のブロックの通し番号 ...][KPP のブロック ...][KKP のブロック ...]
+    void serialize(std::vector<u8>& buffer) const {
+        const u32 kppNum = static_cast<u32>(kppTouched_.size());
+        const u32 kkpNum = static_cast<u32>(kkpTouched_.size());
+        buffer.resize(serializedSize(kppNum, kkpNum));
+        u8* p = buffer.data();
+        auto put = [&p](const void* src, const size_t size) {
+            memcpy(p, src, size);
+            p += size;
+        };
+        put(&kppNum, sizeof(kppNum));
+        put(&kkpNum, sizeof(kkpNum));
+        put(kk_grad, sizeof(kk_grad));
+        put(kppTouched_.data(), sizeof(u32) * kppNum);
+        put(kkpTouched_.data(), sizeof(u32) * kkpNum);
+        for (const u32 idx : kppTouched_)
+            put(&kppBlock(idx), sizeof(Block));
+        for (const u32 idx : kkpTouched_)
+            put(&kkpBlock(idx), sizeof(Block));
+    }
+    // serialize() したものを足し込む。壊れていれば false を返す。
+    bool addSerialized(const u8* data, const size_t size) {
+        u32 kppNum, kkpNum;
+        if (size < sizeof(kppNum) + sizeof(kkpNum))
+            return false;
+        memcpy(&kppNum, data, sizeof(kppNum));
+        memcpy(&kkpNum, data + sizeof(kppNum), sizeof(kkpNum));
+        if (size != serializedSize(kppNum, kkpNum))
+            return false;
+        const u8* p = data + sizeof(kppNum) + sizeof(kkpNum);
+        Element kk[SquareNum][SquareNum];
+        memcpy(kk, p, sizeof(kk));
+        p += sizeof(kk);
+        const u8* kppIndices = p;
+        const u8* kkpIndices = kppIndices + sizeof(u32) * kppNum;
+        const u8* blocks = kkpIndices + sizeof(u32) * kkpNum;
+        // 先に全ての通し番号を確かめておき、途中まで足し込んだ状態で失敗しないようにする。
+        for (u32 n = 0; n < kppNum + kkpNum; ++n) {
+            u32 idx;
+            memcpy(&idx, kppIndices + sizeof(u32) * n, sizeof(idx));
+            if ((n < kppNum ? KPPRowNum : KKPRowNum) * RowBlockNum <= idx)
+                return false;
+        }
+        for (u32 n = 0; n < kppNum + kkpNum; ++n, blocks += sizeof(Block)) {
+            u32 idx;
+            memcpy(&idx, kppIndices + sizeof(u32) * n, sizeof(idx));
+            Block block;
+            memcpy(&block, blocks, sizeof(Block));
+            if (n < kppNum)
+                addBlock(kppRows_, kppTouched_, idx, block);
+            else
+                addBlock(kkpRows_, kkpTouched_, idx, block);
+        }
+        for (int i = 0; i < SquareNum * SquareNum; ++i)
+            (&(** std::begin(kk_grad)))[i] += (&(** std::begin(kk)))[i];
+        return true;
+    }
+    static size_t serializedSize(const u32 kppNum, const u32 kkpNum) {
+        return sizeof(u32) * 2 + sizeof(kk_grad) + (sizeof(u32) + sizeof(Block)) * (static_cast<size_t>(kppNum) + kkpNum);
+    }
+    // 全てのブロックに触れた時の serialize() の大きさ。受け取るメッセージの大きさの上限に使う。
+    static size_t maxSerializedSize() {
+        return serializedSize(KPPRowNum * RowBlockNum, KKPRowNum * RowBlockNum);
+    }
+
+    Element kk_grad[SquareNum][SquareNum];
+
+private:
+    using Row = Block*; // 行は RowBlockNum 個のブロックへのポインタの配列
+    static const size_t PageSize = 1 << 22;
+
+    Element& element(Row* rows[], std::vector<u32>& touched, const u32 rowIdx, const int j) {
+        Row*& row = rows[rowIdx];
+        if (row == nullptr)
+            row = allocate<Row>(RowBlockNum);
+        Block*& block = row[j / BlockSize];
+        if (block == nullptr) {
+            block = allocate<Block>(1);
+            touched.push_back(rowIdx * RowBlockNum + j / BlockSize);
+        }
+        return (*block)[j % BlockSize];
+    }
+    void addBlock(Row* rows[], std::vector<u32>& touched, const u32 idx, const Block& rhs) {
+        Element* lhs = &element(rows, touched, idx / RowBlockNum, (idx % RowBlockNum) * BlockSize); // ブロックの先頭
+        for (int i = 0; i < BlockSize; ++i)
+            lhs[i] += rhs[i];
+    }
+    // 0 で埋めた T の配列を確保する。
+    template <typename T> T* allocate(const size_t num) {
+        const size_t size = sizeof(T) * num;
+        static_assert(sizeof(T) % alignof(T) == 0 && alignof(T) <= 8, "");
+        assert(size <= PageSize);
+        if (PageSize < pageUsed_ + size) {
+            ++pageIdx_;
+            pageUsed_ = 0;
+        }
+        if (pageIdx_ == pages_.size())
+            pages_.emplace_back(new u64[PageSize / sizeof(u64)]);
+        T* p = reinterpret_cast<T*>(reinterpret_cast<u8*>(pages_[pageIdx_].get()) + pageUsed_);
+        pageUsed_ += (size + 7) & ~static_cast<size_t>(7);
+        memset(p, 0, size);
+        return p;
+    }
+
+    Row* kppRows_[KPPRowNum];
+    Row* kkpRows_[KKPRowNum];
+    std::vector<u32> kppTouched_;
+    std::vector<u32> kkpTouched_;
+    std::vector<std::unique_ptr<u64[]> > pages_;
+    size_t pageIdx_;
+    size_t pageUsed_;
+};
+
 // float, double 型の atomic 加算。T は float, double を想定。
 template <typename T>
 inline T atomicAdd(std::atomic<T> &x, const T diff) {
@@ -107,6 +434,18 @@ inline T atomicAdd(std::atomic<T> &x, const T diff) {
 // float, double 型の atomic 減算
 template <typename T>
 inline T atomicSub(std::atomic<T> &x, const T diff) { return atomicAdd(x, -diff); }
+// atomic 加算の結果を確率的に丸めて格納する。double なら通常の atomic 加算と同じ。
+inline void atomicAddStochastically(std::atomic<double>& x, const double diff) { atomicAdd(x, diff); }
+inline void atomicAddStochastically(std::atomic<float>& x, const double diff) {
+    float old = x.load(std::memory_order_consume);
+    while (!x.compare_exchange_weak(old, roundStochastically<float>(old + diff), std::memory_order_release, std::memory_order_consume))
+        ;
+}
+
+// use_teacher で低次元の要素ごとに gradient を集める型
+using LowerDimensionedEvaluatorGradient = EvaluatorBase<std::array<std::atomic<LearnFloat>, 2>,
+                                                        std::array<std::atomic<LearnFloat>, 2>,
+                                                        std::array<std::atomic<LearnFloat>, 2> >;
 
 EvaluatorGradient& operator += (EvaluatorGradient& lhs, EvaluatorGradient& rhs) {
     for (auto lit = &(***std::begin(lhs.kpp_grad)), rit = &(***std::begin(rhs.kpp_grad)); lit != &(***std::end(lhs.kpp_grad)); ++lit, ++rit)
@@ -273,6 +612,156 @@ inline void lowerDimension(EvaluatorBase<std::array<std::atomic<double>, 2>,
 #undef FOO
 }
 
+// 低次元の要素のうち、gradient を与えたもののインデックスを重複無く集めたもの。KK は全て使うので集めない。
+class TouchedBaseIndices {
+public:
+    TouchedBaseIndices(const size_t kppNum, const size_t kkpNum) : kppFlags_(kppNum / 64 + 1), kkpFlags_(kkpNum / 64 + 1) {}
+
+    // 初めて印を付けたインデックスなら true を返す。複数スレッドから呼んで良い。
+    bool markKPP(const size_t index) { return mark(kppFlags_, index); }
+    bool markKKP(const size_t index) { return mark(kkpFlags_, index); }
+    void clear() {
+        for (const size_t index : kpp)
+            kppFlags_[index / 64] = 0;
+        for (const size_t index : kkp)
+            kkpFlags_[index / 64] = 0;
+        kpp.clear();
+        kkp.clear();
+    }
+
+    std::vector<size_t> kpp;
+    std::vector<size_t> kkp;
+
+private:
+    static bool mark(std::vector<std::atomic<u64> >& flags, const size_t index) {
+        const u64 bit = UINT64_C(1) << (index % 64);
+        return !(flags[index / 64].fetch_or(bit, std::memory_order_relaxed) & bit);
+    }
+
+    std::vector<std::atomic<u64> > kppFlags_;
+    std::vector<std::atomic<u64> > kkpFlags_;
+};
+
+// SparseEvaluatorGradient の触れた部分だけを低次元の要素に与える。
+// touched を渡すと、値を与えた KPP, KKP の低次元の要素のインデックスをそこに追加する。
+inline void lowerDimension(LowerDimensionedEvaluatorGradient& base, const SparseEvaluatorGradient& grad,
+                           TouchedBaseIndices* touched = nullptr)
+{
+#define FOO(indices, oneArray, sum, mark, localTouched)                 \
+    for (auto index : indices) {                                        \
+        if (index == std::numeric_limits<ptrdiff_t>::max()) break;      \
+        if (0 <= index) {                                               \
+            atomicAddStochastically((*oneArray( index))[0],  static_cast<double>(sum[0])); \
+            atomicAddStochastically((*oneArray( index))[1],  static_cast<double>(sum[1])); \
+        }                                                               \
+        else {                                                          \
+            atomicAddStochastically((*oneArray(-index))[0], -static_cast<double>(sum[0])); \
+            atomicAddStochastically((*oneArray(-index))[1],  static_cast<double>(sum[1])); \
+        }                                                               \
+        if (touched != nullptr && touched->mark(std::abs(index)))       \
+            localTouched.push_back(std::abs(index));                    \
+    }
+
+    const std::vector<u32>& kppTouched = grad.kppTouched();
+    const std::vector<u32>& kkpTouched = grad.kkpTouched();
+#if defined _OPENMP
+#pragma omp parallel
+#endif
+    {
+    std::vector<size_t> localTouchedKPP;
+    std::vector<size_t> localTouchedKKP;
+
+    // KPP
+    {
+        ptrdiff_t indices[KPPIndicesMax];
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 64)
+#endif
+        for (size_t n = 0; n < kppTouched.size(); ++n) {
+            const u32 idx = kppTouched[n];
+            const u32 rowIdx = idx / SparseEvaluatorGradient::RowBlockNum;
+            const int i = rowIdx % fe_end;
+            const Square ksq = static_cast<Square>(rowIdx / fe_end);
+            const int jbegin = (idx % SparseEvaluatorGradient::RowBlockNum) * SparseEvaluatorGradient::BlockSize;
+            const auto& block = grad.kppBlock(idx);
+            for (int j = jbegin; j <= std::min(i, jbegin + SparseEvaluatorGradient::BlockSize - 1); ++j) {
+                const auto& sum = block[j - jbegin];
+                if (sum[0] == 0.0 && sum[1] == 0.0)
+                    continue;
+                base.kppIndices(indices, ksq, i, j);
+                FOO(indices, base.oneArrayKPP, sum, markKPP, localTouchedKPP);
+            }
+        }
+    }
+    // KKP
+    {
+        ptrdiff_t indices[KKPIndicesMax];
+#ifdef _OPENMP
+#pragma omp for
+#endif
+        for (size_t n = 0; n < kkpTouched.size(); ++n) {
+            const u32 idx = kkpTouched[n];
+            const u32 rowIdx = idx / SparseEvaluatorGradient::RowBlockNum;
+            const Square ksq0 = static_cast<Square>(rowIdx / SquareNum);
+            const Square ksq1 = static_cast<Square>(rowIdx % SquareNum);
+            const int ibegin = (idx % SparseEvaluatorGradient::RowBlockNum) * SparseEvaluatorGradient::BlockSize;
+            const auto& block = grad.kkpBlock(idx);
+            for (int i = ibegin; i < std::min<int>(fe_end, ibegin + SparseEvaluatorGradient::BlockSize); ++i) {
+                const auto& sum = block[i - ibegin];
+                if (sum[0] == 0.0 && sum[1] == 0.0)
+                    continue;
+                base.kkpIndices(indices, ksq0, ksq1, i);
+                FOO(indices, base.oneArrayKKP, sum, markKKP, localTouchedKKP);
+            }
+        }
+    }
+    // KK
+    {
+#ifdef _OPENMP
+#pragma omp for
+#endif
+        for (int ksq0 = SQ11; ksq0 < SquareNum; ++ksq0) {
+            ptrdiff_t indices[KKIndicesMax];
+            for (Square ksq1 = SQ11; ksq1 < SquareNum; ++ksq1) {
+                base.kkIndices(indices, static_cast<Square>(ksq0), ksq1);
+                for (auto index : indices) {
+                    if (index == std::numeric_limits<ptrdiff_t>::max()) break;
+                    if (0 <= index) {
+                        atomicAddStochastically((*base.oneArrayKK( index))[0],  static_cast<double>(grad.kk_grad[ksq0][ksq1][0]));
+                        atomicAddStochastically((*base.oneArrayKK( index))[1],  static_cast<double>(grad.kk_grad[ksq0][ksq1][1]));
+                    }
+                    else {
+                        atomicAddStochastically((*base.oneArrayKK(-index))[0], -static_cast<double>(grad.kk_grad[ksq0][ksq1][0]));
+                        atomicAddStochastically((*base.oneArrayKK(-index))[1],  static_cast<double>(grad.kk_grad[ksq0][ksq1][1]));
+                    }
+                }
+            }
+        }
+    }
+    if (touched != nullptr) {
+#if defined _OPENMP
+#pragma omp critical
+#endif
+        {
+            touched->kpp.insert(std::end(touched->kpp), std::begin(localTouchedKPP), std::end(localTouchedKPP));
+            touched->kkp.insert(std::end(touched->kkp), std::begin(localTouchedKKP), std::end(localTouchedKKP));
+        }
+    }
+    }
+#undef FOO
+}
+
+// 複数スレッドで個別に保持していた gradient を、2 つずつ並列に足し合わせて grads[0] に集約する。
+inline void reduceGradients(std::vector<SparseEvaluatorGradient*>& grads) {
+    for (size_t stride = 1; stride < grads.size(); stride *= 2) {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i + stride < grads.size(); i += 2 * stride)
+            threads.emplace_back([&grads, i, stride] { *grads[i] += *grads[i + stride]; });
+        for (auto& th : threads)
+            th.join();
+    }
+}
+
 const Score FVWindow = static_cast<Score>(256);
 
 inline double sigmoid(const double x) {
@@ -304,6 +793,72 @@ inline void printEvalTable(const Square ksq, const int p0, const int p1_base, co
     fflush(stdout);
 }
 
+// use_teacher で教師局面から qsearch で辿った末端の局面を覚えておき、同じ教師局面を次に使う時に qsearch を省く為の表。
+// 末端の局面は評価関数の更新で少しずつ変わるので、maxUses 回使ったら次に使う時に qsearch し直す。
+// 教師局面の key で引く置換表と同じ形のもので、複数スレッドからロックを取らずに読み書きする。
+// 書き込み途中の entry を読んだ場合は check が合わないので、無かった事にする。
+class LeafCache {
+public:
+    struct Entry {
+        u64 check; // key と残りの要素から作る値。合わなければ空か別の局面か書き込み途中。
+        u32 uses;  // qsearch してから使った回数
+        u32 padding0;
+        HuffmanCodedPos leaf;
+        u8 padding1[16];
+    };
+    static_assert(sizeof(Entry) == 64, "");
+
+    void init(const size_t sizeMB, const u32 maxUses) {
+        entries_.assign(std::max<size_t>((sizeMB << 20) / sizeof(Entry), 1), Entry());
+        maxUses_ = maxUses;
+    }
+    bool enabled() const { return !entries_.empty(); }
+    // 使える末端の局面があれば leaf に書き込んで true を返す。
+    bool probe(const Key key, HuffmanCodedPos& leaf) {
+        Entry& slot = entries_[key % entries_.size()];
+        Entry entry = slot;
+        if (entry.check != makeCheck(key, entry) || maxUses_ <= entry.uses) {
+            ++misses_;
+            return false;
+        }
+        leaf = entry.leaf;
+        ++entry.uses;
+        entry.check = makeCheck(key, entry);
+        slot = entry;
+        ++hits_;
+        return true;
+    }
+    void store(const Key key, const HuffmanCodedPos& leaf) {
+        Entry entry = {};
+        entry.leaf = leaf;
+        entry.check = makeCheck(key, entry);
+        entries_[key % entries_.size()] = entry;
+    }
+    void* data() { return entries_.data(); }
+    size_t bytes() const { return entries_.size() * sizeof(Entry); }
+    // 前回呼んでからの probe() の成功率を返してリセットする。
+    double takeHitRate() {
+        const u64 hits = hits_.exchange(0);
+        const u64 misses = misses_.exchange(0);
+        return (hits + misses == 0 ? 0.0 : static_cast<double>(hits) / (hits + misses));
+    }
+
+private:
+    static u64 makeCheck(const Key key, const Entry& entry) {
+        u64 words[sizeof(HuffmanCodedPos) / sizeof(u64)];
+        memcpy(words, &entry.leaf, sizeof(words));
+        u64 check = key ^ (static_cast<u64>(entry.uses) * 0x9e3779b97f4a7c15ULL);
+        for (const u64 word : words)
+            check = (check ^ word) * 0xff51afd7ed558ccdULL;
+        return check;
+    }
+
+    std::vector<Entry> entries_;
+    u32 maxUses_ = 0;
+    std::atomic<u64> hits_{0};
+    std::atomic<u64> misses_{0};
+};
+
 struct Parse2Data {
     EvaluatorGradient params;
 
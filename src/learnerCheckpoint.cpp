@@ -0,0 +1,262 @@
+/*
+  Apery, a USI shogi playing engine derived from Stockfish, a UCI chess playing engine.
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+  Copyright (C) 2011-2017 Hiraoka Takuya
+
+  Apery is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Apery is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "learnerCheckpoint.hpp"
+
+#if !defined _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <cerrno>
+#endif
+
+const char LearnerCheckpointHeader::Magic[8] = {'A', 'P', 'C', 'K', 'P', 'T', '0', '1'};
+
+namespace {
+    u64 alignSection(const u64 offset) {
+        return (offset + LearnerCheckpointHeader::SectionAlignment - 1) / LearnerCheckpointHeader::SectionAlignment * LearnerCheckpointHeader::SectionAlignment;
+    }
+    bool checkHeader(const std::string& fileName, const LearnerCheckpointHeader& header, const u64 fileSize,
+                     const std::vector<LearnerCheckpointSection>& sections)
+    {
+        if (memcmp(header.magic, LearnerCheckpointHeader::Magic, sizeof(header.magic)) != 0
+            || header.version != LearnerCheckpointHeader::CurrentVersion)
+        {
+            std::cerr << "Error: " << fileName << " is not a checkpoint" << std::endl;
+            return false;
+        }
+        if (header.sectionNum != sections.size()) {
+            std::cerr << "Error: " << fileName << " has a different layout" << std::endl;
+            return false;
+        }
+        for (size_t i = 0; i < sections.size(); ++i) {
+            if (header.sectionSizes[i] != sections[i].size) {
+                std::cerr << "Error: " << fileName << " has a different layout" << std::endl;
+                return false;
+            }
+            if (fileSize < header.sectionOffsets[i] || fileSize - header.sectionOffsets[i] < header.sectionSizes[i]) {
+                std::cerr << "Error: " << fileName << " is truncated" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+bool writeLearnerCheckpoint(const std::string& fileName, LearnerCheckpointHeader& header,
+                            const std::vector<LearnerCheckpointSection>& sections)
+{
+    assert(sections.size() <= static_cast<size_t>(LearnerCheckpointHeader::MaxSectionNum));
+    memcpy(header.magic, LearnerCheckpointHeader::Magic, sizeof(header.magic));
+    header.version = LearnerCheckpointHeader::CurrentVersion;
+    header.sectionNum = static_cast<u32>(sections.size());
+    u64 offset = alignSection(sizeof(header));
+    for (size_t i = 0; i < sections.size(); ++i) {
+        header.sectionOffsets[i] = offset;
+        header.sectionSizes[i] = sections[i].size;
+        offset = alignSection(offset + sections[i].size);
+    }
+
+    const std::string tmpFileName = fileName + ".tmp";
+    {
+        std::ofstream ofs(tmpFileName.c_str(), std::ios::binary);
+        if (!ofs) {
+            std::cerr << "Error: cannot open " << tmpFileName << std::endl;
+            std::remove(tmpFileName.c_str());
+            return false;
+        }
+        ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (size_t i = 0; i < sections.size(); ++i) {
+            ofs.seekp(header.sectionOffsets[i]);
+            ofs.write(static_cast<const char*>(sections[i].data), sections[i].size);
+        }
+        ofs.close();
+        if (!ofs) {
+            std::cerr << "Error: cannot write " << tmpFileName << std::endl;
+            std::remove(tmpFileName.c_str());
+            return false;
+        }
+    }
+    // Windows 以外では置き換え先を消さずに rename するので、途中で落ちても前のチェックポイントが残る。
+    // rename に失敗した時は、書き終えた一時ファイルが唯一のチェックポイントかもしれないので消さない。
+    return replaceFile(tmpFileName, fileName);
+}
+
+bool readLearnerCheckpoint(const std::string& fileName, LearnerCheckpointHeader& header,
+                           const std::vector<LearnerCheckpointSection>& sections)
+{
+#if defined _WIN32
+    std::ifstream ifs(fileName.c_str(), std::ios::binary | std::ios::ate);
+    if (!ifs) {
+        std::cerr << "Error: cannot open " << fileName << std::endl;
+        return false;
+    }
+    const u64 fileSize = static_cast<u64>(ifs.tellg());
+    ifs.seekg(0);
+    if (fileSize < sizeof(header) || !ifs.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        std::cerr << "Error: " << fileName << " is truncated" << std::endl;
+        return false;
+    }
+    if (!checkHeader(fileName, header, fileSize, sections))
+        return false;
+    for (size_t i = 0; i < sections.size(); ++i) {
+        ifs.seekg(header.sectionOffsets[i]);
+        ifs.read(static_cast<char*>(sections[i].data), sections[i].size);
+    }
+    if (!ifs) {
+        std::cerr << "Error: cannot read " << fileName << std::endl;
+        return false;
+    }
+    return true;
+#else
+    const int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Error: cannot open " << fileName << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<u64>(st.st_size) < sizeof(header)) {
+        std::cerr << "Error: " << fileName << " is truncated" << std::endl;
+        close(fd);
+        return false;
+    }
+    const u64 fileSize = static_cast<u64>(st.st_size);
+    void* const mapped = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Error: cannot mmap " << fileName << std::endl;
+        return false;
+    }
+    madvise(mapped, fileSize, MADV_SEQUENTIAL);
+    const u8* const p = static_cast<const u8*>(mapped);
+    memcpy(&header, p, sizeof(header));
+    const bool ok = checkHeader(fileName, header, fileSize, sections);
+    if (ok) {
+        // ページフォルトの処理を複数スレッドに分散させる為に、ブロックごとに分けてコピーする。
+        const size_t BlockSize = 1 << 24;
+        for (size_t i = 0; i < sections.size(); ++i) {
+            const u8* src = p + header.sectionOffsets[i];
+            u8* dst = static_cast<u8*>(sections[i].data);
+            const s64 blockNum = static_cast<s64>((sections[i].size + BlockSize - 1) / BlockSize);
+#if defined _OPENMP
+#pragma omp parallel for
+#endif
+            for (s64 b = 0; b < blockNum; ++b) {
+                const size_t begin = static_cast<size_t>(b) * BlockSize;
+                memcpy(dst + begin, src + begin, std::min(BlockSize, sections[i].size - begin));
+            }
+        }
+    }
+    munmap(mapped, fileSize);
+    return ok;
+#endif
+}
+
+LearnerSnapshotWriter::SpawnResult LearnerSnapshotWriter::spawn() {
+#if defined _WIN32
+    return Failed;
+#else
+    // 書き出していない出力が子プロセスにも複製されて、二重に出力されるのを防ぐ。
+    std::cout << std::flush;
+    std::cerr << std::flush;
+    const pid_t pid = ::fork();
+    if (pid < 0) {
+        std::cerr << "Warning: cannot fork, writing in the foreground" << std::endl;
+        return Failed;
+    }
+    if (pid == 0)
+        return Child;
+    pid_ = pid;
+    return Started;
+#endif
+}
+
+void LearnerSnapshotWriter::exitChild(const bool ok) {
+#if defined _WIN32
+    (void)ok;
+    abort(); // fork() しないので呼ばれない。
+#else
+    // 親と共有しているバッファやデストラクタを触らないように、exit() ではなく _exit() で終わる。
+    _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+#endif
+}
+
+void LearnerSnapshotWriter::reap(const int status) {
+#if defined _WIN32
+    (void)status;
+#else
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        std::cerr << "Error: background snapshot writer failed" << std::endl;
+        failed_ = true;
+    }
+#endif
+    pid_ = 0;
+}
+
+bool LearnerSnapshotWriter::wait() {
+#if !defined _WIN32
+    if (pid_ != 0) {
+        int status = 0;
+        while (waitpid(static_cast<pid_t>(pid_), &status, 0) < 0) {
+            if (errno != EINTR) {
+                status = -1;
+                break;
+            }
+        }
+        reap(status);
+    }
+#endif
+    const bool ok = !failed_;
+    failed_ = false;
+    return ok;
+}
+
+bool LearnerSnapshotWriter::poll() {
+#if !defined _WIN32
+    if (pid_ != 0) {
+        int status = 0;
+        const pid_t pid = waitpid(static_cast<pid_t>(pid_), &status, WNOHANG);
+        if (pid == 0)
+            return false;
+        reap(pid < 0 ? -1 : status);
+        return true;
+    }
+#endif
+    return false;
+}
+
+void LearnerSnapshotWriter::release(const void* data, const size_t size) const {
+#if defined _WIN32
+    (void)data;
+    (void)size;
+#else
+    if (!child_)
+        return;
+    // 前後の端数のページは他の配列と共有しているかもしれないので手放さない。
+    const uintptr_t pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    const uintptr_t begin = (reinterpret_cast<uintptr_t>(data) + pageSize - 1) & ~(pageSize - 1);
+    const uintptr_t end = (reinterpret_cast<uintptr_t>(data) + size) & ~(pageSize - 1);
+    if (begin < end)
+        madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+#endif
+}
@@ -0,0 +1,101 @@
+/*
+  Apery, a USI shogi playing engine derived from Stockfish, a UCI chess playing engine.
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+  Copyright (C) 2011-2017 Hiraoka Takuya
+
+  Apery is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Apery is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef APERY_LEARNERCHECKPOINT_HPP
+#define APERY_LEARNERCHECKPOINT_HPP
+
+#include "common.hpp"
+
+// use_teacher の途中経過を保存、再開する為のチェックポイント。
+// 学習中の配列をメモリ上の配置のままページ境界に揃えて並べるので、書き出しは単純な書き込みだけで済み、
+// 読み込みはファイルを mmap して配列にコピーするだけで済む。
+//
+// レイアウト
+//   LearnerCheckpointHeader
+//   セクション 0, セクション 1, ... (それぞれ SectionAlignment の倍数の位置から始まる)
+
+struct LearnerCheckpointHeader {
+    static const char Magic[8];
+    static const u32 CurrentVersion = 1;
+    static const int MaxSectionNum = 8;
+    static const u64 SectionAlignment = 4096;
+
+    char magic[8];
+    u32 version;
+    u32 sectionNum;
+    s64 iteration;  // 次に行うイテレーション
+    u64 usedNodes;  // 学習に使い終わった教師局面数
+    u64 recordNum;  // 教師データの局面数。再開時に同じ教師データかを確かめる。
+    u64 sectionOffsets[MaxSectionNum];
+    u64 sectionSizes[MaxSectionNum];
+};
+
+struct LearnerCheckpointSection {
+    void* data;
+    size_t size;
+};
+
+// 一時ファイルに書き出してから置き換えるので、書き出し中に落ちても前のチェックポイントは残る。
+bool writeLearnerCheckpoint(const std::string& fileName, LearnerCheckpointHeader& header,
+                            const std::vector<LearnerCheckpointSection>& sections);
+// sections の大きさがファイルと一致しなければ false を返す。
+bool readLearnerCheckpoint(const std::string& fileName, LearnerCheckpointHeader& header,
+                           const std::vector<LearnerCheckpointSection>& sections);
+
+// 学習中の配列をファイルに書き出す処理を、学習を止めずに裏で行う。
+// fork() した子プロセスが、fork() した時点のメモリの内容をそのまま書き出す。(copy-on-write なので配列のコピーは作らない)
+// 親は書き出しを待たずに配列を書き換えて良く、書き換えたページの分だけメモリが増える。
+// 書き出さない配列は子プロセスで release() しておくと、親が書き換えてもメモリが増えない。
+// 子プロセスには fork() したスレッドしか無いので、write には OpenMP や他のスレッドが持つロックを使わない処理を渡すこと。
+// fork() 出来ない場合はその場で書き出す。
+class LearnerSnapshotWriter {
+public:
+    ~LearnerSnapshotWriter() { wait(); }
+    // 前回の書き出しが終わるのを待ってから、write() を実行する。write() は成功すれば true を返すこと。
+    template <typename F> void start(F write) {
+        wait();
+        switch (spawn()) {
+        case Child  : child_ = true; exitChild(write());
+        case Started: return;
+        case Failed : failed_ |= !write(); return;
+        }
+    }
+    // 書き出し中なら終わるのを待つ。前回 wait() してから書き出しに失敗していれば false を返す。
+    bool wait();
+    // 書き出し中の子プロセスが終わっていれば片付けて true を返す。待たない。
+    bool poll();
+    bool running() const { return pid_ != 0; }
+    // 子プロセスの中で、以降読まない配列のページを手放す。手放したページを読むと 0 になる。
+    // その場で書き出している場合は何もしないので、write の中ではどちらの場合も呼んで良い。
+    void release(const void* data, const size_t size) const;
+
+private:
+    enum SpawnResult { Child, Started, Failed };
+    SpawnResult spawn();
+    [[noreturn]] static void exitChild(const bool ok);
+    void reap(const int status);
+
+    long pid_ = 0; // 書き出し中の子プロセス
+    bool failed_ = false;
+    bool child_ = false;
+};
+
+#endif // #ifndef APERY_LEARNERCHECKPOINT_HPP
@@ -0,0 +1,206 @@
+/*
+  Apery, a USI shogi playing engine derived from Stockfish, a UCI chess playing engine.
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+  Copyright (C) 2011-2017 Hiraoka Takuya
+
+  Apery is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Apery is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "learnerNetwork.hpp"
+
+#if defined _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#endif
+
+namespace {
+#if defined _WIN32
+    const intptr_t InvalidSocket = static_cast<intptr_t>(INVALID_SOCKET);
+    void closeSocket(const intptr_t s) { closesocket(static_cast<SOCKET>(s)); }
+    // Winsock はプロセスで 1 回初期化しておく必要がある。
+    struct WinsockInitializer {
+        WinsockInitializer() {
+            WSADATA data;
+            WSAStartup(MAKEWORD(2, 2), &data);
+        }
+        ~WinsockInitializer() { WSACleanup(); }
+    } g_winsockInitializer;
+    const int SendFlags = 0;
+#else
+    const intptr_t InvalidSocket = -1;
+    void closeSocket(const intptr_t s) { ::close(static_cast<int>(s)); }
+#if defined MSG_NOSIGNAL
+    const int SendFlags = MSG_NOSIGNAL; // 相手が切断していても SIGPIPE で落ちないようにする。
+#else
+    const int SendFlags = 0;
+#endif
+#endif
+    // 1 回の send(), recv() に渡す大きさの上限。Windows では int に収まる必要がある。
+    const size_t MaxIOSize = 1 << 30;
+
+    void setNoDelay(const intptr_t s) {
+        const int one = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&one), sizeof(one));
+    }
+}
+
+LearnerConnection::LearnerConnection() : socket_(InvalidSocket) {}
+
+bool LearnerConnection::connect(const std::string& host, const u16 port, const int timeoutSec) {
+    close();
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0) {
+        std::cerr << "Error: cannot resolve " << host << std::endl;
+        return false;
+    }
+    Timer t = Timer::currentTime();
+    while (socket_ == InvalidSocket) {
+        for (addrinfo* ai = result; ai != nullptr; ai = ai->ai_next) {
+            const intptr_t s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (s == InvalidSocket)
+                continue;
+            if (::connect(s, ai->ai_addr, static_cast<int>(ai->ai_addrlen)) == 0) {
+                socket_ = s;
+                break;
+            }
+            closeSocket(s);
+        }
+        if (socket_ == InvalidSocket) {
+            if (timeoutSec * 1000 <= t.elapsed())
+                break;
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+    }
+    freeaddrinfo(result);
+    if (socket_ == InvalidSocket) {
+        std::cerr << "Error: cannot connect to " << host << ":" << port << std::endl;
+        return false;
+    }
+    setNoDelay(socket_);
+    return true;
+}
+
+bool LearnerConnection::sendAll(const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (0 < size) {
+        const auto n = send(socket_, p, static_cast<int>(std::min(size, MaxIOSize)), SendFlags);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool LearnerConnection::recvAll(void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (0 < size) {
+        const auto n = recv(socket_, p, static_cast<int>(std::min(size, MaxIOSize)), 0);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool LearnerConnection::sendMessage(const u32 type, const void* data, const size_t size) {
+    const LearnerMessageHeader header = {LearnerMessageHeader::Magic, type, size};
+    return socket_ != InvalidSocket && sendAll(&header, sizeof(header)) && sendAll(data, size);
+}
+
+bool LearnerConnection::recvMessage(u32& type, std::vector<u8>& data, const size_t maxSize) {
+    LearnerMessageHeader header;
+    if (socket_ == InvalidSocket || !recvAll(&header, sizeof(header)) || header.magic != LearnerMessageHeader::Magic)
+        return false;
+    if (maxSize < header.size) {
+        std::cerr << "Error: too large message (" << header.size << " bytes)" << std::endl;
+        return false;
+    }
+    type = header.type;
+    data.resize(header.size);
+    return recvAll(data.data(), data.size());
+}
+
+void LearnerConnection::close() {
+    if (socket_ != InvalidSocket) {
+        closeSocket(socket_);
+        socket_ = InvalidSocket;
+    }
+}
+
+LearnerListener::LearnerListener() : socket_(InvalidSocket) {}
+
+bool LearnerListener::listen(const std::string& address, const u16 port) {
+    close();
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* result;
+    if (getaddrinfo(address.c_str(), std::to_string(port).c_str(), &hints, &result) != 0) {
+        std::cerr << "Error: cannot resolve " << address << std::endl;
+        return false;
+    }
+    for (addrinfo* ai = result; ai != nullptr && socket_ == InvalidSocket; ai = ai->ai_next) {
+        const intptr_t s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s == InvalidSocket)
+            continue;
+        const int one = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&one), sizeof(one));
+        if (bind(s, ai->ai_addr, static_cast<int>(ai->ai_addrlen)) == 0 && ::listen(s, SOMAXCONN) == 0)
+            socket_ = s;
+        else
+            closeSocket(s);
+    }
+    freeaddrinfo(result);
+    if (socket_ == InvalidSocket) {
+        std::cerr << "Error: cannot listen on " << address << ":" << port << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool LearnerListener::accept(LearnerConnection& connection) {
+    connection.close();
+    const intptr_t s = ::accept(socket_, nullptr, nullptr);
+    if (s == InvalidSocket) {
+        std::cerr << "Error: cannot accept connection" << std::endl;
+        return false;
+    }
+    setNoDelay(s);
+    connection.socket_ = s;
+    return true;
+}
+
+void LearnerListener::close() {
+    if (socket_ != InvalidSocket) {
+        closeSocket(socket_);
+        socket_ = InvalidSocket;
+    }
+}
@@ -0,0 +1,84 @@
+/*
+  Apery, a USI shogi playing engine derived from Stockfish, a UCI chess playing engine.
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+  Copyright (C) 2011-2017 Hiraoka Takuya
+
+  Apery is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Apery is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef APERY_LEARNERNETWORK_HPP
+#define APERY_LEARNERNETWORK_HPP
+
+#include "common.hpp"
+
+// use_teacher を複数のプロセスで分担する為の TCP 通信。
+// 取りまとめ役のプロセス (server) が待ち受け、他のプロセス (client) が接続する。
+// 同じマシン上で動かす場合は localhost に接続すれば良い。
+// server は既定では 127.0.0.1 でしか待ち受けないので、他のマシンから接続させる場合は待ち受けるアドレスを指定する。
+// メッセージは LearnerMessageHeader の後に size バイトの中身が続く。
+
+struct LearnerMessageHeader {
+    static const u32 Magic = 0x4c525041; // "APRL"
+    u32 magic;
+    u32 type;
+    u64 size;
+};
+static_assert(sizeof(LearnerMessageHeader) == 16, "");
+
+enum LearnerMessageType : u32 {
+    LearnerHello,    // server -> client: 担当する部分などを伝える。
+    LearnerGradient, // client -> server: 1 イテレーション分の gradient
+    LearnerUpdate,   // server -> client: 更新後の評価関数の変化した要素
+    LearnerFinish,   // server -> client: 学習を終える。
+    LearnerEval      // server -> client: 評価関数全体。途中から再開する時に送る。
+};
+
+class LearnerConnection {
+public:
+    LearnerConnection();
+    ~LearnerConnection() { close(); }
+    // host:port に接続する。server の起動を待つ為に timeoutSec 秒まで再試行する。
+    bool connect(const std::string& host, const u16 port, const int timeoutSec = 60);
+    bool sendMessage(const u32 type, const void* data, const size_t size);
+    bool sendMessage(const u32 type, const std::vector<u8>& data) { return sendMessage(type, data.data(), data.size()); }
+    // 1 つのメッセージを受け取るまで待つ。接続が切れたり、壊れたメッセージなら false を返す。
+    // 中身が maxSize バイトより大きいメッセージは、受け取る領域を確保せずに壊れたものとして扱う。
+    bool recvMessage(u32& type, std::vector<u8>& data, const size_t maxSize);
+    void close();
+
+private:
+    friend class LearnerListener;
+    bool sendAll(const void* data, size_t size);
+    bool recvAll(void* data, size_t size);
+
+    intptr_t socket_; // Windows の SOCKET と POSIX の fd の両方を入れられる型にしておく。
+};
+
+class LearnerListener {
+public:
+    LearnerListener();
+    ~LearnerListener() { close(); }
+    // address:port で待ち受ける。address が "0.0.0.0" なら全てのアドレスで待ち受ける。
+    bool listen(const std::string& address, const u16 port);
+    // 1 つの接続を受け付けるまで待つ。
+    bool accept(LearnerConnection& connection);
+    void close();
+
+private:
+    intptr_t socket_;
+};
+
+#endif // #ifndef APERY_LEARNERNETWORK_HPP
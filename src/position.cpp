@@ -76,8 +76,8 @@ const HuffmanCode HuffmanCodedPos::handCodeTable[HandPieceNum][ColorNum] = {
     {{Binary<   111111>::value, 7}, {Binary<  1111111>::value, 7}}, // HRook
 };
 
-HuffmanCodeToPieceHash HuffmanCodedPos::boardCodeToPieceHash;
-HuffmanCodeToPieceHash HuffmanCodedPos::handCodeToPieceHash;
+HuffmanDecodeEntry HuffmanCodedPos::boardDecodeTable[1 << HuffmanCodedPos::BoardCodeMaxBits];
+HuffmanDecodeEntry HuffmanCodedPos::handDecodeTable[1 << HuffmanCodedPos::HandCodeMaxBits];
 
 const CharToPieceUSI g_charToPieceUSI;
 
@@ -144,6 +144,26 @@ Bitboard Position::attacksFrom(const PieceType pt, const Color c, const Square s
     }
 }
 
+#if defined USE_ATTACK_MAP
+void Position::addAttackCount(const PieceType pt, const Color c, const Square sq, const Bitboard& occupied, const int delta) {
+    Bitboard bb = attacksFrom(pt, c, sq, occupied);
+    Square to;
+    FOREACH_BB(bb, to, {
+            st_->attackCount[c][to] += delta;
+        });
+}
+
+void Position::setAttackMap() {
+    memset(st_->attackCount, 0, sizeof(st_->attackCount));
+    const Bitboard occ = occupiedBB();
+    Bitboard bb = occ;
+    Square sq;
+    FOREACH_BB(bb, sq, {
+            addAttackCount(pieceToPieceType(piece(sq)), pieceToColor(piece(sq)), sq, occ, 1);
+        });
+}
+#endif
+
 // 実際に指し手が合法手かどうか判定
 // 連続王手の千日手は排除しない。
 // 確実に駒打ちではないときは、MUSTNOTDROP == true とする。
@@ -334,6 +354,28 @@ void Position::doMove(const Move move, StateInfo& newSt) {
     doMove(move, newSt, ci, moveGivesCheck(move, ci));
 }
 
+void Position::prefetchEvaluate(const Key key, const bool kingMoved) const {
+    static_assert(zobTurn_ == 1, "");
+    prefetch(g_evalTable[key >> 1]); // getKeyExcludeTurn() と同じ key
+    // 玉が動いた時は KPP の和を玉の位置から計算し直すので、動いた駒の KPP だけを先読みしても意味が無い。
+    if (kingMoved)
+        return;
+    const Square sq_bk = kingSquare(Black);
+    const Square sq_wk = kingSquare(White);
+    for (size_t n = 0; n < st_->cl.size; ++n) {
+        const int k0 = st_->cl.clistpair[n].newlist[0];
+        const int k1 = st_->cl.clistpair[n].newlist[1];
+        prefetch(&Evaluator::KKP[sq_bk         ][sq_wk         ][k0]);
+        prefetch(&Evaluator::KKP[inverse(sq_wk)][inverse(sq_bk)][k1]);
+        const auto* pkppb = Evaluator::KPP[sq_bk         ][k0];
+        const auto* pkppw = Evaluator::KPP[inverse(sq_wk)][k1];
+        for (int i = 0; i < nlist(); ++i) {
+            prefetch(const_cast<SearchKPPType*>(&pkppb[evalList_.list0[i]]));
+            prefetch(const_cast<SearchKPPType*>(&pkppw[evalList_.list1[i]]));
+        }
+    }
+}
+
 // 局面の更新
 void Position::doMove(const Move move, StateInfo& newSt, const CheckInfo& ci, const bool moveIsCheck) {
     assert(isOK());
@@ -354,6 +396,32 @@ void Position::doMove(const Move move, StateInfo& newSt, const CheckInfo& ci, co
     const Square to = move.to();
     const PieceType ptCaptured = move.cap();
     PieceType ptTo;
+#if defined USE_ATTACK_MAP
+    memcpy(st_->attackCount, st_->previous->attackCount, sizeof(st_->attackCount));
+    // 移動元と移動先 (駒を取らない場合) の駒の有無が変わるので、そこに利いている遠隔駒は利きが変わる。
+    // 動かす駒と取られる駒も含めて、変わる前の利きを引いておき、盤面を更新した後に変わった後の利きを足す。
+    Bitboard slidersChanged;
+    {
+        const Bitboard occ = occupiedBB();
+        const Bitboard sliders = bbOf(Lance) | bbOf(Bishop, Horse) | bbOf(Rook, Dragon);
+        slidersChanged = (ptCaptured ? allZeroBB() : attackersTo(to, occ) & sliders);
+        if (!move.isDrop()) {
+            const Square from = move.from();
+            slidersChanged |= attackersTo(from, occ) & sliders;
+            slidersChanged.clearBit(from);
+            addAttackCount(move.pieceTypeFrom(), us, from, occ, -1);
+        }
+        if (ptCaptured) {
+            slidersChanged.clearBit(to);
+            addAttackCount(ptCaptured, oppositeColor(us), to, occ, -1);
+        }
+        Bitboard bb = slidersChanged;
+        Square sq;
+        FOREACH_BB(bb, sq, {
+                addAttackCount(pieceToPieceType(piece(sq)), pieceToColor(piece(sq)), sq, occ, -1);
+            });
+    }
+#endif
     if (move.isDrop()) {
         ptTo = move.pieceTypeDropped();
         const HandPiece hpTo = pieceTypeToHandPiece(ptTo);
@@ -492,6 +560,17 @@ void Position::doMove(const Move move, StateInfo& newSt, const CheckInfo& ci, co
         }
     }
     goldsBB_ = bbOf(Gold, ProPawn, ProLance, ProKnight, ProSilver);
+    prefetchEvaluate(boardKey + handKey, ptTo == King);
+#if defined USE_ATTACK_MAP
+    {
+        const Bitboard occ = occupiedBB();
+        addAttackCount(ptTo, us, to, occ, 1);
+        Square sq;
+        FOREACH_BB(slidersChanged, sq, {
+                addAttackCount(pieceToPieceType(piece(sq)), pieceToColor(piece(sq)), sq, occ, 1);
+            });
+    }
+#endif
 
     st_->boardKey = boardKey;
     st_->handKey = handKey;
@@ -655,6 +734,11 @@ Score Position::see(const Move move, const int asymmThreshold) const {
     Color turn = oppositeColor(this->turn());
     Score swapList[32];
     if (move.isDrop()) {
+#if defined USE_ATTACK_MAP
+        // 駒を打っても to に利く駒は変わらないので、今の局面の利きの数で判定出来る。
+        if (attackCount(turn, to) == 0)
+            return ScoreZero;
+#endif
         opponentAttackers = attackersTo(turn, to, occ);
         if (!opponentAttackers)
             return ScoreZero;
@@ -1646,10 +1730,9 @@ std::string Position::toSFEN(const Ply ply) const {
 
 HuffmanCodedPos Position::toHuffmanCodedPos() const {
     HuffmanCodedPos result;
-    result.clear();
-    BitStream bs(result.data);
+    WordBitStream bs;
     // 手番 (1bit)
-    bs.putBit(turn());
+    bs.putBits(turn(), 1);
 
     // 玉の位置 (7bit * 2)
     bs.putBits(kingSquare(Black), 7);
@@ -1673,8 +1756,8 @@ HuffmanCodedPos Position::toHuffmanCodedPos() const {
                 bs.putBits(hc.code, hc.numOfBits);
         }
     }
-    assert(bs.data() == std::end(result.data));
-    assert(bs.curr() == 0);
+    assert(bs.curr() == WordBitStream::NumOfBits);
+    bs.store(result.data);
     return result;
 }
 
@@ -1780,6 +1863,23 @@ bool Position::isOK() const {
             goto incorrect_position;
     }
 
+#if defined USE_ATTACK_MAP
+    ++failedStep;
+    {
+        u8 attackCount[ColorNum][SquareNum] = {};
+        for (Square sq = SQ11; sq < SquareNum; ++sq) {
+            if (piece(sq) == Empty)
+                continue;
+            const Color c = pieceToColor(piece(sq));
+            Bitboard bb = attacksFrom(pieceToPieceType(piece(sq)), c, sq, occupiedBB());
+            Square to;
+            FOREACH_BB(bb, to, { ++attackCount[c][to]; });
+        }
+        if (memcmp(attackCount, st_->attackCount, sizeof(attackCount)) != 0)
+            goto incorrect_position;
+    }
+#endif
+
     ++failedStep;
     {
         int i;
@@ -1971,6 +2071,9 @@ void Position::set(const std::string& sfen, Thread* th) {
     st_->hand = hand(turn());
 
     setEvalList();
+#if defined USE_ATTACK_MAP
+    setAttackMap();
+#endif
     findCheckers();
     st_->material = computeMaterial();
     thisThread_ = th;
@@ -1985,48 +2088,43 @@ bool Position::set(const HuffmanCodedPos& hcp, Thread* th) {
     clear();
     setSearcher(s);
 
-    HuffmanCodedPos tmp = hcp; // ローカルにコピー
-    BitStream bs(tmp.data);
+    WordBitStream bs(hcp.data);
 
     // 手番
-    turn_ = static_cast<Color>(bs.getBit());
+    turn_ = static_cast<Color>(bs.getBits(1));
 
     // 玉の位置
-    Square sq0 = (Square)bs.getBits(7);
-    Square sq1 = (Square)bs.getBits(7);
-    setPiece(BKing, static_cast<Square>(sq0));
-    setPiece(WKing, static_cast<Square>(sq1));
+    const Square sq0 = static_cast<Square>(bs.getBits(7));
+    const Square sq1 = static_cast<Square>(bs.getBits(7));
+    if (SquareNum <= sq0 || SquareNum <= sq1 || sq0 == sq1)
+        goto INCORRECT_HUFFMAN_CODE;
+    setPiece(BKing, sq0);
+    setPiece(WKing, sq1);
 
     // 盤上の駒
+    // 最長符号長分を先読みしてテーブルを引くので、1 bit ずつ読む必要は無い。
     for (Square sq = SQ11; sq < SquareNum; ++sq) {
-        if (pieceToPieceType(piece(sq)) == King) // piece(sq) は BKing, WKing, Empty のどれか。
+        if (sq == sq0 || sq == sq1)
             continue;
-        HuffmanCode hc = {0, 0};
-        while (hc.numOfBits <= 8) {
-            hc.code |= bs.getBit() << hc.numOfBits++;
-            if (HuffmanCodedPos::boardCodeToPieceHash.value(hc.key) != PieceNone) {
-                const Piece pc = HuffmanCodedPos::boardCodeToPieceHash.value(hc.key);
-                if (pc != Empty)
-                    setPiece(HuffmanCodedPos::boardCodeToPieceHash.value(hc.key), sq);
-                break;
-            }
-        }
-        if (HuffmanCodedPos::boardCodeToPieceHash.value(hc.key) == PieceNone)
+        if (WordBitStream::NumOfBits <= bs.curr())
+            goto INCORRECT_HUFFMAN_CODE;
+        const HuffmanDecodeEntry& entry = HuffmanCodedPos::boardDecodeTable[bs.peekBits(HuffmanCodedPos::BoardCodeMaxBits)];
+        if (entry.numOfBits == 0)
             goto INCORRECT_HUFFMAN_CODE;
+        bs.skipBits(entry.numOfBits);
+        if (entry.piece != Empty)
+            setPiece(entry.piece, sq);
     }
-    while (bs.data() != std::end(tmp.data)) {
-        HuffmanCode hc = {0, 0};
-        while (hc.numOfBits <= 8) {
-            hc.code |= bs.getBit() << hc.numOfBits++;
-            const Piece pc = HuffmanCodedPos::handCodeToPieceHash.value(hc.key);
-            if (pc != PieceNone) {
-                hand_[pieceToColor(pc)].plusOne(pieceTypeToHandPiece(pieceToPieceType(pc)));
-                break;
-            }
-        }
-        if (HuffmanCodedPos::handCodeToPieceHash.value(hc.key) == PieceNone)
+    // 持ち駒
+    while (bs.curr() < WordBitStream::NumOfBits) {
+        const HuffmanDecodeEntry& entry = HuffmanCodedPos::handDecodeTable[bs.peekBits(HuffmanCodedPos::HandCodeMaxBits)];
+        if (entry.numOfBits == 0)
             goto INCORRECT_HUFFMAN_CODE;
+        bs.skipBits(entry.numOfBits);
+        hand_[pieceToColor(entry.piece)].plusOne(pieceTypeToHandPiece(pieceToPieceType(entry.piece)));
     }
+    if (bs.curr() != WordBitStream::NumOfBits)
+        goto INCORRECT_HUFFMAN_CODE;
 
     kingSquare_[Black] = bbOf(King, Black).constFirstOneFromSQ11();
     kingSquare_[White] = bbOf(King, White).constFirstOneFromSQ11();
@@ -2039,6 +2137,9 @@ bool Position::set(const HuffmanCodedPos& hcp, Thread* th) {
     st_->hand = hand(turn());
 
     setEvalList();
+#if defined USE_ATTACK_MAP
+    setAttackMap();
+#endif
     findCheckers();
     st_->material = computeMaterial();
     thisThread_ = th;
@@ -2049,6 +2150,31 @@ INCORRECT_HUFFMAN_CODE:
     return false;
 }
 
+namespace {
+    inline const HuffmanCodedPos& huffmanCodedPosOf(const HuffmanCodedPos& hcp) { return hcp; }
+    inline const HuffmanCodedPos& huffmanCodedPosOf(const HuffmanCodedPosAndEval& hcpe) { return hcpe.hcp; }
+
+    template <typename Record>
+    size_t setPositionsBody(Position positions[], const Record records[], const size_t num, Thread* th) {
+        for (size_t i = 0; i < num; ++i) {
+            // 次の局面のデータを先に読み込んでおく。
+            if (i + 1 < num)
+                prefetch(const_cast<Record*>(&records[i + 1]));
+            if (!positions[i].set(huffmanCodedPosOf(records[i]), th))
+                return i;
+        }
+        return num;
+    }
+}
+
+size_t setPositions(Position positions[], const HuffmanCodedPos hcps[], const size_t num, Thread* th) {
+    return setPositionsBody(positions, hcps, num, th);
+}
+
+size_t setPositions(Position positions[], const HuffmanCodedPosAndEval hcpes[], const size_t num, Thread* th) {
+    return setPositionsBody(positions, hcpes, num, th);
+}
+
 bool Position::moveGivesCheck(const Move move) const {
     return moveGivesCheck(move, CheckInfo(*this));
 }
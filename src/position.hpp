@@ -77,6 +77,9 @@ struct StateInfo {
     StateInfo* previous;
     Hand hand; // 手番側の持ち駒
     ChangedLists cl;
+#if defined USE_ATTACK_MAP
+    u8 attackCount[ColorNum][SquareNum]; // 各マスに利いている駒の数。doMove() で前の局面からコピーして差分更新する。
+#endif
 
     Key key() const { return boardKey + handKey; }
 };
@@ -135,45 +138,116 @@ private:
     int curr_; // 1byte 中の bit の位置
 };
 
+// 64 bit 単位で読み書きする BitStream。
+// HuffmanCodedPos の様な 256 bit 固定長のデータを、1 bit ずつではなく word 単位で符号化、復号する為に使う。
+// bit の並びは BitStream と同じく、先頭 byte の LSB から順に詰める。(little endian を前提とする。)
+class WordBitStream {
+public:
+    static const int NumOfBits = 256;
+
+    WordBitStream() { clear(); }
+    explicit WordBitStream(const u8* d) { load(d); }
+    void clear() {
+        std::fill(std::begin(words_), std::end(words_), 0);
+        curr_ = 0;
+    }
+    void load(const u8* d) {
+        memcpy(words_, d, NumOfBits / 8);
+        words_[NumOfWords] = 0;
+        curr_ = 0;
+    }
+    void store(u8* d) const { memcpy(d, words_, NumOfBits / 8); }
+    // 読み込み位置を進めずに numOfBits bit 先読みする。numOfBits は 1 以上 57 以下。
+    // 末尾を越えた部分は 0 として読める。curr() < NumOfBits の間だけ呼ぶこと。
+    u64 peekBits(const int numOfBits) const {
+        assert(0 < numOfBits && numOfBits <= 57);
+        assert(curr_ < NumOfBits);
+        const int idx = curr_ >> 6;
+        const int shift = curr_ & 63;
+        u64 result = words_[idx] >> shift;
+        if (shift != 0)
+            result |= words_[idx + 1] << (64 - shift);
+        return result & ((UINT64_C(1) << numOfBits) - 1);
+    }
+    void skipBits(const int numOfBits) { curr_ += numOfBits; }
+    u64 getBits(const int numOfBits) {
+        const u64 result = peekBits(numOfBits);
+        skipBits(numOfBits);
+        return result;
+    }
+    // val の下位 numOfBits bit を書き込む。numOfBits は 64 以下。
+    void putBits(const u64 val, const int numOfBits) {
+        assert(numOfBits <= 64);
+        assert(curr_ + numOfBits <= NumOfBits);
+        if (numOfBits == 0)
+            return;
+        const int idx = curr_ >> 6;
+        const int shift = curr_ & 63;
+        words_[idx] |= val << shift;
+        if (shift != 0 && 64 < shift + numOfBits)
+            words_[idx + 1] |= val >> (64 - shift);
+        curr_ += numOfBits;
+    }
+    int curr() const { return curr_; }
+
+private:
+    static const int NumOfWords = NumOfBits / 64;
+    u64 words_[NumOfWords + 1]; // 末尾を越えて先読みしても良いように 1 word 余分に確保する。
+    int curr_; // 先頭から何 bit 目まで読み書きしたか
+};
+
 union HuffmanCode {
     struct {
         u8 code;      // 符号化時の bit 列
         u8 numOfBits; // 使用 bit 数
     };
-    u16 key; // std::unordered_map の key として使う。
+    u16 key;
 };
 
-struct HuffmanCodeToPieceHash : public std::unordered_map<u16, Piece> {
-    Piece value(const u16 key) const {
-        const auto it = find(key);
-        if (it == std::end(*this))
-            return PieceNone;
-        return it->second;
-    }
+// 先読みした bit 列から駒と符号長を引く為のテーブルの要素。
+struct HuffmanDecodeEntry {
+    Piece piece;
+    int numOfBits; // 0 なら不正な符号。
 };
 
 // Huffman 符号化された局面のデータ構造。256 bit で局面を表す。
 struct HuffmanCodedPos {
+    static const int BoardCodeMaxBits = 8;
+    static const int HandCodeMaxBits = 7;
     static const HuffmanCode boardCodeTable[PieceNone];
     static const HuffmanCode handCodeTable[HandPieceNum][ColorNum];
-    static HuffmanCodeToPieceHash boardCodeToPieceHash;
-    static HuffmanCodeToPieceHash handCodeToPieceHash;
+    // 符号は prefix code なので、最長符号長分を先読みすれば、その値だけで駒と符号長が決まる。
+    static HuffmanDecodeEntry boardDecodeTable[1 << BoardCodeMaxBits];
+    static HuffmanDecodeEntry handDecodeTable[1 << HandCodeMaxBits];
     static void init() {
+        auto setDecodeEntry = [](HuffmanDecodeEntry table[], const int maxBits, const HuffmanCode hc, const Piece pc) {
+            assert(0 < hc.numOfBits && hc.numOfBits <= maxBits);
+            for (int upper = 0; upper < (1 << (maxBits - hc.numOfBits)); ++upper) {
+                HuffmanDecodeEntry& entry = table[hc.code | (upper << hc.numOfBits)];
+                entry.piece = pc;
+                entry.numOfBits = hc.numOfBits;
+            }
+        };
+        for (auto& entry : boardDecodeTable)
+            entry = {PieceNone, 0};
+        for (auto& entry : handDecodeTable)
+            entry = {PieceNone, 0};
         for (Piece pc = Empty; pc <= BDragon; ++pc)
             if (pieceToPieceType(pc) != King) // 玉は位置で符号化するので、駒の種類では符号化しない。
-                boardCodeToPieceHash[boardCodeTable[pc].key] = pc;
+                setDecodeEntry(boardDecodeTable, BoardCodeMaxBits, boardCodeTable[pc], pc);
         for (Piece pc = WPawn; pc <= WDragon; ++pc)
             if (pieceToPieceType(pc) != King) // 玉は位置で符号化するので、駒の種類では符号化しない。
-                boardCodeToPieceHash[boardCodeTable[pc].key] = pc;
+                setDecodeEntry(boardDecodeTable, BoardCodeMaxBits, boardCodeTable[pc], pc);
         for (HandPiece hp = HPawn; hp < HandPieceNum; ++hp)
             for (Color c = Black; c < ColorNum; ++c)
-                handCodeToPieceHash[handCodeTable[hp][c].key] = colorAndPieceTypeToPiece(c, handPieceToPieceType(hp));
+                setDecodeEntry(handDecodeTable, HandCodeMaxBits, handCodeTable[hp][c], colorAndPieceTypeToPiece(c, handPieceToPieceType(hp)));
     }
     void clear() { std::fill(std::begin(data), std::end(data), 0); }
 
     u8 data[32];
 };
 static_assert(sizeof(HuffmanCodedPos) == 32, "");
+static_assert(sizeof(HuffmanCodedPos) * 8 == WordBitStream::NumOfBits, "");
 
 struct HuffmanCodedPosAndEval {
     HuffmanCodedPos hcp;
@@ -282,12 +356,20 @@ public:
     Bitboard attackersTo(const Color c, const Square sq) const { return attackersTo(c, sq, occupiedBB()); }
     Bitboard attackersTo(const Color c, const Square sq, const Bitboard& occupied) const;
     Bitboard attackersToExceptKing(const Color c, const Square sq) const;
-    // todo: 利きをデータとして持ったとき、attackersToIsAny() を高速化すること。
+#if defined USE_ATTACK_MAP
+    // c 側の駒が sq に利いている数。玉の利きも含む。
+    // doMove() で更新するので、xorBBs() などで盤面を一時的に書き換えている間は、書き換える前の局面の値を返す。
+    int attackCount(const Color c, const Square sq) const { return st_->attackCount[c][sq]; }
+    // 盤面を一時的に書き換えている間は使わないこと。
+    bool attackersToIsAny(const Color c, const Square sq) const { return attackCount(c, sq) != 0; }
+#else
     bool attackersToIsAny(const Color c, const Square sq) const { return attackersTo(c, sq).isAny(); }
+#endif
     bool attackersToIsAny(const Color c, const Square sq, const Bitboard& occupied) const {
         return attackersTo(c, sq, occupied).isAny();
     }
     // 移動王手が味方の利きに支えられているか。false なら相手玉で取れば詰まない。
+    // 動かす駒を xorBBs() で取り除いた状態で呼ぶので、利きの数は使えない。
     bool unDropCheckIsSupported(const Color c, const Square sq) const { return attackersTo(c, sq).isAny(); }
     // 利きの生成
 
@@ -465,6 +547,14 @@ private:
     int debugSetEvalList() const;
 #endif
     void setEvalList() { evalList_.set(*this); }
+#if defined USE_ATTACK_MAP
+    // 利きの数を全て数え直す。
+    void setAttackMap();
+    // pt, c の駒が sq から occupied の下で利いているマスの利きの数に delta を足す。
+    void addAttackCount(const PieceType pt, const Color c, const Square sq, const Bitboard& occupied, const int delta);
+#endif
+    // doMove() の直後の evaluate() で読む評価関数のハッシュテーブルと、動いた駒の KPP, KKP を先読みする。
+    void prefetchEvaluate(const Key key, const bool kingMoved) const;
 
     Key computeBoardKey() const;
     Key computeHandKey() const;
@@ -523,6 +613,11 @@ template <> inline Bitboard Position::attacksFrom<King  >(const Color  , const S
 template <> inline Bitboard Position::attacksFrom<Horse >(const Color  , const Square sq) const { return  horseAttack(   sq, occupiedBB()); }
 template <> inline Bitboard Position::attacksFrom<Dragon>(const Color  , const Square sq) const { return dragonAttack(   sq, occupiedBB()); }
 
+// 複数の Huffman 符号化された局面をまとめて positions[0, num) に復号する。
+// 各 Position の Searcher はそのまま残す。全て復号出来れば num、出来なければ最初に失敗した局面の index を返す。
+size_t setPositions(Position positions[], const HuffmanCodedPos hcps[], const size_t num, Thread* th);
+size_t setPositions(Position positions[], const HuffmanCodedPosAndEval hcpes[], const size_t num, Thread* th);
+
 // position sfen R8/2K1S1SSk/4B4/9/9/9/9/9/1L1L1L3 b PLNSGBR17p3n3g 1
 // の局面が最大合法手局面で 593 手。番兵の分、+ 1 しておく。
 const int MaxLegalMoves = 593 + 1;
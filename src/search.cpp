@@ -36,6 +36,7 @@ LimitsType Searcher::limits;
 StateListPtr Searcher::states;
 TimeManager Searcher::timeManager;
 TranspositionTable Searcher::tt;
+Book Searcher::book;
 #if defined INANIWA_SHIFT
 InaniwaFlag Searcher::inaniwaFlag;
 #endif
@@ -482,6 +483,12 @@ Score Searcher::qsearch(Position& pos, SearchStack* ss, Score alpha, Score beta,
     return bestScore;
 }
 
+#if defined LEARN
+// 学習では探索の外から qsearch を直接呼ぶので、明示的に実体化しておく。
+template Score Searcher::qsearch<PV, true >(Position& pos, SearchStack* ss, Score alpha, Score beta, const Depth depth);
+template Score Searcher::qsearch<PV, false>(Position& pos, SearchStack* ss, Score alpha, Score beta, const Depth depth);
+#endif
+
 void Thread::search() {
     SearchStack stack[MaxPly+7];
     SearchStack* ss = stack + 5; // To allow referencing (ss-5) and (ss+2)
@@ -1378,8 +1385,8 @@ void MainThread::search() {
     auto& options = searcher->options;
     auto& tt = searcher->tt;
     auto& signals = searcher->signals;
+    auto& book = searcher->book;
 
-    static Book book;
     Position& pos = rootPos;
     const Color us = pos.turn();
     searcher->timeManager.init(searcher->limits, us, pos.gamePly(), pos, searcher);
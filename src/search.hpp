@@ -27,6 +27,7 @@
 #include "timeManager.hpp"
 #include "tt.hpp"
 #include "thread.hpp"
+#include "book.hpp"
 
 class Position;
 struct SplitPoint;
@@ -116,6 +117,7 @@ struct Searcher {
 
     STATIC TimeManager timeManager;
     STATIC TranspositionTable tt;
+    STATIC Book book;
 
 #if defined INANIWA_SHIFT
     STATIC InaniwaFlag inaniwaFlag;
@@ -0,0 +1,972 @@
+/*
+  Apery, a USI shogi playing engine derived from Stockfish, a UCI chess playing engine.
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+  Copyright (C) 2011-2017 Hiraoka Takuya
+
+  Apery is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Apery is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "teacherData.hpp"
+#include "position.hpp"
+#include <numeric>
+
+const char TeacherFileHeader::Magic[8] = {'A', 'P', 'T', 'E', 'A', 'C', 'H', '1'};
+
+namespace {
+    // CRC-32C の多項式 (reflected)
+    const u32 Crc32cPolynomial = 0x82f63b78;
+
+    struct Crc32cTable {
+        Crc32cTable() {
+            for (u32 i = 0; i < 256; ++i) {
+                u32 crc = i;
+                for (int j = 0; j < 8; ++j)
+                    crc = (crc & 1) ? (crc >> 1) ^ Crc32cPolynomial : crc >> 1;
+                table[i] = crc;
+            }
+        }
+        u32 table[256];
+    };
+    const Crc32cTable g_crc32cTable;
+
+    const size_t LZMinMatch = 4;
+    const size_t LZMaxOffset = 0xffff;
+    const int LZHashBits = 16;
+
+    inline u32 read32(const u8* p) {
+        u32 v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    inline u32 lzHash(const u32 v) { return (v * 2654435761u) >> (32 - LZHashBits); }
+
+    // 15 以上の長さの残りを 255 区切りで書き込む。
+    inline u8* writeLength(u8* op, size_t len) {
+        for (; 255 <= len; len -= 255)
+            *op++ = 255;
+        *op++ = static_cast<u8>(len);
+        return op;
+    }
+    // 15 以上の長さの残りを読み込む。
+    inline bool readLength(const u8*& ip, const u8* ipEnd, size_t& len) {
+        u8 b;
+        do {
+            if (ip == ipEnd)
+                return false;
+            b = *ip++;
+            len += b;
+        } while (b == 255);
+        return true;
+    }
+    // literal の列と、続く一致部分を 1 組書き込む。matchLen == 0 なら末尾の literal のみ。
+    u8* writeSequence(u8* op, const u8* literals, const size_t literalLen, const size_t offset, const size_t matchLen) {
+        u8* token = op++;
+        *token = static_cast<u8>(std::min<size_t>(literalLen, 15) << 4);
+        if (15 <= literalLen)
+            op = writeLength(op, literalLen - 15);
+        memcpy(op, literals, literalLen);
+        op += literalLen;
+        if (matchLen != 0) {
+            assert(LZMinMatch <= matchLen && offset <= LZMaxOffset);
+            *op++ = static_cast<u8>(offset);
+            *op++ = static_cast<u8>(offset >> 8);
+            const size_t len = matchLen - LZMinMatch;
+            *token |= static_cast<u8>(std::min<size_t>(len, 15));
+            if (15 <= len)
+                op = writeLength(op, len - 15);
+        }
+        return op;
+    }
+
+    // レコードのバイト位置ごとに並べ直す。
+    void shuffleRecords(const u8* src, u8* dst, const size_t recordSize, const size_t num) {
+        for (size_t r = 0; r < num; ++r)
+            for (size_t b = 0; b < recordSize; ++b)
+                dst[b * num + r] = src[r * recordSize + b];
+    }
+    void unshuffleRecords(const u8* src, u8* dst, const size_t recordSize, const size_t num) {
+        for (size_t b = 0; b < recordSize; ++b)
+            for (size_t r = 0; r < num; ++r)
+                dst[r * recordSize + b] = src[b * num + r];
+    }
+
+    bool recordSizeFromName(const std::string& name, size_t& recordSize) {
+        if      (name == "hcp" ) recordSize = sizeof(HuffmanCodedPos);
+        else if (name == "hcpe") recordSize = sizeof(HuffmanCodedPosAndEval);
+        else {
+            std::cerr << "Error: unknown record type " << name << " (hcp or hcpe)" << std::endl;
+            return false;
+        }
+        return true;
+    }
+}
+
+u32 crc32c(const void* data, const size_t size, u32 crc) {
+    const u8* p = static_cast<const u8*>(data);
+    const u8* const end = p + size;
+    crc = ~crc;
+#if defined HAVE_SSE42
+    for (; p + sizeof(u64) <= end; p += sizeof(u64)) {
+        u64 v;
+        memcpy(&v, p, sizeof(v));
+        crc = static_cast<u32>(_mm_crc32_u64(crc, v));
+    }
+#endif
+    for (; p < end; ++p)
+        crc = g_crc32cTable.table[(crc ^ *p) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+size_t lzCompress(const u8* src, const size_t srcSize, u8* dst) {
+    std::vector<u32> table(1 << LZHashBits, 0); // 位置 + 1 を入れる。0 は未登録。
+    u8* op = dst;
+    size_t anchor = 0;
+    size_t ip = 0;
+    while (ip + LZMinMatch <= srcSize) {
+        const u32 v = read32(src + ip);
+        const u32 h = lzHash(v);
+        const size_t ref = table[h];
+        table[h] = static_cast<u32>(ip + 1);
+        if (ref != 0 && ip - (ref - 1) <= LZMaxOffset && read32(src + ref - 1) == v) {
+            const size_t matchPos = ref - 1;
+            size_t len = LZMinMatch;
+            while (ip + len < srcSize && src[matchPos + len] == src[ip + len])
+                ++len;
+            op = writeSequence(op, src + anchor, ip - anchor, ip - matchPos, len);
+            ip += len;
+            anchor = ip;
+        }
+        else
+            ++ip;
+    }
+    op = writeSequence(op, src + anchor, srcSize - anchor, 0, 0);
+    assert(static_cast<size_t>(op - dst) <= lzCompressBound(srcSize));
+    return op - dst;
+}
+
+bool lzDecompress(const u8* src, const size_t srcSize, u8* dst, const size_t dstSize) {
+    const u8* ip = src;
+    const u8* const ipEnd = src + srcSize;
+    u8* op = dst;
+    u8* const opEnd = dst + dstSize;
+    while (ip < ipEnd) {
+        const u8 token = *ip++;
+        size_t literalLen = token >> 4;
+        if (literalLen == 15 && !readLength(ip, ipEnd, literalLen))
+            return false;
+        if (static_cast<size_t>(ipEnd - ip) < literalLen || static_cast<size_t>(opEnd - op) < literalLen)
+            return false;
+        memcpy(op, ip, literalLen);
+        ip += literalLen;
+        op += literalLen;
+        if (ip == ipEnd)
+            break; // 末尾の literal のみの組
+        if (ipEnd - ip < 2)
+            return false;
+        const size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t matchLen = token & 15;
+        if (matchLen == 15 && !readLength(ip, ipEnd, matchLen))
+            return false;
+        matchLen += LZMinMatch;
+        if (offset == 0 || static_cast<size_t>(op - dst) < offset || static_cast<size_t>(opEnd - op) < matchLen)
+            return false;
+        const u8* match = op - offset;
+        // 重なりがあり得るので 1 byte ずつコピーする。
+        for (size_t i = 0; i < matchLen; ++i)
+            op[i] = match[i];
+        op += matchLen;
+    }
+    return op == opEnd;
+}
+
+bool TeacherFileReader::open(const std::string& fileName, const size_t recordSize) {
+    if (ifs_.is_open())
+        ifs_.close();
+    ifs_.clear();
+    chunks_.clear();
+    chunkBegins_.clear();
+    cursor_ = 0;
+    bufferedChunk_ = std::numeric_limits<size_t>::max();
+    recordSize_ = recordSize;
+
+    ifs_.open(fileName.c_str(), std::ios::binary);
+    if (!ifs_) {
+        std::cerr << "Error: cannot open " << fileName << std::endl;
+        return false;
+    }
+    const u64 fileSize = static_cast<u64>(ifs_.seekg(0, std::ios::end).tellg());
+    ifs_.seekg(0, std::ios::beg);
+    TeacherFileHeader header;
+    chunked_ = (sizeof(header) <= fileSize
+                && ifs_.read(reinterpret_cast<char*>(&header), sizeof(header))
+                && std::equal(std::begin(header.magic), std::end(header.magic), TeacherFileHeader::Magic));
+    ifs_.clear();
+
+    if (!chunked_) {
+        // 生の形式は recordsPerChunk 局面ごとの仮想的なチャンクとして扱う。
+        recordNum_ = fileSize / recordSize;
+        for (u64 begin = 0; begin < recordNum_; begin += DefaultRecordsPerChunk) {
+            TeacherChunkIndex chunk;
+            chunk.offset = begin * recordSize;
+            chunk.recordNum = static_cast<u32>(std::min<u64>(DefaultRecordsPerChunk, recordNum_ - begin));
+            chunk.size = static_cast<u32>(chunk.recordNum * recordSize);
+            chunk.checksum = 0;
+            chunk.method = TeacherChunkIndex::Stored;
+            chunks_.push_back(chunk);
+            chunkBegins_.push_back(begin);
+        }
+        return true;
+    }
+
+    if (header.version != TeacherFileHeader::CurrentVersion || header.recordSize != recordSize) {
+        std::cerr << "Error: " << fileName << " has version " << header.version << ", record size " << header.recordSize
+                  << " (expected version " << TeacherFileHeader::CurrentVersion << ", record size " << recordSize << ")" << std::endl;
+        return false;
+    }
+    chunks_.resize(header.chunkNum);
+    ifs_.seekg(header.indexOffset, std::ios::beg);
+    ifs_.read(reinterpret_cast<char*>(chunks_.data()), sizeof(TeacherChunkIndex) * chunks_.size());
+    if (!ifs_ || crc32c(chunks_.data(), sizeof(TeacherChunkIndex) * chunks_.size()) != header.indexChecksum) {
+        std::cerr << "Error: broken chunk index in " << fileName << std::endl;
+        return false;
+    }
+    recordNum_ = 0;
+    bool hasEmptyChunk = false; // 空のチャンクは書き出さない。
+    for (auto& chunk : chunks_) {
+        hasEmptyChunk |= (chunk.recordNum == 0);
+        chunkBegins_.push_back(recordNum_);
+        recordNum_ += chunk.recordNum;
+    }
+    if (hasEmptyChunk || recordNum_ != header.recordNum) {
+        std::cerr << "Error: broken chunk index in " << fileName << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool TeacherFileReader::readChunk(const size_t chunkIdx, std::vector<u8>& records) {
+    assert(chunkIdx < chunks_.size());
+    const TeacherChunkIndex& chunk = chunks_[chunkIdx];
+    const size_t rawSize = static_cast<size_t>(chunk.recordNum) * recordSize_;
+    records.resize(rawSize);
+    ifs_.clear();
+    ifs_.seekg(chunk.offset, std::ios::beg);
+    if (!chunked_) {
+        ifs_.read(reinterpret_cast<char*>(records.data()), rawSize);
+        return static_cast<bool>(ifs_);
+    }
+
+    compressed_.resize(chunk.size);
+    ifs_.read(reinterpret_cast<char*>(compressed_.data()), chunk.size);
+    if (!ifs_) {
+        std::cerr << "Error: cannot read chunk " << chunkIdx << std::endl;
+        return false;
+    }
+    std::vector<u8> shuffled(rawSize);
+    if (chunk.method == TeacherChunkIndex::Compressed) {
+        if (!lzDecompress(compressed_.data(), compressed_.size(), shuffled.data(), rawSize)) {
+            std::cerr << "Error: cannot decompress chunk " << chunkIdx << std::endl;
+            return false;
+        }
+    }
+    else if (chunk.size == rawSize)
+        shuffled.swap(compressed_);
+    else {
+        std::cerr << "Error: broken chunk " << chunkIdx << std::endl;
+        return false;
+    }
+    unshuffleRecords(shuffled.data(), records.data(), recordSize_, chunk.recordNum);
+    if (crc32c(records.data(), rawSize) != chunk.checksum) {
+        std::cerr << "Error: checksum mismatch in chunk " << chunkIdx << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void TeacherFileReader::seek(const u64 recordIdx) {
+    cursor_ = std::min(recordIdx, recordNum_);
+}
+
+size_t TeacherFileReader::read(void* records, const size_t num) {
+    u8* out = static_cast<u8*>(records);
+    size_t readNum = 0;
+    while (readNum < num && cursor_ < recordNum_) {
+        const size_t chunkIdx = findChunk(cursor_);
+        if (chunkIdx != bufferedChunk_) {
+            if (!readChunk(chunkIdx, buffer_)) {
+                bufferedChunk_ = std::numeric_limits<size_t>::max();
+                break;
+            }
+            bufferedChunk_ = chunkIdx;
+        }
+        const size_t offset = static_cast<size_t>(cursor_ - chunkBegins_[chunkIdx]);
+        const size_t n = std::min<size_t>(num - readNum, chunks_[chunkIdx].recordNum - offset);
+        memcpy(out + readNum * recordSize_, buffer_.data() + offset * recordSize_, n * recordSize_);
+        readNum += n;
+        cursor_ += n;
+    }
+    return readNum;
+}
+
+bool TeacherFileWriter::open(const std::string& fileName, const size_t recordSize, const u32 recordsPerChunk) {
+    close();
+    ofs_.clear();
+    ofs_.open(fileName.c_str(), std::ios::binary);
+    if (!ofs_) {
+        std::cerr << "Error: cannot open " << fileName << std::endl;
+        return false;
+    }
+    std::copy(std::begin(TeacherFileHeader::Magic), std::end(TeacherFileHeader::Magic), header_.magic);
+    header_.version = TeacherFileHeader::CurrentVersion;
+    header_.recordSize = static_cast<u32>(recordSize);
+    header_.recordNum = 0;
+    header_.chunkNum = 0;
+    header_.indexOffset = 0;
+    header_.recordsPerChunk = recordsPerChunk;
+    header_.indexChecksum = 0;
+    chunks_.clear();
+    buffer_.clear();
+    // ヘッダは close() で書き直すので、ここでは領域だけ確保しておく。
+    ofs_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+    return true;
+}
+
+void TeacherFileWriter::write(const void* records, const size_t num) {
+    assert(ofs_.is_open());
+    const u8* p = static_cast<const u8*>(records);
+    const size_t chunkBytes = static_cast<size_t>(header_.recordsPerChunk) * header_.recordSize;
+    size_t rest = num * header_.recordSize;
+    while (rest) {
+        const size_t n = std::min(rest, chunkBytes - buffer_.size());
+        buffer_.insert(std::end(buffer_), p, p + n);
+        p += n;
+        rest -= n;
+        if (buffer_.size() == chunkBytes)
+            flushChunk();
+    }
+}
+
+void TeacherFileWriter::flushChunk() {
+    if (buffer_.empty())
+        return;
+    const size_t num = buffer_.size() / header_.recordSize;
+    TeacherChunkIndex chunk;
+    chunk.offset = static_cast<u64>(ofs_.tellp());
+    chunk.recordNum = static_cast<u32>(num);
+    chunk.checksum = crc32c(buffer_.data(), buffer_.size());
+    shuffled_.resize(buffer_.size());
+    shuffleRecords(buffer_.data(), shuffled_.data(), header_.recordSize, num);
+    compressed_.resize(lzCompressBound(shuffled_.size()));
+    const size_t compressedSize = lzCompress(shuffled_.data(), shuffled_.size(), compressed_.data());
+    if (compressedSize < shuffled_.size()) {
+        chunk.method = TeacherChunkIndex::Compressed;
+        chunk.size = static_cast<u32>(compressedSize);
+        ofs_.write(reinterpret_cast<const char*>(compressed_.data()), compressedSize);
+    }
+    else {
+        chunk.method = TeacherChunkIndex::Stored;
+        chunk.size = static_cast<u32>(shuffled_.size());
+        ofs_.write(reinterpret_cast<const char*>(shuffled_.data()), shuffled_.size());
+    }
+    chunks_.push_back(chunk);
+    header_.recordNum += num;
+    buffer_.clear();
+}
+
+bool TeacherFileWriter::close() {
+    if (!ofs_.is_open())
+        return true;
+    flushChunk();
+    header_.chunkNum = chunks_.size();
+    header_.indexOffset = static_cast<u64>(ofs_.tellp());
+    header_.indexChecksum = crc32c(chunks_.data(), sizeof(TeacherChunkIndex) * chunks_.size());
+    ofs_.write(reinterpret_cast<const char*>(chunks_.data()), sizeof(TeacherChunkIndex) * chunks_.size());
+    ofs_.seekp(0, std::ios::beg);
+    ofs_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+    const bool ok = static_cast<bool>(ofs_);
+    ofs_.close();
+    return ok;
+}
+
+TeacherStream::TeacherStream(TeacherFileReader& reader, const size_t slotNum)
+    : reader_(reader), head_(0), endChunk_(0), failed_(false), stop_(true)
+{
+    for (size_t i = 0; i < std::max<size_t>(slotNum, 1); ++i)
+        slots_.emplace_back(new Slot);
+}
+
+void TeacherStream::start(const u64 recordIdx, const u64 endRecordIdx) {
+    stop();
+    for (auto& slot : slots_) {
+        slot->num = 0;
+        slot->state = 0;
+        slot->done = 0;
+    }
+    const u64 end = std::min(endRecordIdx, reader_.size());
+    head_ = (recordIdx < end ? reader_.findChunk(recordIdx) : reader_.chunkNum());
+    endChunk_ = (0 < end ? reader_.findChunk(end - 1) + 1 : 0);
+    failed_ = false;
+    stop_ = false;
+    producer_ = std::thread([this, recordIdx, end] { produce(recordIdx, end); });
+}
+
+void TeacherStream::stop() {
+    stop_ = true;
+    if (producer_.joinable())
+        producer_.join();
+}
+
+void TeacherStream::produce(const u64 recordIdx, const u64 endRecordIdx) {
+    for (size_t k = head_; k < endChunk_; ++k) {
+        Slot& slot = *slots_[k % slots_.size()];
+        // 前に入っていたチャンクが全て取り出されるまで待つ。
+        while (slot.state.load(std::memory_order_acquire) != 0 && slot.done.load(std::memory_order_acquire) != slot.num) {
+            if (stop_)
+                return;
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        // 取り出す側が古い state で CAS 出来ないように、書き換える前に空にしておく。
+        slot.state.store(0, std::memory_order_release);
+        if (!reader_.readChunk(k, slot.records)) {
+            failed_ = true;
+            return;
+        }
+        const u64 offset = (reader_.chunkBegin(k) < recordIdx ? recordIdx - reader_.chunkBegin(k) : 0);
+        slot.num = std::min<u64>(reader_.chunkRecordNum(k), endRecordIdx - reader_.chunkBegin(k));
+        slot.done = offset;
+        slot.state.store(((static_cast<u64>(k) + 1) << 32) | offset, std::memory_order_release);
+    }
+}
+
+size_t TeacherStream::take(void* records, const size_t num) {
+    const size_t recordSize = reader_.recordSize();
+    while (true) {
+        u64 k = head_.load(std::memory_order_acquire);
+        if (endChunk_ <= k)
+            return 0;
+        Slot& slot = *slots_[k % slots_.size()];
+        u64 state = slot.state.load(std::memory_order_acquire);
+        while ((state >> 32) == k + 1) {
+            const u64 begin = state & 0xffffffff;
+            const u64 slotNum = slot.num;
+            if (slotNum <= begin) {
+                // このチャンクは取り出し終わったので次に進める。
+                head_.compare_exchange_strong(k, k + 1);
+                break;
+            }
+            const size_t n = static_cast<size_t>(std::min<u64>(num, slotNum - begin));
+            if (slot.state.compare_exchange_weak(state, state + n, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                // 最後の局面を取り出したら、done を増やしてスロットが再利用される前に次のチャンクに進めておく。
+                if (begin + n == slotNum)
+                    head_.compare_exchange_strong(k, k + 1);
+                memcpy(records, slot.records.data() + begin * recordSize, n * recordSize);
+                slot.done.fetch_add(n, std::memory_order_release);
+                return n;
+            }
+        }
+        if ((state >> 32) != k + 1) {
+            // 先読みが追い付いていない。
+            if (failed_ || stop_)
+                return 0;
+            std::this_thread::yield();
+        }
+    }
+}
+
+void TeacherKeyFilter::init(const size_t sizeMB) {
+    free(mem_);
+    mem_ = nullptr;
+    blocks_ = nullptr;
+    blockNum_ = (static_cast<u64>(sizeMB) << 20) / sizeof(Block);
+    if (blockNum_ == 0)
+        return;
+    // ブロックがキャッシュラインを跨がないようにする。
+    mem_ = calloc(blockNum_ * sizeof(Block) + CacheLineSize - 1, 1);
+    if (mem_ == nullptr) {
+        std::cerr << "Error: Failed to allocate " << sizeMB << "MB for teacher key filter." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    blocks_ = reinterpret_cast<Block*>((uintptr_t(mem_) + CacheLineSize - 1) & ~(CacheLineSize - 1));
+}
+
+bool TeacherKeyFilter::insert(const Key key) {
+    // key は Zobrist hash なので、混ぜ直してからブロックの選択と各 word の bit 位置に使う。
+    u64 h = key * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 32;
+    Block& block = blocks_[h % blockNum_];
+    h = (h ^ key) * 0xbf58476d1ce4e5b9ULL;
+    bool inserted = false;
+    for (auto& word : block.words) {
+        const u64 mask = UINT64_C(1) << (h & 63);
+        h >>= 6;
+        if (!(word.load(std::memory_order_relaxed) & mask)
+            && !(word.fetch_or(mask, std::memory_order_relaxed) & mask))
+        {
+            inserted = true;
+        }
+    }
+    return inserted;
+}
+
+double TeacherKeyFilter::fillRate() const {
+    u64 count = 0;
+    for (u64 i = 0; i < blockNum_; ++i) {
+        for (auto& word : blocks_[i].words)
+            count += count1s(word.load(std::memory_order_relaxed));
+    }
+    return (blockNum_ == 0 ? 0.0 : static_cast<double>(count) / (blockNum_ * 512));
+}
+
+bool TeacherShardWriter::open(const std::string& fileName, const size_t shardNum) {
+    close();
+    shards_.clear();
+    workers_.clear();
+    writtenBytes_ = 0;
+    for (size_t i = 0; i < std::max<size_t>(shardNum, 1); ++i) {
+        shards_.emplace_back(new Shard);
+        Shard& shard = *shards_.back();
+        shard.fileName = (shardNum <= 1 ? fileName : fileName + "." + std::to_string(i));
+        shard.ofs.open(shard.fileName.c_str(), std::ios::binary);
+        if (!shard.ofs) {
+            std::cerr << "Error: cannot open " << shard.fileName << std::endl;
+            shards_.clear();
+            return false;
+        }
+        shard.failed = false;
+    }
+    for (size_t i = 0; i < std::min(shards_.size(), MaxWriterThreads); ++i) {
+        workers_.emplace_back(new Worker);
+        workers_.back()->closing = false;
+    }
+    for (size_t i = 0; i < workers_.size(); ++i)
+        workers_[i]->thread = std::thread([this, i] { run(i); });
+    return true;
+}
+
+void TeacherShardWriter::run(const size_t workerIdx) {
+    Worker& worker = *workers_[workerIdx];
+    const size_t workerNum = workers_.size();
+    std::vector<u8> buffer;
+    size_t cursor = workerIdx; // 受け持つファイルを順番に見る。
+    while (true) {
+        Shard* shard = nullptr;
+        {
+            std::unique_lock<Mutex> lock(worker.mutex);
+            auto findQueued = [&] {
+                for (size_t i = 0; i < shards_.size(); i += workerNum) {
+                    cursor += workerNum;
+                    if (shards_.size() <= cursor)
+                        cursor = workerIdx;
+                    if (!shards_[cursor]->queue.empty())
+                        return shards_[cursor].get();
+                }
+                return static_cast<Shard*>(nullptr);
+            };
+            worker.cond.wait(lock, [&] { return (shard = findQueued()) != nullptr || worker.closing; });
+            if (shard == nullptr)
+                return; // closing
+            buffer.swap(shard->queue.front());
+            shard->queue.pop_front();
+        }
+        worker.cond.notify_all(); // 空きを待っている push() を起こす。
+        shard->ofs.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+        if (!shard->ofs)
+            shard->failed = true;
+        writtenBytes_ += buffer.size();
+        buffer.clear();
+    }
+}
+
+void TeacherShardWriter::push(const size_t shardIdx, std::vector<u8>& buffer) {
+    if (buffer.empty())
+        return;
+    Shard& shard = *shards_[shardIdx % shards_.size()];
+    Worker& worker = *workers_[shardIdx % shards_.size() % workers_.size()];
+    const size_t capacity = buffer.capacity();
+    {
+        std::unique_lock<Mutex> lock(worker.mutex);
+        worker.cond.wait(lock, [&shard] { return shard.queue.size() < MaxQueuedBuffers; });
+        shard.queue.emplace_back();
+        shard.queue.back().swap(buffer);
+    }
+    worker.cond.notify_all();
+    buffer.reserve(capacity); // 渡した分と同じだけ確保し直しておく。
+}
+
+bool TeacherShardWriter::close() {
+    if (workers_.empty())
+        return true;
+    for (auto& worker : workers_) {
+        {
+            std::unique_lock<Mutex> lock(worker->mutex);
+            worker->closing = true;
+        }
+        worker->cond.notify_all();
+        worker->thread.join();
+    }
+    workers_.clear();
+    bool ok = true;
+    for (auto& shard : shards_) {
+        shard->ofs.close();
+        if (shard->failed) {
+            std::cerr << "Error: cannot write " << shard->fileName << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+bool TeacherShardWriter::merge(const std::string& fileName) {
+    if (shards_.size() <= 1)
+        return true;
+    std::ofstream ofs(fileName.c_str(), std::ios::binary);
+    if (!ofs) {
+        std::cerr << "Error: cannot open " << fileName << std::endl;
+        return false;
+    }
+    std::vector<char> buffer(1 << 24);
+    for (auto& shard : shards_) {
+        std::ifstream ifs(shard->fileName.c_str(), std::ios::binary);
+        if (!ifs) {
+            std::cerr << "Error: cannot open " << shard->fileName << std::endl;
+            return false;
+        }
+        while (ifs.read(buffer.data(), buffer.size()) || ifs.gcount())
+            ofs.write(buffer.data(), ifs.gcount());
+    }
+    if (!ofs) {
+        std::cerr << "Error: cannot write " << fileName << std::endl;
+        return false;
+    }
+    for (auto& shard : shards_)
+        std::remove(shard->fileName.c_str());
+    return true;
+}
+
+void packTeacher(std::istringstream& ssCmd) {
+    std::string inputFileName;
+    std::string outputFileName;
+    std::string recordType;
+    u32 recordsPerChunk = TeacherFileReader::DefaultRecordsPerChunk;
+    ssCmd >> inputFileName >> outputFileName >> recordType;
+    ssCmd >> recordsPerChunk;
+    size_t recordSize;
+    if (!recordSizeFromName(recordType, recordSize))
+        return;
+    if (recordsPerChunk == 0)
+        recordsPerChunk = TeacherFileReader::DefaultRecordsPerChunk;
+    TeacherFileReader reader;
+    TeacherFileWriter writer;
+    if (!reader.open(inputFileName, recordSize) || !writer.open(outputFileName, recordSize, recordsPerChunk))
+        return;
+    Timer t = Timer::currentTime();
+    std::vector<u8> records(static_cast<size_t>(recordsPerChunk) * recordSize);
+    size_t num;
+    while ((num = reader.read(records.data(), recordsPerChunk)) != 0)
+        writer.write(records.data(), num);
+    if (reader.tell() != reader.size() || !writer.close()) {
+        std::cerr << "Error: failed to pack " << inputFileName << std::endl;
+        return;
+    }
+    std::ifstream ifs(outputFileName.c_str(), std::ios::binary | std::ios::ate);
+    std::cout << "packed " << reader.size() << " records: "
+              << reader.size() * recordSize << " -> " << static_cast<u64>(ifs.tellg()) << " bytes in "
+              << t.elapsed() / 1000 << " seconds." << std::endl;
+}
+
+void unpackTeacher(std::istringstream& ssCmd) {
+    std::string inputFileName;
+    std::string outputFileName;
+    std::string recordType;
+    ssCmd >> inputFileName >> outputFileName >> recordType;
+    size_t recordSize;
+    if (!recordSizeFromName(recordType, recordSize))
+        return;
+    TeacherFileReader reader;
+    if (!reader.open(inputFileName, recordSize))
+        return;
+    std::ofstream ofs(outputFileName.c_str(), std::ios::binary);
+    if (!ofs) {
+        std::cerr << "Error: cannot open " << outputFileName << std::endl;
+        return;
+    }
+    std::vector<u8> records;
+    for (size_t i = 0; i < reader.chunkNum(); ++i) {
+        if (!reader.readChunk(i, records)) {
+            std::cerr << "Error: failed to unpack " << inputFileName << std::endl;
+            return;
+        }
+        ofs.write(reinterpret_cast<const char*>(records.data()), records.size());
+    }
+    std::cout << "unpacked " << reader.size() << " records." << std::endl;
+}
+
+namespace {
+    // 局面 (HuffmanCodedPos の部分) のバイト列のハッシュ値。同じ局面は同じバイト列に符号化される。
+    u64 teacherPositionHash(const u8* record, const u64 seed) {
+        u64 h = seed;
+        for (size_t i = 0; i < sizeof(HuffmanCodedPos); i += sizeof(u64)) {
+            u64 v;
+            memcpy(&v, record + i, sizeof(v));
+            h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+            h ^= h >> 29;
+        }
+        return h;
+    }
+
+    // 1 回の振り分けで使うバケツの数の上限。同時に開くファイルの数と、書き込み待ちのバッファの数を抑える。
+    const size_t MaxBucketNum = 256;
+    // 振り分け直す回数の上限。重複を除く場合、同じ局面ばかりのバケツは何度振り分けても小さくならない。
+    const int MaxScatterDepth = 3;
+
+    // reader の局面を bucketNum 個のバケツのファイル (baseName.0, baseName.1, ...) に振り分け、ファイル名を bucketFileNames に加える。
+    // bucketNum が 1 なら baseName に書き出す。
+    // 重複を除く場合は同じ局面が同じバケツに入るように局面のハッシュ値で、そうでなければ乱数で振り分ける。
+    // 読み込みは TeacherStream で先読みし、書き込みは TeacherShardWriter のスレッドで行うので、読み書きが並行して進む。
+    bool scatterTeacher(TeacherFileReader& reader, const std::string& baseName, const size_t bucketNum, const size_t recordSize,
+                        const u64 memoryBytes, const bool dedup, const u64 seed, std::vector<std::string>& bucketFileNames)
+    {
+        assert(1 <= bucketNum && bucketNum <= MaxBucketNum);
+        // 振り分け中は、バケツごとの書き込み待ちのバッファ (最大 MaxQueuedBuffers + 1 個) も memory に収める。
+        const size_t bufferRecords = static_cast<size_t>(std::max<u64>(std::min<u64>(memoryBytes / bucketNum
+                                                                                      / (TeacherShardWriter::MaxQueuedBuffers + 1) / recordSize,
+                                                                                      (1 << 20) / recordSize), 1));
+        std::vector<std::string> names;
+        for (size_t i = 0; i < bucketNum; ++i)
+            names.push_back(bucketNum <= 1 ? baseName : baseName + "." + std::to_string(i));
+        TeacherShardWriter writer;
+        if (!writer.open(baseName, bucketNum))
+            return false;
+        std::vector<std::vector<u8> > buffers(bucketNum);
+        for (auto& buffer : buffers)
+            buffer.reserve(bufferRecords * recordSize);
+        TeacherStream stream(reader);
+        stream.start();
+        std::mt19937_64 mt(seed);
+        std::vector<u8> records(TeacherFileReader::DefaultRecordsPerChunk * recordSize);
+        size_t num;
+        while ((num = stream.take(records.data(), TeacherFileReader::DefaultRecordsPerChunk)) != 0) {
+            for (size_t i = 0; i < num; ++i) {
+                const u8* record = &records[i * recordSize];
+                const size_t bucketIdx = static_cast<size_t>((dedup ? teacherPositionHash(record, seed) : mt()) % bucketNum);
+                std::vector<u8>& buffer = buffers[bucketIdx];
+                buffer.insert(std::end(buffer), record, record + recordSize);
+                if (bufferRecords * recordSize <= buffer.size())
+                    writer.push(bucketIdx, buffer);
+            }
+        }
+        const bool failed = stream.failed();
+        stream.stop();
+        for (size_t i = 0; i < bucketNum; ++i)
+            writer.push(i, buffers[i]);
+        if (!writer.close() || failed) {
+            for (auto& name : names)
+                std::remove(name.c_str());
+            return false;
+        }
+        bucketFileNames.insert(std::end(bucketFileNames), std::begin(names), std::end(names));
+        return true;
+    }
+}
+
+void shuffleTeacher(std::istringstream& ssCmd) {
+    std::string inputFileName;
+    std::string outputFileName;
+    std::string recordType;
+    ssCmd >> inputFileName >> outputFileName >> recordType;
+    int threadNum = 1;
+    u64 memoryMB = 1024;
+    bool dedup = false;
+    bool pack = false;
+    std::string token;
+    while (ssCmd >> token) {
+        if      (token == "threads") ssCmd >> threadNum;
+        else if (token == "memory" ) ssCmd >> memoryMB;
+        else if (token == "dedup"  ) dedup = true;
+        else if (token == "pack"   ) pack = true;
+        else {
+            std::cerr << "Error: unknown option " << token << std::endl;
+            return;
+        }
+    }
+    size_t recordSize;
+    if (!recordSizeFromName(recordType, recordSize))
+        return;
+    if (threadNum <= 0 || memoryMB == 0) {
+        std::cerr << "Error: invalid threads or memory" << std::endl;
+        return;
+    }
+    TeacherFileReader reader;
+    if (!reader.open(inputFileName, recordSize))
+        return;
+    Timer t = Timer::currentTime();
+
+    // 1 つのバケツを読み込んで並べ替える時に、局面と並べ替え用の添字で局面あたり recordSize + 8 byte 使う。
+    // 各スレッドが同時に 1 つずつバケツを持つので、その合計が memory に収まるようにバケツ数を決める。
+    // バケツの大きさには偏りがあるので、余裕を見て半分程度にしておく。
+    const u64 memoryBytes = memoryMB << 20;
+    const u64 bucketRecords = std::min<u64>(std::max<u64>(memoryBytes / threadNum / (recordSize + sizeof(u64)) / 2, 1),
+                                            std::numeric_limits<u32>::max());
+    const u64 seed = std::random_device()() ^ static_cast<u64>(std::chrono::system_clock::now().time_since_epoch().count());
+    auto bucketNumOf = [bucketRecords](const u64 records) {
+        return static_cast<size_t>(std::min<u64>((records + bucketRecords - 1) / bucketRecords, MaxBucketNum));
+    };
+
+    // 1. 局面をバケツごとのファイルに振り分ける。
+    // 1 回に振り分けるバケツの数は MaxBucketNum までなので、メモリに載らない大きさのバケツが残れば、それを更に振り分ける。
+    // 振り分けるたびに別の seed を使うので、重複を除く場合も同じハッシュ値の下位の bit で偏る事は無い。
+    std::vector<std::string> bucketFileNames;
+    auto removeBuckets = [&bucketFileNames] {
+        for (auto& name : bucketFileNames)
+            std::remove(name.c_str());
+    };
+    if (!scatterTeacher(reader, outputFileName + ".bucket", std::max<size_t>(bucketNumOf(reader.size()), 1), recordSize, memoryBytes, dedup, seed, bucketFileNames)) {
+        std::cerr << "Error: failed to scatter " << inputFileName << std::endl;
+        return;
+    }
+    std::vector<int> depths(bucketFileNames.size(), 0); // bucketFileNames のそれぞれを振り分け直した回数
+    for (size_t i = 0; i < bucketFileNames.size(); ++i) {
+        const std::string name = bucketFileNames[i];
+        if (MaxScatterDepth <= depths[i])
+            continue;
+        TeacherFileReader bucketReader;
+        if (!bucketReader.open(name, recordSize)) {
+            removeBuckets();
+            return;
+        }
+        // バケツの大きさの偏りの分は bucketRecords の余裕で吸収出来るので、その 2 倍を超えたものだけ振り分け直す。
+        if (bucketReader.size() <= 2 * bucketRecords)
+            continue;
+        const size_t subBucketNum = bucketNumOf(bucketReader.size());
+        std::vector<std::string> subBucketFileNames;
+        if (!scatterTeacher(bucketReader, name, subBucketNum, recordSize, memoryBytes, dedup, seed + (i + 1) * 0x9e3779b97f4a7c15ULL, subBucketFileNames)) {
+            std::cerr << "Error: failed to scatter " << name << std::endl;
+            removeBuckets();
+            return;
+        }
+        std::remove(name.c_str());
+        const int depth = depths[i] + 1;
+        bucketFileNames[i] = subBucketFileNames.back();
+        depths[i] = depth;
+        subBucketFileNames.pop_back();
+        bucketFileNames.insert(std::end(bucketFileNames), std::begin(subBucketFileNames), std::end(subBucketFileNames));
+        depths.resize(bucketFileNames.size(), depth);
+        --i; // 入れ替えたバケツも調べる。
+    }
+    const size_t bucketNum = bucketFileNames.size();
+    std::cout << "scattered " << reader.size() << " records into " << bucketNum << " buckets in " << t.elapsed() / 1000 << " seconds." << std::endl;
+
+    // 2. バケツを 1 つずつメモリに読み込み、重複を除いてシャッフルして書き出す。
+    // 読み込み、並べ替えは各スレッドで並行して行い、書き出しだけ排他制御する。
+    // バケツを書き出す順番は完了順になるが、バケツへの振り分けが無作為なので問題無い。
+    std::ofstream ofs;
+    TeacherFileWriter packWriter;
+    if (pack) {
+        if (!packWriter.open(outputFileName, recordSize)) {
+            removeBuckets();
+            return;
+        }
+    }
+    else {
+        ofs.open(outputFileName.c_str(), std::ios::binary);
+        if (!ofs) {
+            std::cerr << "Error: cannot open " << outputFileName << std::endl;
+            removeBuckets();
+            return;
+        }
+    }
+    Mutex outputMutex;
+    std::atomic<size_t> nextBucket(0);
+    std::atomic<u64> writtenRecords(0);
+    std::atomic<bool> failed(false);
+    auto func = [&](const int threadIdx) {
+        std::vector<u8> records;
+        std::vector<u8> shuffled;
+        std::vector<u32> order;
+        size_t bucketIdx;
+        while (!failed && (bucketIdx = nextBucket++) < bucketNum) {
+            const std::string& name = bucketFileNames[bucketIdx];
+            {
+                std::ifstream ifs(name.c_str(), std::ios::binary | std::ios::ate);
+                if (!ifs) {
+                    std::cerr << "Error: cannot open " << name << std::endl;
+                    failed = true;
+                    return;
+                }
+                records.resize(static_cast<size_t>(ifs.tellg()));
+                ifs.seekg(0, std::ios::beg);
+                ifs.read(reinterpret_cast<char*>(records.data()), records.size());
+                if (!ifs || records.size() % recordSize != 0) {
+                    std::cerr << "Error: cannot read " << name << std::endl;
+                    failed = true;
+                    return;
+                }
+            }
+            std::remove(name.c_str());
+            const size_t num = records.size() / recordSize;
+            order.resize(num);
+            std::iota(std::begin(order), std::end(order), 0);
+            if (dedup) {
+                // 局面のバイト列で並べて、同じ局面が連続したら最初のもの以外を除く。
+                auto position = [&](const u32 i) { return &records[static_cast<size_t>(i) * recordSize]; };
+                std::sort(std::begin(order), std::end(order), [&](const u32 a, const u32 b) {
+                        const int c = memcmp(position(a), position(b), sizeof(HuffmanCodedPos));
+                        return c < 0 || (c == 0 && a < b);
+                    });
+                order.erase(std::unique(std::begin(order), std::end(order), [&](const u32 a, const u32 b) {
+                            return memcmp(position(a), position(b), sizeof(HuffmanCodedPos)) == 0;
+                        }), std::end(order));
+            }
+            std::mt19937_64 mt(seed + bucketIdx * 0x9e3779b97f4a7c15ULL + threadIdx);
+            std::shuffle(std::begin(order), std::end(order), mt);
+            shuffled.resize(order.size() * recordSize);
+            for (size_t i = 0; i < order.size(); ++i)
+                memcpy(&shuffled[i * recordSize], &records[static_cast<size_t>(order[i]) * recordSize], recordSize);
+            {
+                std::unique_lock<Mutex> lock(outputMutex);
+                if (pack)
+                    packWriter.write(shuffled.data(), order.size());
+                else
+                    ofs.write(reinterpret_cast<const char*>(shuffled.data()), shuffled.size());
+            }
+            writtenRecords += order.size();
+        }
+    };
+    std::vector<std::thread> threads(threadNum);
+    for (int i = 0; i < threadNum; ++i)
+        threads[i] = std::thread([&func, i] { func(i); });
+    for (auto& th : threads)
+        th.join();
+    if (pack) {
+        if (!packWriter.close())
+            failed = true;
+    }
+    else {
+        ofs.close();
+        if (!ofs)
+            failed = true;
+    }
+    if (failed) {
+        std::cerr << "Error: failed to shuffle " << inputFileName << std::endl;
+        removeBuckets();
+        return;
+    }
+    std::cout << "shuffled " << writtenRecords << " records";
+    if (dedup)
+        std::cout << " (" << reader.size() - writtenRecords << " duplicates removed)";
+    std::cout << " in " << t.elapsed() / 1000 << " seconds." << std::endl;
+}
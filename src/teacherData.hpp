@@ -0,0 +1,259 @@
+/*
+  Apery, a USI shogi playing engine derived from Stockfish, a UCI chess playing engine.
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+  Copyright (C) 2011-2017 Hiraoka Takuya
+
+  Apery is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Apery is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef APERY_TEACHERDATA_HPP
+#define APERY_TEACHERDATA_HPP
+
+#include "common.hpp"
+#include <memory>
+#include <deque>
+
+// 教師データのファイル形式。
+// 生の形式は HuffmanCodedPos や HuffmanCodedPosAndEval を単に並べたもの。
+// チャンク形式は固定数の局面ごとにチャンクに分けて圧縮し、ファイルヘッダからチャンクの索引を引けるようにしたもの。
+//
+// チャンク形式のレイアウト
+//   TeacherFileHeader
+//   チャンク 0, チャンク 1, ...
+//   TeacherChunkIndex * chunkNum (header.indexOffset の位置)
+//
+// チャンクの中身は、レコードのバイト位置ごとに並べ直してから (同じフィールドの値が近くに集まる) LZ 系の圧縮をしたもの。
+// 圧縮しても小さくならなければ並べ直しだけを行って格納する。
+
+struct TeacherFileHeader {
+    static const char Magic[8];
+    static const u32 CurrentVersion = 1;
+
+    char magic[8];
+    u32 version;
+    u32 recordSize;
+    u64 recordNum;
+    u64 chunkNum;
+    u64 indexOffset;
+    u32 recordsPerChunk;
+    u32 indexChecksum; // 索引全体の crc32c
+};
+static_assert(sizeof(TeacherFileHeader) == 48, "");
+
+struct TeacherChunkIndex {
+    enum : u32 { Stored = 0, Compressed = 1 };
+
+    u64 offset;    // ファイル先頭からのチャンクの位置
+    u32 size;      // ファイル上のチャンクのサイズ
+    u32 recordNum; // チャンクに含まれる局面数
+    u32 checksum;  // 展開後のデータの crc32c
+    u32 method;
+};
+static_assert(sizeof(TeacherChunkIndex) == 24, "");
+
+// CRC-32C (Castagnoli)。SSE4.2 があれば専用命令を使う。どちらでも同じ値になる。
+u32 crc32c(const void* data, const size_t size, u32 crc = 0);
+
+// 教師データのチャンク用の軽量な LZ 圧縮。
+// 圧縮後のサイズの上限
+inline size_t lzCompressBound(const size_t size) { return size + size / 255 + 16; }
+// dst には lzCompressBound(srcSize) 以上の領域が必要。圧縮後のサイズを返す。
+size_t lzCompress(const u8* src, const size_t srcSize, u8* dst);
+// 展開後のサイズがちょうど dstSize にならなければ false を返す。
+bool lzDecompress(const u8* src, const size_t srcSize, u8* dst, const size_t dstSize);
+
+// 生の形式、チャンク形式のどちらも同じように読む為のクラス。
+// 生の形式も recordsPerChunk 局面ごとの仮想的なチャンクに分けて扱う。
+// スレッドセーフではないので、複数スレッドから使う場合は排他制御すること。
+class TeacherFileReader {
+public:
+    static const u32 DefaultRecordsPerChunk = 1 << 16;
+
+    bool open(const std::string& fileName, const size_t recordSize);
+    bool isChunked() const { return chunked_; }
+    size_t recordSize() const { return recordSize_; }
+    u64 size() const { return recordNum_; }
+    size_t chunkNum() const { return static_cast<size_t>(chunks_.size()); }
+    size_t chunkRecordNum(const size_t chunkIdx) const { return chunks_[chunkIdx].recordNum; }
+    // chunkIdx 番目のチャンクの先頭の局面の通し番号
+    u64 chunkBegin(const size_t chunkIdx) const { return chunkBegins_[chunkIdx]; }
+    // recordIdx 番目の局面を含むチャンクの番号
+    size_t findChunk(const u64 recordIdx) const {
+        return std::upper_bound(std::begin(chunkBegins_), std::end(chunkBegins_), recordIdx) - std::begin(chunkBegins_) - 1;
+    }
+
+    // チャンクを丸ごと読み込んで展開する。チェックサムが合わなければ false を返す。
+    bool readChunk(const size_t chunkIdx, std::vector<u8>& records);
+    // 先頭から順に num 局面まで読み込み、読み込んだ局面数を返す。終端なら 0 を返す。
+    size_t read(void* records, const size_t num);
+    // 順に読み込む位置を局面の通し番号で指定する。
+    void seek(const u64 recordIdx);
+    // 次に順に読み込む局面の通し番号
+    u64 tell() const { return cursor_; }
+
+private:
+    std::ifstream ifs_;
+    bool chunked_;
+    size_t recordSize_;
+    u64 recordNum_;
+    std::vector<TeacherChunkIndex> chunks_;
+    std::vector<u64> chunkBegins_;
+    u64 cursor_;
+    // read() の為に展開済みのチャンク
+    size_t bufferedChunk_;
+    std::vector<u8> buffer_;
+    std::vector<u8> compressed_;
+};
+
+// チャンク形式で書き出す為のクラス。
+class TeacherFileWriter {
+public:
+    ~TeacherFileWriter() { close(); }
+    bool open(const std::string& fileName, const size_t recordSize, const u32 recordsPerChunk = TeacherFileReader::DefaultRecordsPerChunk);
+    void write(const void* records, const size_t num);
+    // 索引とヘッダを書き込んで閉じる。
+    bool close();
+
+private:
+    void flushChunk();
+
+    std::ofstream ofs_;
+    TeacherFileHeader header_;
+    std::vector<TeacherChunkIndex> chunks_;
+    std::vector<u8> buffer_;
+    std::vector<u8> shuffled_;
+    std::vector<u8> compressed_;
+};
+
+// TeacherFileReader から先頭から順に局面を読み出す。
+// バックグラウンドのスレッドがチャンク単位で先読みと展開を行い、リングバッファに並べておく。
+// 取り出す側は CAS でチャンク内の位置を進めるだけなので、複数スレッドから同時に take() してもロックを取らない。
+// 先読みが追い付いていない場合だけ、取り出す側は yield して待つ。
+class TeacherStream {
+public:
+    static const size_t DefaultSlotNum = 4;
+
+    explicit TeacherStream(TeacherFileReader& reader, const size_t slotNum = DefaultSlotNum);
+    ~TeacherStream() { stop(); }
+    // recordIdx 番目の局面から先読みを始める。endRecordIdx 番目の局面の手前で終端とする。
+    void start(const u64 recordIdx = 0, const u64 endRecordIdx = std::numeric_limits<u64>::max());
+    void stop();
+    // 最大 num 局面を取り出し、取り出した局面数を返す。チャンクを跨がないので num 未満になる事がある。
+    // 終端か、読み込みに失敗した場合は 0 を返す。
+    size_t take(void* records, const size_t num);
+    bool failed() const { return failed_; }
+
+private:
+    struct Slot {
+        std::vector<u8> records;
+        std::atomic<u64> num;
+        // 上位 32bit がチャンクの通し番号 + 1 (0 は空)、下位 32bit が次に取り出すチャンク内の位置
+        std::atomic<u64> state;
+        std::atomic<u64> done; // 取り出し終わった局面数。num と等しくなれば再利用出来る。
+    };
+    void produce(const u64 recordIdx, const u64 endRecordIdx);
+
+    TeacherFileReader& reader_;
+    std::vector<std::unique_ptr<Slot> > slots_;
+    std::atomic<u64> head_; // 取り出し中のチャンクの通し番号
+    u64 endChunk_;          // 取り出す最後のチャンクの次の通し番号
+    std::atomic<bool> failed_;
+    std::atomic<bool> stop_;
+    std::thread producer_;
+};
+
+// 生の形式の教師データを shardNum 個のファイルに分けて、書き込み用のスレッドで非同期に書き出す。
+// 書き込み用のスレッドは最大 MaxWriterThreads 個で、shardIdx % スレッド数 が同じファイルを 1 つのスレッドが受け持つ。
+// 書き出す側は溜めたバッファを渡すだけなので、ファイルへの書き込みを待たない。
+// ただし書き込みが追い付かずに 1 つのファイルに MaxQueuedBuffers 個を超えて溜まった場合は待つ。
+class TeacherShardWriter {
+public:
+    static const size_t MaxQueuedBuffers = 8;
+    static const size_t MaxWriterThreads = 8;
+
+    ~TeacherShardWriter() { close(); }
+    // shardNum が 1 なら fileName に、そうでなければ fileName.0, fileName.1, ... に書き出す。
+    bool open(const std::string& fileName, const size_t shardNum);
+    size_t shardNum() const { return shards_.size(); }
+    // buffer の中身を shardIdx 番目のファイルに書き出す。buffer は空の状態で返る。
+    void push(const size_t shardIdx, std::vector<u8>& buffer);
+    // 溜まっている分を全て書き出して閉じる。
+    bool close();
+    // 全てのファイルを fileName に連結し、元のファイルを削除する。close() の後に呼ぶ。
+    bool merge(const std::string& fileName);
+    // これまでにファイルに書き出したバイト数
+    u64 writtenBytes() const { return writtenBytes_; }
+
+private:
+    struct Shard {
+        std::string fileName;
+        std::ofstream ofs;
+        std::deque<std::vector<u8> > queue; // 受け持つ Worker の mutex で保護する。
+        bool failed;
+    };
+    struct Worker {
+        Mutex mutex;
+        ConditionVariable cond;
+        std::thread thread;
+        bool closing;
+    };
+    void run(const size_t workerIdx);
+
+    std::vector<std::unique_ptr<Shard> > shards_;
+    std::vector<std::unique_ptr<Worker> > workers_;
+    std::atomic<u64> writtenBytes_;
+};
+
+// 教師局面を作る時に、既に書き出した局面を飛ばす為の局面の key の集合。
+// 使うメモリが一定の blocked bloom filter で、key ごとに 64 byte のブロック 1 つの中の 8 bit を使う。
+// 複数スレッドから同時に insert() してもロックを取らない。
+// 偽陽性があるので、書き出していない局面を書き出し済みと判定する事がある。
+// また、同じ key を同時に insert() した場合は、両方が新しい局面と判定する事がある。
+class TeacherKeyFilter {
+public:
+    ~TeacherKeyFilter() { free(mem_); }
+    // sizeMB [MB] の領域を確保する。0 なら何もしない。
+    void init(const size_t sizeMB);
+    bool enabled() const { return blockNum_ != 0; }
+    // key を加える。加える前に無かった (と判定した) なら true を返す。
+    bool insert(const Key key);
+    // 立っている bit の割合。偽陽性の確率の目安になる。
+    double fillRate() const;
+
+private:
+    struct Block {
+        std::atomic<u64> words[8];
+    };
+    static_assert(sizeof(Block) == CacheLineSize, "");
+    void* mem_ = nullptr;
+    Block* blocks_ = nullptr;
+    u64 blockNum_ = 0;
+};
+
+// 生の形式とチャンク形式を相互に変換する。
+// pack_teacher <input> <output> <hcp|hcpe> [records_per_chunk]
+void packTeacher(std::istringstream& ssCmd);
+// unpack_teacher <input> <output> <hcp|hcpe>
+void unpackTeacher(std::istringstream& ssCmd);
+// 教師データをメモリに載せずにシャッフルする。
+// 局面を無作為にバケツごとの一時ファイルに振り分けてから、バケツごとにメモリ上でシャッフルして書き出す。
+// memory (MB) はバケツの読み込みと振り分け中のバッファに使うメモリの目安で、バケツ数はこれから決める。
+// dedup を指定すると、局面のハッシュ値でバケツに振り分けて、同じ局面が複数あれば 1 つだけ残す。
+// pack を指定するとチャンク形式で、そうでなければ生の形式で書き出す。
+// shuffle_teacher <input> <output> <hcp|hcpe> [threads <n>] [memory <MB>] [dedup] [pack]
+void shuffleTeacher(std::istringstream& ssCmd);
+
+#endif // #ifndef APERY_TEACHERDATA_HPP
@@ -0,0 +1,39 @@
+#!/bin/sh
+# load_eval した直後の write_eval が、読み込んだ評価関数をそのまま書き出す事を確かめる。
+# eval_dir の次元下げした評価関数を 2 つの一時ディレクトリにコピーし、片方は Eval_Dir に指定して write_eval、
+# もう片方は load_eval してから write_eval して、書き出された *_synthesized.bin が一致すれば成功とする。
+# 使い方: load_eval_write_eval.sh <engine> <eval_dir>
+
+if [ $# -ne 2 ]; then
+    echo "usage: $0 <engine> <eval_dir>" >&2
+    exit 1
+fi
+engine=$1
+evalDir=$2
+for f in kpps.kpp.bin kkps.kkp.bin kks.kk.bin; do
+    if [ ! -f "$evalDir/$f" ]; then
+        echo "Error: $evalDir/$f is not found" >&2
+        exit 1
+    fi
+done
+
+workDir=$(mktemp -d) || exit 1
+trap 'rm -rf "$workDir"' EXIT
+mkdir "$workDir/expected" "$workDir/loaded"
+for f in kpps.kpp.bin kkps.kkp.bin kks.kk.bin; do
+    cp "$evalDir/$f" "$workDir/expected/" || exit 1
+    cp "$evalDir/$f" "$workDir/loaded/" || exit 1
+done
+
+printf "setoption name Eval_Dir value %s\nwrite_eval\nquit\n" "$workDir/expected" | "$engine" > /dev/null || exit 1
+printf "load_eval %s\nwrite_eval\nquit\n" "$workDir/loaded" | "$engine" > /dev/null || exit 1
+
+status=0
+for f in KPP_synthesized.bin KKP_synthesized.bin KK_synthesized.bin; do
+    if ! cmp -s "$workDir/expected/$f" "$workDir/loaded/$f"; then
+        echo "NG: $f written after load_eval differs" >&2
+        status=1
+    fi
+done
+[ $status -eq 0 ] && echo "OK: load_eval -> write_eval"
+exit $status
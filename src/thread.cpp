@@ -111,6 +111,7 @@ s64 ThreadPool::nodesSearched() const {
 
 void ThreadPool::startThinking(const Position& pos, const LimitsType& limits, StateListPtr& states) {
     main()->waitForSearchFinished();
+    Evaluator::switchTable(); // load_eval で読み込んだ評価関数があれば、探索していない今のうちに切り替える。
     pos.searcher()->signals.stopOnPonderHit = pos.searcher()->signals.stop = false;
     pos.searcher()->limits = limits;
     std::vector<RootMove> rootMoves;
@@ -123,6 +123,7 @@ struct Thread {
     MoveStats counterMoves;
     FromToStats fromTo;
     CounterMoveHistoryStats counterMoveHistory;
+    KingKPPCache kingKPPCache;
 
 private:
     std::thread nativeThread;
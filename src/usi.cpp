@@ -30,6 +30,9 @@
 #include "thread.hpp"
 #include "benchmark.hpp"
 #include "learner.hpp"
+#include "teacherData.hpp"
+#include "learnerNetwork.hpp"
+#include "learnerCheckpoint.hpp"
 
 namespace {
     void onThreads(Searcher* s, const USIOption&)      { s->threads.readUSIOptions(s); }
@@ -91,6 +94,7 @@ void OptionsMap::init(Searcher* s) {
     (*this)["Eval_Dir"]                    = USIOption("20170329");
     (*this)["Best_Book_Move"]              = USIOption(false);
     (*this)["OwnBook"]                     = USIOption(true);
+    (*this)["Book_Mmap"]                   = USIOption(true); // isready で定跡ファイルをメモリにマップして索引を作る。
     (*this)["Min_Book_Ply"]                = USIOption(SHRT_MAX, 0, SHRT_MAX);
     (*this)["Max_Book_Ply"]                = USIOption(SHRT_MAX, 0, SHRT_MAX);
     (*this)["Min_Book_Score"]              = USIOption(-180, -ScoreInfinite, ScoreInfinite);
@@ -347,15 +351,39 @@ void randomMove(Position& pos, std::mt19937& mt) {
     setPosition(pos, ss);
 }
 // 教師局面を作成する。100万局面で34MB。
+// make_teacher <roots> <output> <threads> <nodes> [shards <n>] [merge] [filter <MB>]
+// shards を 2 以上にすると output.0, output.1, ... に分けて書き出し、merge を付けると最後に output に連結する。shards の既定値は 1。
+// filter を付けると、既に書き出した局面を指定した大きさ (MB) のフィルタで判定して書き出さない。
+// 偽陽性があるので、書き出していない局面も少し飛ばす事になる。既定では使わない。
 void make_teacher(std::istringstream& ssCmd) {
     std::string recordFileName;
     std::string outputFileName;
     int threadNum;
     s64 teacherNodes; // 教師局面数
+    int shardNum = 1;
+    std::string mergeStr;
+    size_t filterMB = 0;
     ssCmd >> recordFileName;
     ssCmd >> outputFileName;
     ssCmd >> threadNum;
     ssCmd >> teacherNodes;
+    std::string token;
+    while (ssCmd >> token) {
+        if (token == "shards")
+            ssCmd >> shardNum;
+        else if (token == "merge")
+            mergeStr = token;
+        else if (token == "filter")
+            ssCmd >> filterMB;
+        else {
+            std::cerr << "Error: unknown option " << token << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (shardNum <= 0) {
+        std::cerr << "Error: shard num = " << shardNum << std::endl;
+        exit(EXIT_FAILURE);
+    }
     if (threadNum <= 0) {
         std::cerr << "Error: thread num = " << threadNum << std::endl;
         exit(EXIT_FAILURE);
@@ -379,39 +407,63 @@ void make_teacher(std::istringstream& ssCmd) {
         }
         positions.emplace_back(DefaultStartPositionSFEN, s.threads.main(), s.thisptr);
     }
-    std::ifstream ifs(recordFileName.c_str(), std::ifstream::in | std::ifstream::binary | std::ios::ate);
-    if (!ifs) {
-        std::cerr << "Error: cannot open " << recordFileName << std::endl;
+    // 生の形式とチャンク形式のどちらでも読み込める。
+    TeacherFileReader reader;
+    if (!reader.open(recordFileName, sizeof(HuffmanCodedPos)))
+        exit(EXIT_FAILURE);
+    if (reader.size() == 0) {
+        std::cerr << "Error: " << recordFileName << " has no positions" << std::endl;
         exit(EXIT_FAILURE);
     }
-    const size_t entryNum = ifs.tellg() / sizeof(HuffmanCodedPos);
-    std::uniform_int_distribution<s64> inputFileDist(0, entryNum-1);
+    std::uniform_int_distribution<size_t> inputChunkDist(0, reader.chunkNum()-1);
 
     Mutex imutex;
-    Mutex omutex;
-    std::ofstream ofs(outputFileName.c_str(), std::ios::binary);
-    if (!ofs) {
-        std::cerr << "Error: cannot open " << outputFileName << std::endl;
+    TeacherShardWriter writer;
+    if (!writer.open(outputFileName, shardNum))
         exit(EXIT_FAILURE);
-    }
-    auto func = [&omutex, &ofs, &imutex, &ifs, &inputFileDist, &teacherNodes](Position& pos, std::atomic<s64>& idx, const int threadID) {
+    // 全スレッドで共有し、書き出した局面を記録しておく。
+    TeacherKeyFilter filter;
+    filter.init(filterMB);
+    std::atomic<s64> skippedGames(0);     // 開始局面が書き出し済みだったので探索しなかった対局数
+    std::atomic<s64> duplicatedNodes(0); // 対局途中で書き出し済みだったので書き出さなかった局面数
+    auto func = [&writer, &imutex, &reader, &inputChunkDist, &teacherNodes, &filter, &skippedGames, &duplicatedNodes]
+        (Position& pos, std::atomic<s64>& idx, const int threadID)
+    {
         std::mt19937 mt(std::chrono::system_clock::now().time_since_epoch().count() + threadID);
         std::uniform_real_distribution<double> doRandomMoveDist(0.0, 1.0);
+        // チャンク単位でしか読めないので、ランダムに選んだチャンクから RootsPerChunk 局面をランダムに選んでから次のチャンクに移る。
+        constexpr int RootsPerChunk = 64;
+        std::vector<u8> roots;
+        int restRoots = 0;
         HuffmanCodedPos hcp;
+        // 書き出す局面はスレッドごとに溜めておき、溜まったら書き出し用のスレッドに渡す。
+        constexpr size_t OutputBufferSize = 1 << 22;
+        std::vector<u8> outputBuffer;
+        outputBuffer.reserve(OutputBufferSize);
         while (idx < teacherNodes) {
-            {
+            if (restRoots-- == 0) {
                 std::unique_lock<Mutex> lock(imutex);
-                ifs.seekg(inputFileDist(mt) * sizeof(HuffmanCodedPos), std::ios_base::beg);
-                ifs.read(reinterpret_cast<char*>(&hcp), sizeof(hcp));
+                if (!reader.readChunk(inputChunkDist(mt), roots))
+                    exit(EXIT_FAILURE);
+                restRoots = RootsPerChunk - 1;
             }
-            setPosition(pos, hcp);
+            std::uniform_int_distribution<size_t> rootDist(0, roots.size() / sizeof(HuffmanCodedPos) - 1);
+            memcpy(&hcp, &roots[rootDist(mt) * sizeof(HuffmanCodedPos)], sizeof(HuffmanCodedPos));
+            if (!setPosition(pos, hcp))
+                continue;
             randomMove(pos, mt); // 教師局面を増やす為、取得した元局面からランダムに動かしておく。
             double randomMoveRateThresh = 0.2;
             std::unordered_set<Key> keyHash;
             StateListPtr states = StateListPtr(new std::deque<StateInfo>(1));
             std::vector<HuffmanCodedPosAndEval> hcpevec;
             GameResult gameResult = Draw;
-            for (Ply ply = pos.gamePly(); ply < 400; ++ply, ++idx) { // 400 手くらいで終了しておく。
+            // 開始局面が書き出し済みなら、同じような対局になるので探索せずに次の開始局面を選ぶ。
+            if (filter.enabled() && !filter.insert(pos.getKey())) {
+                ++skippedGames;
+                continue;
+            }
+            bool isRoot = true;
+            for (Ply ply = pos.gamePly(); ply < 400; ++ply) { // 400 手くらいで終了しておく。
 #if 0 // 自己対局の勝敗を記録する為、対局途中でのランダムムーブは行わない。
                 if (!pos.inCheck() && doRandomMoveDist(mt) <= randomMoveRateThresh) { // 王手が掛かっていない局面で、randomMoveRateThresh の確率でランダムに局面を動かす。
                     randomMove(pos, mt);
@@ -426,6 +478,9 @@ void make_teacher(std::istringstream& ssCmd) {
                     gameResult = Draw;
                     break;
                 }
+                // 書き出し済みの局面でも、対局を続ける為に探索はする。開始局面は既にフィルタに加えてある。
+                const bool isNew = (isRoot || !filter.enabled() || filter.insert(key));
+                isRoot = false;
                 pos.searcher()->alpha = -ScoreMaxEvaluate;
                 pos.searcher()->beta  =  ScoreMaxEvaluate;
                 go(pos, static_cast<Depth>(6));
@@ -444,7 +499,10 @@ void make_teacher(std::istringstream& ssCmd) {
                     break;
                 }
 
-                {
+                if (!isNew)
+                    ++duplicatedNodes;
+                else {
+                    ++idx;
                     hcpevec.emplace_back(HuffmanCodedPosAndEval());
                     HuffmanCodedPosAndEval& hcpe = hcpevec.back();
                     hcpe.hcp = pos.toHuffmanCodedPos();
@@ -472,20 +530,31 @@ void make_teacher(std::istringstream& ssCmd) {
             // 勝敗を1局全てに付ける。
             for (auto& elem : hcpevec)
                 elem.gameResult = gameResult;
-            std::unique_lock<Mutex> lock(omutex);
-            ofs.write(reinterpret_cast<char*>(hcpevec.data()), sizeof(HuffmanCodedPosAndEval) * hcpevec.size());
+            const u8* begin = reinterpret_cast<const u8*>(hcpevec.data());
+            outputBuffer.insert(std::end(outputBuffer), begin, begin + sizeof(HuffmanCodedPosAndEval) * hcpevec.size());
+            if (OutputBufferSize <= outputBuffer.size())
+                writer.push(threadID, outputBuffer);
         }
+        writer.push(threadID, outputBuffer);
     };
-    auto progressFunc = [&teacherNodes] (std::atomic<s64>& index, Timer& t) {
+    auto progressFunc = [&teacherNodes, &writer] (std::atomic<s64>& index, Timer& t) {
+        u64 prevWrittenBytes = 0;
+        int prevElapsed = 0;
         while (true) {
             std::this_thread::sleep_for(std::chrono::seconds(5)); // 指定秒だけ待機し、進捗を表示する。
             const s64 madeTeacherNodes = index;
             const double progress = static_cast<double>(madeTeacherNodes) / teacherNodes;
             auto elapsed_msec = t.elapsed();
+            const u64 writtenBytes = writer.writtenBytes();
+            // 直近の区間の書き込み速度 [MB/s]
+            const double writeSpeed = static_cast<double>(writtenBytes - prevWrittenBytes) / (1 << 20) * 1000 / std::max(1, elapsed_msec - prevElapsed);
+            prevWrittenBytes = writtenBytes;
+            prevElapsed = elapsed_msec;
             if (progress > 0.0) // 0 除算を回避する。
                 std::cout << std::fixed << "Progress: " << std::setprecision(2) << std::min(100.0, progress * 100.0)
                           << "%, Elapsed: " << elapsed_msec/1000
-                          << "[s], Remaining: " << std::max<s64>(0, elapsed_msec*(1.0 - progress)/(progress*1000)) << "[s]" << std::endl;
+                          << "[s], Remaining: " << std::max<s64>(0, elapsed_msec*(1.0 - progress)/(progress*1000)) << "[s]"
+                          << ", Written: " << static_cast<double>(writtenBytes) / (1 << 20) << "[MB] (" << writeSpeed << "[MB/s])" << std::endl;
             if (index >= teacherNodes)
                 break;
         }
@@ -500,290 +569,1463 @@ void make_teacher(std::istringstream& ssCmd) {
     for (int i = 0; i < threadNum; ++i)
         threads[i].join();
     progressThread.join();
-
-    std::cout << "Made " << teacherNodes << " teacher nodes in " << t.elapsed()/1000 << " seconds." << std::endl;
+    if (!writer.close())
+        exit(EXIT_FAILURE);
+    const int elapsed = t.elapsed();
+    std::cout << "Made " << teacherNodes << " teacher nodes in " << elapsed/1000 << " seconds. "
+              << "Written " << std::fixed << std::setprecision(2) << static_cast<double>(writer.writtenBytes()) / (1 << 20) << "[MB] ("
+              << static_cast<double>(writer.writtenBytes()) / (1 << 20) * 1000 / std::max(1, elapsed) << "[MB/s])." << std::endl;
+    if (filter.enabled())
+        std::cout << "Skipped " << skippedGames << " games and " << duplicatedNodes << " nodes already written"
+                  << " (filter fill rate: " << filter.fillRate() * 100 << "%)." << std::endl;
+    if (mergeStr == "merge" && !writer.merge(outputFileName))
+        exit(EXIT_FAILURE);
 }
 
 namespace {
     // Learner とほぼ同じもの。todo: Learner と共通化する。
 
-    using LowerDimensionedEvaluatorGradient = EvaluatorBase<std::array<std::atomic<double>, 2>,
-                                                            std::array<std::atomic<double>, 2>,
-                                                            std::array<std::atomic<double>, 2> >;
-    using EvalBaseType = EvaluatorBase<std::array<double, 2>,
-                                       std::array<double, 2>,
-                                       std::array<double, 2> >;
+    // 要素の型は learner.hpp の LearnFloat, LearnMeanSquareFloat で切り替える。
+    using EvalBaseType = EvaluatorBase<std::array<LearnFloat, 2>,
+                                       std::array<LearnFloat, 2>,
+                                       std::array<LearnFloat, 2> >;
+    using MeanSquareType = EvaluatorBase<std::array<LearnMeanSquareFloat, 2>,
+                                         std::array<LearnMeanSquareFloat, 2>,
+                                         std::array<LearnMeanSquareFloat, 2> >;
+
+    // 整数の評価値 (Evaluator) の要素 1 つの変更。index は oneArrayKPP() などのインデックス。
+    struct EvalDiffEntry {
+        u32 index;
+        std::array<s16, 2> value;
+    };
+    // 評価関数の全要素を舐める処理は、kpps, kkps, kks を一つの一次元配列 (oneArray()) として扱い、
+    // SweepBlockSize 個ずつに分けてスレッドに割り振る。AVX2 が使える場合は 4 つずつまとめて計算する。
+    // omp parallel の中から呼ぶこと。f(begin, end) で [begin, end) を処理する。
+    template <typename F> void sweepEval(const size_t size, F f) {
+        constexpr size_t SweepBlockSize = 1 << 16;
+        const s64 blockNum = static_cast<s64>((size + SweepBlockSize - 1) / SweepBlockSize);
+#ifdef _OPENMP
+#pragma omp for
+#endif
+        for (s64 block = 0; block < blockNum; ++block)
+            f(block * SweepBlockSize, std::min(size, (block + 1) * SweepBlockSize));
+    }
+    template <typename T> T* flatEval(EvaluatorBase<std::array<T, 2>, std::array<T, 2>, std::array<T, 2> >& base) {
+        assert(base.oneArrayKKP(0) == base.oneArray(base.kpps_end_index()));
+        assert(base.oneArrayKK(0) == base.oneArray(base.kpps_end_index() + base.kkps_end_index()));
+        return &(*base.oneArray(0))[0];
+    }
+    // round() と同じく 0 から遠い方に丸めて s16 にする。
+    inline s16 roundEval(const double x) { return static_cast<s16>(round(x)); }
+#if defined HAVE_AVX2
+    // 4 つまとめて丸めて、s16 4 つを下位 64bit に詰めたものを返す。
+    inline __m128i roundEval4(const __m256d x) {
+        const __m256d t = _mm256_round_pd(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+        const __m256d d = _mm256_sub_pd(x, t);
+        const __m256d one = _mm256_set1_pd(1.0);
+        const __m256d up = _mm256_and_pd(_mm256_cmp_pd(d, _mm256_set1_pd(0.5), _CMP_GE_OQ), one);
+        const __m256d down = _mm256_and_pd(_mm256_cmp_pd(d, _mm256_set1_pd(-0.5), _CMP_LE_OQ), one);
+        const __m128i i = _mm256_cvttpd_epi32(_mm256_sub_pd(_mm256_add_pd(t, up), down));
+        return _mm_packs_epi32(i, i);
+    }
+    inline void storeRoundEval4(s16* p, const __m256d x) {
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(p), roundEval4(x));
+    }
+#endif
+    // eval の oneArray() の index 番目の要素を value に変える事を、KPP, KKP, KK ごとに entries[0], [1], [2] に追加する。
+    void pushEvalDiff(const Evaluator& eval, std::vector<EvalDiffEntry> entries[3], size_t index, const std::array<s16, 2>& value) {
+        if (index < eval.kpps_end_index()) {
+            entries[0].push_back({static_cast<u32>(index), value});
+            return;
+        }
+        index -= eval.kpps_end_index();
+        if (index < eval.kkps_end_index()) {
+            entries[1].push_back({static_cast<u32>(index), value});
+            return;
+        }
+        entries[2].push_back({static_cast<u32>(index - eval.kkps_end_index()), value});
+    }
 
     // 小数の評価値を round して整数に直す。
     void copyEval(Evaluator& eval, EvalBaseType& evalBase) {
+        s16* dst = flatEval(eval);
+        const LearnFloat* src = flatEval(evalBase);
 #if defined _OPENMP
 #pragma omp parallel
 #endif
-#ifdef _OPENMP
-#pragma omp for
-#endif
-        for (size_t i = 0; i < eval.kpps_end_index(); ++i)
-            for (int boardTurn = 0; boardTurn < 2; ++boardTurn)
-                (*eval.oneArrayKPP(i))[boardTurn] = round((*evalBase.oneArrayKPP(i))[boardTurn]);
-#ifdef _OPENMP
-#pragma omp for
+        sweepEval(2 * evalBase.oneArraySize(), [&](const size_t begin, const size_t end) {
+            size_t i = begin;
+#if defined HAVE_AVX2
+            for (; i + 4 <= end; i += 4)
+                storeRoundEval4(dst + i, loadAsDouble4(src + i));
 #endif
-        for (size_t i = 0; i < eval.kkps_end_index(); ++i)
-            for (int boardTurn = 0; boardTurn < 2; ++boardTurn)
-                (*eval.oneArrayKKP(i))[boardTurn] = round((*evalBase.oneArrayKKP(i))[boardTurn]);
-#ifdef _OPENMP
-#pragma omp for
-#endif
-        for (size_t i = 0; i < eval.kks_end_index(); ++i)
-            for (int boardTurn = 0; boardTurn < 2; ++boardTurn)
-                (*eval.oneArrayKK(i))[boardTurn] = round((*evalBase.oneArrayKK(i))[boardTurn]);
+            for (; i < end; ++i)
+                dst[i] = roundEval(src[i]);
+        });
+    }
+    // copyEval() と同じだが OpenMP を使わないので、fork() した子プロセスからも呼べる。
+    void copyEvalSerially(Evaluator& eval, EvalBaseType& evalBase) {
+        s16* dst = flatEval(eval);
+        const LearnFloat* src = flatEval(evalBase);
+        for (size_t i = 0; i < 2 * evalBase.oneArraySize(); ++i)
+            dst[i] = roundEval(src[i]);
     }
     // 整数の評価値を小数に直す。
     void copyEval(EvalBaseType& evalBase, Evaluator& eval) {
+        LearnFloat* dst = flatEval(evalBase);
+        const s16* src = flatEval(eval);
 #if defined _OPENMP
 #pragma omp parallel
 #endif
-#ifdef _OPENMP
-#pragma omp for
-#endif
-        for (size_t i = 0; i < evalBase.kpps_end_index(); ++i)
-            for (int boardTurn = 0; boardTurn < 2; ++boardTurn)
-                (*evalBase.oneArrayKPP(i))[boardTurn] = (*eval.oneArrayKPP(i))[boardTurn];
-#ifdef _OPENMP
-#pragma omp for
-#endif
-        for (size_t i = 0; i < evalBase.kkps_end_index(); ++i)
-            for (int boardTurn = 0; boardTurn < 2; ++boardTurn)
-                (*evalBase.oneArrayKKP(i))[boardTurn] = (*eval.oneArrayKKP(i))[boardTurn];
-#ifdef _OPENMP
-#pragma omp for
-#endif
-        for (size_t i = 0; i < evalBase.kks_end_index(); ++i)
-            for (int boardTurn = 0; boardTurn < 2; ++boardTurn)
-                (*evalBase.oneArrayKK(i))[boardTurn] = (*eval.oneArrayKK(i))[boardTurn];
+        sweepEval(2 * evalBase.oneArraySize(), [&](const size_t begin, const size_t end) {
+            for (size_t i = begin; i < end; ++i)
+                dst[i] = src[i];
+        });
     }
+    constexpr double AverageDecay = 0.8; // todo: 過去のデータの重みが強すぎる可能性あり。
     void averageEval(EvalBaseType& averagedEvalBase, EvalBaseType& evalBase) {
-        constexpr double AverageDecay = 0.8; // todo: 過去のデータの重みが強すぎる可能性あり。
+        LearnFloat* avg = flatEval(averagedEvalBase);
+        const LearnFloat* v = flatEval(evalBase);
 #if defined _OPENMP
 #pragma omp parallel
 #endif
-#ifdef _OPENMP
-#pragma omp for
-#endif
-        for (size_t i = 0; i < averagedEvalBase.kpps_end_index(); ++i)
-            for (int boardTurn = 0; boardTurn < 2; ++boardTurn)
-                (*averagedEvalBase.oneArrayKPP(i))[boardTurn] = AverageDecay * (*averagedEvalBase.oneArrayKPP(i))[boardTurn] + (1.0 - AverageDecay) * (*evalBase.oneArrayKPP(i))[boardTurn];
-#ifdef _OPENMP
-#pragma omp for
+        {
+#if defined HAVE_AVX2
+            StochasticRounder4 rounder;
+            const __m256d decay = _mm256_set1_pd(AverageDecay);
+            const __m256d rest = _mm256_set1_pd(1.0 - AverageDecay);
 #endif
-        for (size_t i = 0; i < averagedEvalBase.kkps_end_index(); ++i)
-            for (int boardTurn = 0; boardTurn < 2; ++boardTurn)
-                (*averagedEvalBase.oneArrayKKP(i))[boardTurn] = AverageDecay * (*averagedEvalBase.oneArrayKKP(i))[boardTurn] + (1.0 - AverageDecay) * (*evalBase.oneArrayKKP(i))[boardTurn];
-#ifdef _OPENMP
-#pragma omp for
+            sweepEval(2 * averagedEvalBase.oneArraySize(), [&](const size_t begin, const size_t end) {
+                size_t i = begin;
+#if defined HAVE_AVX2
+                for (; i + 4 <= end; i += 4)
+                    rounder.store(avg + i, _mm256_add_pd(_mm256_mul_pd(decay, loadAsDouble4(avg + i)), _mm256_mul_pd(rest, loadAsDouble4(v + i))));
 #endif
-        for (size_t i = 0; i < averagedEvalBase.kks_end_index(); ++i)
-            for (int boardTurn = 0; boardTurn < 2; ++boardTurn)
-                (*averagedEvalBase.oneArrayKK(i))[boardTurn] = AverageDecay * (*averagedEvalBase.oneArrayKK(i))[boardTurn] + (1.0 - AverageDecay) * (*evalBase.oneArrayKK(i))[boardTurn];
+                for (; i < end; ++i)
+                    avg[i] = roundStochastically<LearnFloat>(AverageDecay * avg[i] + (1.0 - AverageDecay) * v[i]);
+            });
+        }
     }
     constexpr double FVPenalty() { return (0.001/static_cast<double>(FVScale)); }
-    // RMSProp(実質、改造してAdaGradになっている) でパラメータを更新する。
-    template <typename T>
-    void updateFV(std::array<T, 2>& v, const std::array<std::atomic<double>, 2>& grad, std::array<std::atomic<double>, 2>& msGrad, std::atomic<double>& max) {
-        //constexpr double AttenuationRate = 0.99999;
-        constexpr double UpdateParam = 100.0; // 更新用のハイパーパラメータ。大きいと不安定になり、小さいと学習が遅くなる。
-        constexpr double epsilon = 0.000001; // 0除算防止の定数
-
+    //constexpr double AttenuationRate = 0.99999;
+    constexpr double UpdateParam = 100.0; // 更新用のハイパーパラメータ。大きいと不安定になり、小さいと学習が遅くなる。
+    constexpr double UpdateEpsilon = 0.000001; // 0除算防止の定数
+    // RMSProp(実質、改造してAdaGradになっている) でパラメータを 1 つ更新し、更新幅を返す。
+    // 計算は double で行い、格納する時に LearnFloat, LearnMeanSquareFloat に確率的に丸める。
+    inline double updateFVValue(LearnFloat& v, const double g, LearnMeanSquareFloat& msGrad) {
+        // ほぼAdaGrad
+        const double ms = /*AttenuationRate * */static_cast<double>(msGrad) + /*(1.0 - AttenuationRate) * */g * g;
+        msGrad = roundStochastically<LearnMeanSquareFloat>(ms);
+        const double updateStep = UpdateParam * g / sqrt(ms + UpdateEpsilon);
+        v = roundStochastically<LearnFloat>(v + updateStep);
+        return updateStep;
+    }
+    void updateFV(std::array<LearnFloat, 2>& v, const std::array<std::atomic<LearnFloat>, 2>& grad, std::array<LearnMeanSquareFloat, 2>& msGrad, std::atomic<double>& max) {
         for (int i = 0; i < 2; ++i) {
-            // ほぼAdaGrad
-            msGrad[i] = /*AttenuationRate * */msGrad[i] + /*(1.0 - AttenuationRate) * */grad[i] * grad[i];
-            const double updateStep = UpdateParam * grad[i] / sqrt(msGrad[i] + epsilon);
-            v[i] += updateStep;
-            const double fabsmax = fabs(updateStep);
+            const double fabsmax = fabs(updateFVValue(v[i], grad[i], msGrad[i]));
             if (max < fabsmax)
                 max = fabsmax;
         }
     }
+    // 全てのパラメータを更新し、使い終わった gradient は 0 に戻す。
+    // averagedEvalBase を渡すと更新後の値で平均化する。
+    // eval を渡すと、更新後の値を整数に丸めたものが eval と異なる要素を entries に集める。eval は書き換えない。
+    // averageEval() や差分を求める処理を別に行うより、全要素を舐めるのが 1 回で済む。
     void updateEval(EvalBaseType& evalBase,
                     LowerDimensionedEvaluatorGradient& lowerDimentionedEvaluatorGradient,
-                    LowerDimensionedEvaluatorGradient& meanSquareOfLowerDimensionedEvaluatorGradient)
+                    MeanSquareType& meanSquareOfLowerDimensionedEvaluatorGradient,
+                    EvalBaseType* averagedEvalBase = nullptr, Evaluator* eval = nullptr, std::vector<EvalDiffEntry> entries[3] = nullptr)
     {
-        std::atomic<double> max;
-        max = 0.0;
+        LearnFloat* v = flatEval(evalBase);
+        std::atomic<LearnFloat>* grad = &(*lowerDimentionedEvaluatorGradient.oneArray(0))[0];
+        LearnMeanSquareFloat* msGrad = flatEval(meanSquareOfLowerDimensionedEvaluatorGradient);
+        LearnFloat* avg = (averagedEvalBase != nullptr ? flatEval(*averagedEvalBase) : nullptr);
+        const s16* oldEval = (eval != nullptr ? flatEval(*eval) : nullptr);
+        if (eval != nullptr)
+            for (int k = 0; k < 3; ++k)
+                entries[k].clear();
+        double max = 0.0;
 #if defined _OPENMP
 #pragma omp parallel
 #endif
+        {
+            double localMax = 0.0;
+            std::vector<EvalDiffEntry> localEntries[3];
+#if defined HAVE_AVX2
+            StochasticRounder4 rounder;
+            const __m256d updateParam = _mm256_set1_pd(UpdateParam);
+            const __m256d epsilon = _mm256_set1_pd(UpdateEpsilon);
+            const __m256d decay = _mm256_set1_pd(AverageDecay);
+            const __m256d rest = _mm256_set1_pd(1.0 - AverageDecay);
+            const __m256d signMask = _mm256_set1_pd(-0.0);
+            __m256d maxStep = _mm256_setzero_pd();
+#endif
+            sweepEval(2 * evalBase.oneArraySize(), [&](const size_t begin, const size_t end) {
+                size_t i = begin;
+#if defined HAVE_AVX2
+                for (; i + 4 <= end; i += 4) {
+                    const __m256d g = loadAsDouble4(grad + i);
+                    memset(static_cast<void*>(grad + i), 0, 4 * sizeof(LearnFloat));
+                    const __m256d ms = _mm256_add_pd(loadAsDouble4(msGrad + i), _mm256_mul_pd(g, g));
+                    rounder.store(msGrad + i, ms);
+                    const __m256d updateStep = _mm256_div_pd(_mm256_mul_pd(updateParam, g), _mm256_sqrt_pd(_mm256_add_pd(ms, epsilon)));
+                    const __m256d newValue = rounder.store(v + i, _mm256_add_pd(loadAsDouble4(v + i), updateStep));
+                    maxStep = _mm256_max_pd(maxStep, _mm256_andnot_pd(signMask, updateStep));
+                    if (avg != nullptr)
+                        rounder.store(avg + i, _mm256_add_pd(_mm256_mul_pd(decay, loadAsDouble4(avg + i)), _mm256_mul_pd(rest, newValue)));
+                    if (oldEval != nullptr) {
+                        std::array<s16, 2> newPairs[2];
+                        _mm_storel_epi64(reinterpret_cast<__m128i*>(newPairs), roundEval4(newValue));
+                        for (int k = 0; k < 2; ++k)
+                            if (memcmp(&newPairs[k], oldEval + i + 2 * k, sizeof(newPairs[k])) != 0)
+                                pushEvalDiff(*eval, localEntries, i / 2 + k, newPairs[k]);
+                    }
+                }
+#endif
+                // 1 つの要素の 2 つの値をまとめて扱う。begin, end は常に偶数になっている。
+                for (; i < end; i += 2) {
+                    for (size_t k = i; k < i + 2; ++k) {
+                        const double g = grad[k];
+                        grad[k] = 0.0;
+                        localMax = std::max(localMax, fabs(updateFVValue(v[k], g, msGrad[k])));
+                        if (avg != nullptr)
+                            avg[k] = roundStochastically<LearnFloat>(AverageDecay * avg[k] + (1.0 - AverageDecay) * v[k]);
+                    }
+                    if (oldEval != nullptr) {
+                        const std::array<s16, 2> newPair = {{roundEval(v[i]), roundEval(v[i + 1])}};
+                        if (newPair[0] != oldEval[i] || newPair[1] != oldEval[i + 1])
+                            pushEvalDiff(*eval, localEntries, i / 2, newPair);
+                    }
+                }
+            });
+#if defined HAVE_AVX2
+            alignas(32) double steps[4];
+            _mm256_store_pd(steps, maxStep);
+            localMax = std::max({localMax, steps[0], steps[1], steps[2], steps[3]});
+#endif
+#if defined _OPENMP
+#pragma omp critical
+#endif
+            {
+                max = std::max(max, localMax);
+                if (eval != nullptr)
+                    for (int k = 0; k < 3; ++k)
+                        entries[k].insert(std::end(entries[k]), std::begin(localEntries[k]), std::end(localEntries[k]));
+            }
+        }
+
+        std::cout << "max update step : " << std::fixed << std::setprecision(2) << max << std::endl;
+    }
+
+    // 以下、更新した低次元の要素に関係する合成後の要素だけを更新する為のもの。
+    // EVAL_ONLINE では合成後の KPP, KKP の要素 1 つにつき低次元の要素が 1 つだけ対応するので、
+    // 低次元の要素 1 つの値が変わった時は、その要素を参照している合成後の要素に差分を足せば良い。
+    // EVAL_PHASE1 - 4 を使う場合は複数の低次元の要素が対応するので、毎回全て合成し直す。
+#if defined EVAL_ONLINE && !defined EVAL_PHASE1 && !defined EVAL_PHASE2 && !defined EVAL_PHASE3 && !defined EVAL_PHASE4
+#define RESYNTHESIZE_INCREMENTALLY
+#endif
+
+    // 低次元の要素 1 つが合成後の要素に与える値。Evaluator::setEvaluate() と同じ計算をする。
+    inline std::array<s64, 2> synthesizedContribution(const Evaluator& eval, const std::array<s16, 2>& v, const int sign) {
+        return {{sign * static_cast<s64>(v[0]), static_cast<s64>(v[1]) / eval.TurnWeight()}};
+    }
+    inline int inverseKPPIndexColor(const int i) {
+        const int ibegin = kppIndexBegin(i);
+        return kppIndexToOpponentBegin(i) + (i < fe_hand_end ? i - ibegin : inverse(static_cast<Square>(i - ibegin)));
+    }
+    // 低次元の要素から、それを参照している合成後の要素への対応を前計算しておき、
+    // 低次元の要素を書き換えた時に、関係する合成後の要素だけを計算し直す。
+    // 参照している合成後の要素は、低次元の要素から左右反転などで移り合う 16 通りの候補のどれかなので、
+    // 低次元の要素ごとに、実際に参照している候補を bit で持つ。
+    class EvalResynthesizer {
+    public:
+        // 合成後の評価関数が eval と dirName の *_some_synthesized.bin から合成したものになっている時に呼ぶ。
+        void init(Evaluator& eval, const std::string& dirName);
+        // 低次元の KPP, KKP の要素 index を newValue に書き換え、それを参照している合成後の要素に差分を足す。
+        // index が異なれば参照している合成後の要素も異なるので、複数スレッドから呼んで良い。
+        void setKPP(Evaluator& eval, const size_t index, const std::array<s16, 2>& newValue) const;
+        void setKKP(Evaluator& eval, const size_t index, const std::array<s16, 2>& newValue) const;
+        // KK は小さいので、低次元の要素を書き換えた後に全て合成し直す。
+        // RESYNTHESIZE_INCREMENTALLY でなければ、KPP, KKP も含めて全て合成し直す。
+        void resynthesizeKK(Evaluator& eval) const;
+        // entries[0], entries[1], entries[2] の KPP, KKP, KK の要素を書き換えて、合成後の評価関数に反映する。
+        void apply(Evaluator& eval, const std::vector<EvalDiffEntry> entries[3]) const;
+
+    private:
+        // 低次元の KPP の要素 (k, i, j) から、左右反転と i, j の入れ替えで移り合う c 番目の候補
+        static std::tuple<Square, int, int> kppCandidate(const Square k, const int i, const int j, const int c) {
+            const Square ksq = (c & 8 ? inverseFile(k) : k);
+            const int a = (c & 4 ? inverseFileIndexIfOnBoard(i) : i);
+            const int b = (c & 2 ? inverseFileIndexIfOnBoard(j) : j);
+            return (c & 1 ? std::make_tuple(ksq, b, a) : std::make_tuple(ksq, a, b));
+        }
+        // 低次元の KKP の要素 (k0, k1, i) から、左右反転と先後反転で移り合う c 番目の候補
+        static std::tuple<Square, Square, int> kkpCandidate(const Square k0, const Square k1, const int i, const int c) {
+            const Square ksq0 = (c & 8 ? inverseFile(k0) : k0);
+            const Square ksq1 = (c & 4 ? inverseFile(k1) : k1);
+            const int a = (c & 2 ? inverseFileIndexIfOnBoard(i) : i);
+            return (c & 1 ? std::make_tuple(inverse(ksq1), inverse(ksq0), inverseKPPIndexColor(a)) : std::make_tuple(ksq0, ksq1, a));
+        }
+        // 合成後の KK の要素 1 つに低次元の要素から与えられる値。Evaluator::setEvaluate() と同じ計算をする。
+        static std::array<s64, 2> synthesizedKK(Evaluator& eval, const Square ksq0, const Square ksq1);
+
+        std::string dirName_;
+        size_t kppBegin_; // 低次元の KPP の kpp[0][0][0] のインデックス
+        size_t kkpBegin_;
+        std::vector<std::atomic<u16> > kppOrbits_;
+        std::vector<std::atomic<u32> > kkpOrbits_; // 下位 16bit が参照している候補、上位 16bit がそのうち符号を反転して参照している候補
+        std::vector<std::array<s64, 2> > kkSomeSynthesized_; // 合成後の KK のうち、低次元の要素以外から与えられた分
+    };
+
+    void EvalResynthesizer::init(Evaluator& eval, const std::string& dirName) {
+        dirName_ = dirName;
+#if defined RESYNTHESIZE_INCREMENTALLY
+        kppBegin_ = &eval.kpps.kpp[0][0][0] - eval.oneArrayKPP(0);
+        kkpBegin_ = &eval.kkps.kkp[0][0][0] - eval.oneArrayKKP(0);
+        std::vector<std::atomic<u16> >(eval.kpps_end_index()).swap(kppOrbits_);
+        std::vector<std::atomic<u32> >(eval.kkps_end_index()).swap(kkpOrbits_);
+#if defined _OPENMP
+#pragma omp parallel
+#endif
+        {
+            ptrdiff_t indices[KPPIndicesMax];
 #ifdef _OPENMP
 #pragma omp for
 #endif
-        for (size_t i = 0; i < evalBase.kpps_end_index(); ++i)
-            updateFV(*evalBase.oneArrayKPP(i), *lowerDimentionedEvaluatorGradient.oneArrayKPP(i), *meanSquareOfLowerDimensionedEvaluatorGradient.oneArrayKPP(i), max);
+            for (int ksq = SQ11; ksq < SquareNum; ++ksq) {
+                for (int i = 0; i < fe_end; ++i) {
+                    for (int j = 0; j < fe_end; ++j) {
+                        eval.kppIndices(indices, static_cast<Square>(ksq), i, j);
+                        if (indices[0] == std::numeric_limits<ptrdiff_t>::max())
+                            continue;
+                        assert(indices[1] == std::numeric_limits<ptrdiff_t>::max());
+                        const size_t index = indices[0];
+                        const size_t offset = index - kppBegin_;
+                        // kppCandidate() で target になる最初の c を探す。合成後の要素ごとに 1 つだけ bit を立てる。
+                        // ksq が一致するなら c の 8 の bit は立てない方が先になる。
+                        const int bi = offset / fe_end % fe_end;
+                        const int bj = offset % fe_end;
+                        const int is[] = {bi, inverseFileIndexIfOnBoard(bi)};
+                        const int js[] = {bj, inverseFileIndexIfOnBoard(bj)};
+                        const int ksqBit = (static_cast<size_t>(ksq) == offset / (fe_end * fe_end) ? 0 : 8);
+                        for (int c = 0; c < 8; ++c) {
+                            const int a = is[(c >> 2) & 1];
+                            const int b = js[(c >> 1) & 1];
+                            if ((c & 1 ? b == i && a == j : a == i && b == j)) {
+                                assert(kppCandidate(static_cast<Square>(offset / (fe_end * fe_end)), bi, bj, ksqBit | c) == std::make_tuple(static_cast<Square>(ksq), i, j));
+                                kppOrbits_[index].fetch_or(static_cast<u16>(1 << (ksqBit | c)), std::memory_order_relaxed);
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
 #ifdef _OPENMP
 #pragma omp for
 #endif
-        for (size_t i = 0; i < evalBase.kkps_end_index(); ++i)
-            updateFV(*evalBase.oneArrayKKP(i), *lowerDimentionedEvaluatorGradient.oneArrayKKP(i), *meanSquareOfLowerDimensionedEvaluatorGradient.oneArrayKKP(i), max);
+            for (int ksq0 = SQ11; ksq0 < SquareNum; ++ksq0) {
+                for (Square ksq1 = SQ11; ksq1 < SquareNum; ++ksq1) {
+                    for (int i = 0; i < fe_end; ++i) {
+                        eval.kkpIndices(indices, static_cast<Square>(ksq0), ksq1, i);
+                        if (indices[0] == std::numeric_limits<ptrdiff_t>::max())
+                            continue;
+                        assert(indices[1] == std::numeric_limits<ptrdiff_t>::max());
+                        const size_t index = std::abs(indices[0]);
+                        const size_t offset = index - kkpBegin_;
+                        const auto target = std::make_tuple(static_cast<Square>(ksq0), ksq1, i);
+                        for (int c = 0; c < 16; ++c) {
+                            if (kkpCandidate(static_cast<Square>(offset / (SquareNum * fe_end)), static_cast<Square>(offset / fe_end % SquareNum), offset % fe_end, c) == target) {
+                                kkpOrbits_[index].fetch_or((UINT32_C(1) << c) | (indices[0] < 0 ? UINT32_C(1) << (16 + c) : 0), std::memory_order_relaxed);
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        kkSomeSynthesized_.resize(SquareNum * SquareNum);
+        for (Square ksq0 = SQ11; ksq0 < SquareNum; ++ksq0) {
+            for (Square ksq1 = SQ11; ksq1 < SquareNum; ++ksq1) {
+                const std::array<s64, 2> sum = synthesizedKK(eval, ksq0, ksq1);
+                for (int boardTurn = 0; boardTurn < 2; ++boardTurn)
+                    kkSomeSynthesized_[ksq0 * SquareNum + ksq1][boardTurn] = Evaluator::KK[ksq0][ksq1][boardTurn] - sum[boardTurn];
+            }
+        }
+#else
+        (void)eval;
+#endif
+    }
+    void EvalResynthesizer::setKPP(Evaluator& eval, const size_t index, const std::array<s16, 2>& newValue) const {
+        const std::array<s16, 2> oldValue = *eval.oneArrayKPP(index);
+        if (oldValue == newValue)
+            return;
+        *eval.oneArrayKPP(index) = newValue;
+#if defined RESYNTHESIZE_INCREMENTALLY
+        const std::array<s64, 2> oldc = synthesizedContribution(eval, oldValue, 1);
+        const std::array<s64, 2> newc = synthesizedContribution(eval, newValue, 1);
+        const size_t offset = index - kppBegin_;
+        const Square k = static_cast<Square>(offset / (fe_end * fe_end));
+        for (u64 orbits = kppOrbits_[index].load(std::memory_order_relaxed); orbits; orbits &= orbits - 1) {
+            Square ksq;
+            int i, j;
+            std::tie(ksq, i, j) = kppCandidate(k, offset / fe_end % fe_end, offset % fe_end, firstOneFromLSB(orbits));
+            Evaluator::KPP[ksq][i][j][0] += newc[0] - oldc[0];
+            Evaluator::KPP[ksq][i][j][1] += newc[1] - oldc[1];
+        }
+#endif
+    }
+    void EvalResynthesizer::setKKP(Evaluator& eval, const size_t index, const std::array<s16, 2>& newValue) const {
+        const std::array<s16, 2> oldValue = *eval.oneArrayKKP(index);
+        if (oldValue == newValue)
+            return;
+        *eval.oneArrayKKP(index) = newValue;
+#if defined RESYNTHESIZE_INCREMENTALLY
+        const size_t offset = index - kkpBegin_;
+        const u32 orbits = kkpOrbits_[index].load(std::memory_order_relaxed);
+        for (u64 bb = orbits & 0xffff; bb; bb &= bb - 1) {
+            const int c = firstOneFromLSB(bb);
+            const int sign = (orbits & (UINT32_C(1) << (16 + c)) ? -1 : 1);
+            Square ksq0, ksq1;
+            int i;
+            std::tie(ksq0, ksq1, i) = kkpCandidate(static_cast<Square>(offset / (SquareNum * fe_end)), static_cast<Square>(offset / fe_end % SquareNum), offset % fe_end, c);
+            const std::array<s64, 2> oldc = synthesizedContribution(eval, oldValue, sign);
+            const std::array<s64, 2> newc = synthesizedContribution(eval, newValue, sign);
+            Evaluator::KKP[ksq0][ksq1][i][0] += newc[0] - oldc[0];
+            Evaluator::KKP[ksq0][ksq1][i][1] += newc[1] - oldc[1];
+        }
+#endif
+    }
+    std::array<s64, 2> EvalResynthesizer::synthesizedKK(Evaluator& eval, const Square ksq0, const Square ksq1) {
+        ptrdiff_t indices[KKIndicesMax];
+        eval.kkIndices(indices, ksq0, ksq1);
+        std::array<s64, 2> sum = {{}};
+        for (auto index : indices) {
+            if (index == std::numeric_limits<ptrdiff_t>::max()) break;
+            sum[0] += (0 <= index ? 1 : -1) * static_cast<s64>((*eval.oneArrayKK(std::abs(index)))[0]);
+            sum[1] += static_cast<s64>((*eval.oneArrayKK(std::abs(index)))[1]);
+        }
+        sum[1] /= eval.TurnWeight();
+        return {{sum[0] / 2, sum[1] / 2}};
+    }
+    void EvalResynthesizer::resynthesizeKK(Evaluator& eval) const {
+#if defined RESYNTHESIZE_INCREMENTALLY
+        for (Square ksq0 = SQ11; ksq0 < SquareNum; ++ksq0) {
+            for (Square ksq1 = SQ11; ksq1 < SquareNum; ++ksq1) {
+                const std::array<s64, 2> sum = synthesizedKK(eval, ksq0, ksq1);
+                Evaluator::KK[ksq0][ksq1][0] = kkSomeSynthesized_[ksq0 * SquareNum + ksq1][0] + sum[0];
+                Evaluator::KK[ksq0][ksq1][1] = kkSomeSynthesized_[ksq0 * SquareNum + ksq1][1] + sum[1];
+            }
+        }
+#else
+        eval.init(dirName_, false, false);
+#endif
+    }
+    void EvalResynthesizer::apply(Evaluator& eval, const std::vector<EvalDiffEntry> entries[3]) const {
+#if defined _OPENMP
+#pragma omp parallel
+#endif
+        {
 #ifdef _OPENMP
-#pragma omp for
+#pragma omp for schedule(dynamic, 256)
 #endif
-        for (size_t i = 0; i < evalBase.kks_end_index(); ++i)
-            updateFV(*evalBase.oneArrayKK(i), *lowerDimentionedEvaluatorGradient.oneArrayKK(i), *meanSquareOfLowerDimensionedEvaluatorGradient.oneArrayKK(i), max);
-
-        std::cout << "max update step : " << std::fixed << std::setprecision(2) << max << std::endl;
+            for (size_t n = 0; n < entries[0].size(); ++n)
+                setKPP(eval, entries[0][n].index, entries[0][n].value);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 256)
+#endif
+            for (size_t n = 0; n < entries[1].size(); ++n)
+                setKKP(eval, entries[1][n].index, entries[1][n].value);
+        }
+        for (const EvalDiffEntry& entry : entries[2])
+            *eval.oneArrayKK(entry.index) = entry.value;
+        resynthesizeKK(eval);
+    }
+    // 1 つの mini batch 分の gradient で KPP, KKP のパラメータを更新し、探索で使う合成後の評価関数にも反映する。
+    // 探索中のスレッドがあっても止めずに書き換える。
+    // KK の gradient は lowerDimentionedEvaluatorGradient に溜めておき、applyAsyncKKUpdate() でまとめて更新する。
+    void applyAsyncUpdate(Evaluator& eval, EvalBaseType& evalBase,
+                          LowerDimensionedEvaluatorGradient& lowerDimentionedEvaluatorGradient,
+                          MeanSquareType& meanSquareOfLowerDimensionedEvaluatorGradient,
+                          const SparseEvaluatorGradient& gradient, TouchedBaseIndices& touched,
+                          const EvalResynthesizer& resynthesizer)
+    {
+        touched.clear();
+        lowerDimension(lowerDimentionedEvaluatorGradient, gradient, &touched);
+        std::atomic<double> max;
+        max = 0.0;
+        auto roundEvalPair = [](const std::array<LearnFloat, 2>& v) -> std::array<s16, 2> {
+            return {{roundEval(v[0]), roundEval(v[1])}};
+        };
+#if defined _OPENMP
+#pragma omp parallel
+#endif
+        {
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 256)
+#endif
+            for (size_t n = 0; n < touched.kpp.size(); ++n) {
+                const size_t index = touched.kpp[n];
+                auto& grad = *lowerDimentionedEvaluatorGradient.oneArrayKPP(index);
+                updateFV(*evalBase.oneArrayKPP(index), grad, *meanSquareOfLowerDimensionedEvaluatorGradient.oneArrayKPP(index), max);
+                grad[0] = grad[1] = 0.0;
+                resynthesizer.setKPP(eval, index, roundEvalPair(*evalBase.oneArrayKPP(index)));
+            }
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 256)
+#endif
+            for (size_t n = 0; n < touched.kkp.size(); ++n) {
+                const size_t index = touched.kkp[n];
+                auto& grad = *lowerDimentionedEvaluatorGradient.oneArrayKKP(index);
+                updateFV(*evalBase.oneArrayKKP(index), grad, *meanSquareOfLowerDimensionedEvaluatorGradient.oneArrayKKP(index), max);
+                grad[0] = grad[1] = 0.0;
+                resynthesizer.setKKP(eval, index, roundEvalPair(*evalBase.oneArrayKKP(index)));
+            }
+        }
+    }
+    // 溜めておいた KK の gradient でパラメータを更新する。
+    // KK は全ての要素を更新して合成し直すので、mini batch ごとに行うとこのスレッドが律速になる。
+    void applyAsyncKKUpdate(Evaluator& eval, EvalBaseType& evalBase,
+                            LowerDimensionedEvaluatorGradient& lowerDimentionedEvaluatorGradient,
+                            MeanSquareType& meanSquareOfLowerDimensionedEvaluatorGradient,
+                            const EvalResynthesizer& resynthesizer)
+    {
+        std::atomic<double> max;
+        max = 0.0;
+        for (size_t index = 0; index < evalBase.kks_end_index(); ++index) {
+            auto& grad = *lowerDimentionedEvaluatorGradient.oneArrayKK(index);
+            auto& v = *evalBase.oneArrayKK(index);
+            updateFV(v, grad, *meanSquareOfLowerDimensionedEvaluatorGradient.oneArrayKK(index), max);
+            grad[0] = grad[1] = 0.0;
+            *eval.oneArrayKK(index) = {{roundEval(v[0]), roundEval(v[1])}};
+        }
+        resynthesizer.resynthesizeKK(eval);
     }
 }
 
 constexpr s64 NodesPerIteration = 1000000; // 1回評価値を更新するのに使う教師局面数
 
-void use_teacher(Position& pos, std::istringstream& ssCmd) {
-    std::string teacherFileName;
-    int threadNum;
-    ssCmd >> teacherFileName;
-    ssCmd >> threadNum;
-    if (threadNum <= 0)
-        exit(EXIT_FAILURE);
-    std::vector<Searcher> searchers(threadNum);
-    std::vector<Position> positions;
-    // std::vector<TriangularEvaluatorGradient> だと、非常に大きな要素が要素数分メモリ上に連続する必要があり、
-    // 例えメモリ量が余っていても、連続で確保出来ない場合は bad_alloc してしまうので、unordered_map にする。
-    std::unordered_map<int, std::unique_ptr<TriangularEvaluatorGradient> > evaluatorGradients;
-    // evaluatorGradients(threadNum) みたいにコンストラクタで確保するとスタックを使い切って落ちたので emplace_back する。
-    for (int i = 0; i < threadNum; ++i)
-        evaluatorGradients.emplace(i, std::move(std::unique_ptr<TriangularEvaluatorGradient>(new TriangularEvaluatorGradient)));
-    for (auto& s : searchers) {
-        s.init();
-        const std::string options[] = {"name Threads value 1",
-                                       "name MultiPV value 1",
-                                       "name USI_Hash value 256",
-                                       "name OwnBook value false",
-                                       "name Max_Random_Score_Diff value 0"};
-        for (auto& str : options) {
-            std::istringstream is(str);
-            s.setOption(is);
+// 複数プロセスでの学習で、server が client に送る評価関数の差分。
+namespace {
+    struct LearnerHelloMessage {
+        u32 rank;          // 何番目のプロセスか。server が 0
+        u32 processNum;
+        u64 recordNum;     // 教師データの局面数。全てのプロセスで同じファイルを使っている事を確かめる。
+        u32 evalChecksum;  // 学習開始時の評価関数の crc32c。全てのプロセスで同じ評価関数から始める事を確かめる。
+        u32 padding;
+        s64 iteration;     // 最初に行うイテレーション。0 でなければ、続けて LearnerEval で評価関数を送る。
+    };
+    struct LearnerGradientMessage {
+        s64 nodes;
+        double loss;
+        // この後に SparseEvaluatorGradient::serialize() したものが続く。
+    };
+    // 評価関数の KPP, KKP, KK の要素は連続して並んでいる。
+    size_t evalBytes(Evaluator& eval) {
+        return reinterpret_cast<u8*>(eval.oneArrayKK(eval.kks_end_index())) - reinterpret_cast<u8*>(eval.oneArrayKPP(0));
+    }
+    // LearnerGradient の大きさの上限
+    size_t maxGradientMessageBytes() {
+        return sizeof(LearnerGradientMessage) + SparseEvaluatorGradient::maxSerializedSize();
+    }
+    u32 evalChecksum(Evaluator& eval) {
+        u32 crc = crc32c(eval.oneArrayKPP(0), sizeof(KPPType) * eval.kpps_end_index());
+        crc = crc32c(eval.oneArrayKKP(0), sizeof(KKPType) * eval.kkps_end_index(), crc);
+        return crc32c(eval.oneArrayKK(0), sizeof(KKType) * eval.kks_end_index(), crc);
+    }
+    // evalBase を整数にした値が eval と異なる要素を entries に集める。
+    void diffEval(std::vector<EvalDiffEntry> entries[3], Evaluator& eval, EvalBaseType& evalBase) {
+        const s16* oldEval = flatEval(eval);
+        const LearnFloat* v = flatEval(evalBase);
+        for (int k = 0; k < 3; ++k)
+            entries[k].clear();
+        for (size_t i = 0; i < eval.oneArraySize(); ++i) {
+            const std::array<s16, 2> newValue = {{roundEval(v[2 * i]), roundEval(v[2 * i + 1])}};
+            if (newValue[0] != oldEval[2 * i] || newValue[1] != oldEval[2 * i + 1])
+                pushEvalDiff(eval, entries, i, newValue);
         }
-        positions.emplace_back(DefaultStartPositionSFEN, s.threads.main(), s.thisptr);
     }
-    if (teacherFileName == "-") // "-" なら棋譜ファイルを読み込まない。
-        exit(EXIT_FAILURE);
-    std::ifstream ifs(teacherFileName.c_str(), std::ios::binary);
-    if (!ifs)
-        exit(EXIT_FAILURE);
+    // diffEval() などで集めたものを buffer に書き出す。
+    // [KPP の要素数 (u64)][KKP の要素数 (u64)][KK の要素数 (u64)][EvalDiffEntry ...]
+    void serializeEvalDiff(std::vector<u8>& buffer, const std::vector<EvalDiffEntry> entries[3]) {
+        buffer.resize(sizeof(u64) * 3 + sizeof(EvalDiffEntry) * (entries[0].size() + entries[1].size() + entries[2].size()));
+        u8* p = buffer.data();
+        for (int k = 0; k < 3; ++k) {
+            const u64 num = entries[k].size();
+            memcpy(p, &num, sizeof(num));
+            p += sizeof(num);
+        }
+        for (int k = 0; k < 3; ++k) {
+            memcpy(p, entries[k].data(), sizeof(EvalDiffEntry) * entries[k].size());
+            p += sizeof(EvalDiffEntry) * entries[k].size();
+        }
+    }
+    // 全ての要素が変化した時の serializeEvalDiff() の大きさ。LearnerUpdate の大きさの上限に使う。
+    size_t maxEvalDiffBytes(const Evaluator& eval) {
+        return sizeof(u64) * 3 + sizeof(EvalDiffEntry) * eval.oneArraySize();
+    }
+    // serializeEvalDiff() で書き出したものを entries に読み込む。壊れていれば false を返す。
+    bool deserializeEvalDiff(std::vector<EvalDiffEntry> entries[3], const Evaluator& eval, const std::vector<u8>& buffer) {
+        u64 nums[3];
+        if (buffer.size() < sizeof(nums))
+            return false;
+        memcpy(nums, buffer.data(), sizeof(nums));
+        if (eval.kpps_end_index() < nums[0] || eval.kkps_end_index() < nums[1] || eval.kks_end_index() < nums[2]
+            || buffer.size() != sizeof(nums) + sizeof(EvalDiffEntry) * (nums[0] + nums[1] + nums[2]))
+        {
+            return false;
+        }
+        const size_t sizes[3] = {eval.kpps_end_index(), eval.kkps_end_index(), eval.kks_end_index()};
+        const u8* p = buffer.data() + sizeof(nums);
+        for (int k = 0; k < 3; ++k) {
+            entries[k].resize(nums[k]);
+            memcpy(entries[k].data(), p, sizeof(EvalDiffEntry) * nums[k]);
+            p += sizeof(EvalDiffEntry) * nums[k];
+            for (const EvalDiffEntry& entry : entries[k])
+                if (sizes[k] <= entry.index)
+                    return false;
+        }
+        return true;
+    }
+}
+
+constexpr s64 AsyncMiniBatchSize = 4096; // 非同期学習で 1 回のパラメータ更新に使う教師局面数
+constexpr u64 AsyncKKUpdateInterval = 16; // 非同期学習で KK を更新する mini batch の間隔
+
+constexpr s64 CheckpointInterval = 10; // チェックポイントを書き出すイテレーションの間隔
+
+constexpr Ply ValidationSearchDepth = 1; // 検証用の局面で指し手の一致率を求める為の探索深さ
+
+constexpr size_t TeacherBatchSize = 64; // 各スレッドが教師データから一度に取り出す局面数
+
+namespace {
+    // use_teacher の各モードで共有する学習の状態。
+    // 教師局面からの gradient の計算、パラメータ更新、ファイルの書き出しをここで行い、
+    // 各モードの関数はそれらを呼ぶ順番と、他のプロセスとのやり取りだけを受け持つ。
+    struct UseTeacherContext {
+        UseTeacherContext(const std::string& evalDir, const int threadNum, const int gradientNum, const std::string& checkpointFileName);
+        // 教師データと検証用の教師データを開く。validationFileName が空なら検証しない。
+        bool open(const std::string& teacherFileName, const std::string& validationFileName, const s64 interval);
+        // leafCacheMB が 0 なら leafCache を使わない。fileName が空でなければ、保存してある表を読み込む。
+        bool initLeafCache(const size_t leafCacheMB, const u32 leafCacheUses, const std::string& fileName);
+        // 整数化した評価関数を読み込む。withParameters なら、パラメータ更新の為の領域も確保する。
+        void initEval(const bool withParameters);
+        // チェックポイントから学習を再開する。
+        bool readCheckpoint();
+        // rank 番目のプロセスの教師データの読み込みを始める。ネットワークの準備が終わってから呼ぶ。
+        void start(const int rank, const int processNum);
+
+        // 教師局面 1 つ分の gradient を evaluatorGradient に足し込む。
+        // evaluatorGradient が nullptr なら loss だけを求める。末端の局面に移動出来なければ false を返す。
+        bool learnPosition(Position& pos, SearchStack* ss, const HuffmanCodedPosAndEval& hcpe, SparseEvaluatorGradient* evaluatorGradient, double& loss);
+        // 検証用の局面を最大 num 局面取り出して、loss と指し手の一致数を数える。取り出した局面数を返す。
+        s64 validatePositions(Position& pos, SearchStack* ss, std::vector<HuffmanCodedPosAndEval>& hcpes, const s64 num);
+        // 同期的な学習で、1 イテレーション分の gradient を全スレッドで計算する。loss を返す。
+        double computeGradients(const s64 iteration);
+        // 複数スレッドで個別に保持していた gradients を evaluatorGradients[0] に集約する。
+        void mergeGradients();
+        // evaluatorGradients[0] からパラメータを更新し、整数の評価値が変わる要素を diffEntries に集める。
+        void updateParameters(const s64 iteration);
+        // diffEntries を探索で使う評価関数に反映し、イテレーションの結果の表示とファイルの書き出しを行う。
+        void finishIteration(const s64 iteration, const double loss, const Timer& updateTimer);
+
+        void writeEval();
+        // 書き出し中の分を待って、結果を表示する。
+        void waitEval();
+        void writeCheckpoint(const s64 nextIteration, const s64 nodesUsed);
+        void writeLeafCache();
+
+        const std::string evalDir;
+        const int threadNum;
+        std::vector<Searcher> searchers;
+        std::vector<Position> positions;
+        // gradient は触れた部分だけを確保するので、スレッド数が多くてもメモリを使い切らない。
+        std::vector<std::unique_ptr<SparseEvaluatorGradient> > evaluatorGradients;
+        std::vector<SparseEvaluatorGradient*> evaluatorGradientPtrs;
+
+        // 教師データの読み込みはバックグラウンドで先読みし、各スレッドはロックを取らずに TeacherBatchSize 局面ずつ取り出す。
+        // 先読みはパラメータ更新中も続ける。
+        TeacherFileReader reader;
+        TeacherStream stream;
+        s64 maxNodes = 0;
+        s64 iterationNodes = NodesPerIteration; // このプロセスが 1 イテレーションで使う教師局面数
+        std::atomic<s64> claimedNodes; // 今回のイテレーションで各スレッドが取り出す事にした局面数
+        std::atomic<s64> nodes; // 今回のイテレーションで読み込んだ学習局面数。
+
+        // 検証用の教師データも同じように先読みする。
+        TeacherFileReader validationReader;
+        std::unique_ptr<TeacherStream> validationStream;
+        s64 validationInterval = 0;
+        s64 validationShare = 0; // 学習局面 TeacherBatchSize 局面ごとに取り出す検証用の局面数
+        std::atomic<bool> validating; // 今回のイテレーションで検証を行うか。
+        std::atomic<s64> validationNodes;
+        std::atomic<s64> validationMatches;
+        std::atomic<double> validationLoss;
+
+        LeafCache leafCache;
+        std::string leafCacheFileName;
+
+        // パラメータ更新は server だけが行うので、client は eval 以外を確保しない。
+        std::unique_ptr<Evaluator> eval; // 整数化した評価関数。相対位置などに分解して保持する。
+        std::unique_ptr<LowerDimensionedEvaluatorGradient> lowerDimensionedEvaluatorGradient;
+        std::unique_ptr<MeanSquareType> meanSquareOfLowerDimensionedEvaluatorGradient; // 過去の gradient の mean square (二乗総和)
+        std::unique_ptr<EvalBaseType> evalBase; // double で保持した評価関数の要素。相対位置などに分解して保持する。
+        std::unique_ptr<EvalBaseType> averagedEvalBase; // ファイル保存する際に評価ベクトルを平均化したもの。
+        // 評価関数を更新した時は、基本的に変わった要素に関係する合成後の要素だけを計算し直す。
+        EvalResynthesizer resynthesizer;
+        std::vector<EvalDiffEntry> diffEntries[3];
+
+        const std::string checkpointFileName;
+        s64 startIteration = 0;
+        s64 usedNodes = 0; // 再開する場合に、既に学習に使った教師局面数
+        // ファイル保存は学習を止めないように裏で行う。
+        LearnerSnapshotWriter snapshotWriter;
+        Timer iterationTimer;
+
+    private:
+        // 各スレッドが、iterationNodes に達するまで教師局面を取り出して gradient を計算する。
+        void learnIteration(Position& pos, SparseEvaluatorGradient& evaluatorGradient, double& loss);
+        std::vector<LearnerCheckpointSection> checkpointSections() {
+            return std::vector<LearnerCheckpointSection>{{evalBase.get(), sizeof(EvalBaseType)},
+                                                         {averagedEvalBase.get(), sizeof(EvalBaseType)},
+                                                         {meanSquareOfLowerDimensionedEvaluatorGradient.get(), sizeof(MeanSquareType)}};
+        }
+    };
+
+    UseTeacherContext::UseTeacherContext(const std::string& evalDir, const int threadNum, const int gradientNum, const std::string& checkpointFileName)
+        : evalDir(evalDir), threadNum(threadNum), searchers(threadNum), stream(reader), claimedNodes(0), nodes(0),
+          validating(false), validationNodes(0), validationMatches(0), validationLoss(0.0), checkpointFileName(checkpointFileName)
+    {
+        for (int i = 0; i < gradientNum; ++i) {
+            evaluatorGradients.emplace_back(new SparseEvaluatorGradient);
+            evaluatorGradientPtrs.push_back(evaluatorGradients.back().get());
+        }
+        for (auto& s : searchers) {
+            s.init();
+            const std::string options[] = {"name Threads value 1",
+                                           "name MultiPV value 1",
+                                           "name USI_Hash value 256",
+                                           "name OwnBook value false",
+                                           "name Max_Random_Score_Diff value 0"};
+            for (auto& str : options) {
+                std::istringstream is(str);
+                s.setOption(is);
+            }
+            positions.emplace_back(DefaultStartPositionSFEN, s.threads.main(), s.thisptr);
+        }
+    }
+
+    bool UseTeacherContext::open(const std::string& teacherFileName, const std::string& validationFileName, const s64 interval) {
+        if (teacherFileName == "-") // "-" なら棋譜ファイルを読み込まない。
+            return false;
+        if (!reader.open(teacherFileName, sizeof(HuffmanCodedPosAndEval)))
+            return false;
+        maxNodes = static_cast<s64>(reader.size());
+        if (!validationFileName.empty()) {
+            if (!validationReader.open(validationFileName, sizeof(HuffmanCodedPosAndEval)))
+                return false;
+            validationStream.reset(new TeacherStream(validationReader));
+            validationInterval = interval;
+        }
+        return true;
+    }
+
+    bool UseTeacherContext::initLeafCache(const size_t leafCacheMB, const u32 leafCacheUses, const std::string& fileName) {
+        if (leafCacheMB == 0)
+            return true;
+        leafCache.init(leafCacheMB, leafCacheUses);
+        leafCacheFileName = fileName;
+        if (!leafCacheFileName.empty() && std::ifstream(leafCacheFileName.c_str())) {
+            LearnerCheckpointHeader header;
+            if (!readLearnerCheckpoint(leafCacheFileName, header, {{leafCache.data(), leafCache.bytes()}}))
+                return false;
+            if (header.recordNum != reader.size()) {
+                std::cerr << "Error: " << leafCacheFileName << " was made from different teacher data" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void UseTeacherContext::initEval(const bool withParameters) {
+        eval.reset(new Evaluator);
+        eval->init(evalDir, false);
+        if (!withParameters)
+            return;
+        lowerDimensionedEvaluatorGradient.reset(new LowerDimensionedEvaluatorGradient);
+        meanSquareOfLowerDimensionedEvaluatorGradient.reset(new MeanSquareType);
+        lowerDimensionedEvaluatorGradient->clear();
+        meanSquareOfLowerDimensionedEvaluatorGradient->clear();
+        evalBase.reset(new EvalBaseType);
+        averagedEvalBase.reset(new EvalBaseType);
+        copyEval(*evalBase, *eval); // 小数に直してコピー。
+        memcpy(averagedEvalBase.get(), evalBase.get(), sizeof(EvalBaseType));
+    }
 
-    Mutex mutex;
-    auto func = [&mutex, &ifs](Position& pos, TriangularEvaluatorGradient& evaluatorGradient, double& loss, std::atomic<s64>& nodes) {
+    bool UseTeacherContext::readCheckpoint() {
+        LearnerCheckpointHeader header;
+        if (!readLearnerCheckpoint(checkpointFileName, header, checkpointSections()))
+            return false;
+        if (header.recordNum != reader.size()) {
+            std::cerr << "Error: " << checkpointFileName << " was made from different teacher data" << std::endl;
+            return false;
+        }
+        startIteration = header.iteration;
+        usedNodes = static_cast<s64>(header.usedNodes);
+        copyEval(*eval, *evalBase); // 整数の評価値にコピー
+        eval->init(evalDir, false, false); // 探索で使う評価関数の更新
+        std::cout << "resume from iteration " << startIteration << ", nodes: " << usedNodes << std::endl;
+        return true;
+    }
+
+    // 複数プロセスでの学習では、rank 番目のプロセスが教師データの [maxNodes * rank / processNum, maxNodes * (rank + 1) / processNum) を使う。
+    void UseTeacherContext::start(const int rank, const int processNum) {
+        iterationNodes = NodesPerIteration * (rank + 1) / processNum - NodesPerIteration * rank / processNum;
+        // 再開する場合は、学習に使い終わった局面を飛ばす。
+        const s64 skippedNodes = (processNum == 1 ? usedNodes : iterationNodes * startIteration);
+        stream.start(maxNodes * rank / processNum + skippedNodes, maxNodes * (rank + 1) / processNum);
+        Timer resynthesizerTimer = Timer::currentTime();
+        resynthesizer.init(*eval, evalDir);
+        std::cout << "resynthesizer init elapsed: " << resynthesizerTimer.elapsed() << "[msec]" << std::endl;
+        iterationTimer.restart();
+    }
+
+    // 検証用の局面は学習に使う局面と別なので、leafCache は学習する時だけ使う。
+    bool UseTeacherContext::learnPosition(Position& pos, SearchStack* ss, const HuffmanCodedPosAndEval& hcpe, SparseEvaluatorGradient* evaluatorGradient, double& loss) {
+        setPosition(pos, hcpe.hcp);
+        const Color rootColor = pos.turn();
+        pos.searcher()->alpha = -ScoreMaxEvaluate;
+        pos.searcher()->beta  =  ScoreMaxEvaluate;
+        if (evaluatorGradient != nullptr && leafCache.enabled()) {
+            // 末端の局面は教師の指し手によっても変わるので、key に混ぜる。
+            const Key key = pos.getKey() ^ (static_cast<Key>(hcpe.bestMove16) * 0x9e3779b97f4a7c15ULL);
+            HuffmanCodedPos leaf;
+            if (leafCache.probe(key, leaf)) {
+                if (!setPosition(pos, leaf))
+                    return false;
+            }
+            else {
+                if (!qsearch<false>(pos, hcpe.bestMove16)) // 末端の局面に移動する。
+                    return false;
+                leafCache.store(key, pos.toHuffmanCodedPos());
+            }
+        }
+        else if (!qsearch<false>(pos, hcpe.bestMove16)) // 末端の局面に移動する。
+            return false;
+        // pv を辿って評価値を返す。pos は pv を辿る為に状態が変わる。
+        auto pvEval = [&ss, &rootColor](Position& pos) {
+            ss[0].staticEvalRaw.p[0][0] = ss[1].staticEvalRaw.p[0][0] = ScoreNotEvaluated;
+            // evaluate() は手番側から見た点数なので、eval は rootColor から見た点数。
+            const Score eval = (rootColor == pos.turn() ? evaluate(pos, ss+1) : -evaluate(pos, ss+1));
+            return eval;
+        };
+        const Score eval = pvEval(pos);
+        const Score teacherEval = static_cast<Score>(hcpe.eval); // root から見た評価値が入っている。
+        const Color leafColor = pos.turn(); // pos は末端の局面になっている。
+        // x を浅い読みの評価値、y を深い読みの評価値として、
+        // 目的関数 f(x, y) は、勝率の誤差の最小化を目指す以下の式とする。
+        // また、** 2 は 2 乗を表すとする。
+        // f(x,y) = (sigmoidWinningRate(x) - sigmoidWinningRate(y)) ** 2
+        //        = sigmoidWinningRate(x)**2 - 2*sigmoidWinningRate(x)*sigmoidWinningRate(y) + sigmoidWinningRate(y)**2
+        // 浅い読みの点数を修正したいので、x について微分すると。
+        // df(x,y)/dx = 2*sigmoidWinningRate(x)*dsigmoidWinningRate(x)-2*sigmoidWinningRate(y)*dsigmoidWinningRate(x)
+        //            = 2*dsigmoidWinningRate(x)*(sigmoidWinningRate(x) - sigmoidWinningRate(y))
+        const double dsig = 2*dsigmoidWinningRate(eval)*(sigmoidWinningRate(eval) - sigmoidWinningRate(teacherEval));
+        const double tmp = sigmoidWinningRate(eval) - sigmoidWinningRate(teacherEval);
+        loss += tmp * tmp;
+        if (evaluatorGradient == nullptr)
+            return true;
+        std::array<double, 2> dT = {{(rootColor == Black ? -dsig : dsig), (rootColor == leafColor ? -dsig : dsig)}};
+        evaluatorGradient->incParam(pos, dT);
+        return true;
+    }
+
+    // hcpes は作業用の領域として使う。
+    s64 UseTeacherContext::validatePositions(Position& pos, SearchStack* ss, std::vector<HuffmanCodedPosAndEval>& hcpes, const s64 num) {
+        s64 taken = 0;
+        size_t n;
+        while (taken < num && (n = validationStream->take(&hcpes[0], static_cast<size_t>(std::min<s64>(hcpes.size(), num - taken)))) != 0) {
+            taken += n;
+            double loss = 0.0;
+            s64 count = 0;
+            s64 matches = 0;
+            for (size_t i = 0; i < n; ++i) {
+                if (!learnPosition(pos, ss, hcpes[i], nullptr, loss))
+                    continue;
+                ++count;
+#if defined LEARN
+                // 浅い探索の最善手が教師の指し手と一致するか。
+                setPosition(pos, hcpes[i].hcp);
+                pos.searcher()->alpha = -ScoreMaxEvaluate;
+                pos.searcher()->beta  =  ScoreMaxEvaluate;
+                go(pos, ValidationSearchDepth);
+                const auto& rootMoves = pos.searcher()->threads.main()->rootMoves;
+                if (!rootMoves.empty() && rootMoves[0].pv[0] == move16toMove(Move(hcpes[i].bestMove16), pos))
+                    ++matches;
+#endif
+            }
+            atomicAdd(validationLoss, loss);
+            validationNodes += count;
+            validationMatches += matches;
+        }
+        return taken;
+    }
+
+    void UseTeacherContext::learnIteration(Position& pos, SparseEvaluatorGradient& evaluatorGradient, double& loss) {
         SearchStack ss[2];
-        HuffmanCodedPosAndEval hcpe;
+        std::vector<HuffmanCodedPosAndEval> hcpes(TeacherBatchSize);
+        size_t batchIdx = 0;
+        size_t batchNum = 0;
         evaluatorGradient.clear();
         pos.searcher()->tt.clear();
         while (true) {
-            {
-                std::unique_lock<Mutex> lock(mutex);
-                if (NodesPerIteration < nodes++)
+            if (batchIdx == batchNum) {
+                // 学習局面の合間に、検証用の局面を学習局面の数に比例して処理する。
+                if (validating && validatePositions(pos, ss, hcpes, validationShare) < validationShare)
+                    validating = false; // 検証用の局面を全て取り出した。
+                // iterationNodes を超えないように、取り出す局面数を先に確保しておく。
+                const s64 begin = claimedNodes.fetch_add(TeacherBatchSize);
+                if (iterationNodes <= begin)
                     return;
-                ifs.read(reinterpret_cast<char*>(&hcpe), sizeof(hcpe));
-                if (ifs.eof())
+                const size_t want = static_cast<size_t>(std::min<s64>(TeacherBatchSize, iterationNodes - begin));
+                size_t num;
+                batchNum = 0;
+                while (batchNum < want && (num = stream.take(&hcpes[batchNum], want - batchNum)) != 0)
+                    batchNum += num;
+                nodes += batchNum;
+                if (batchNum == 0)
                     return;
+                batchIdx = 0;
             }
-            auto setpos = [](HuffmanCodedPosAndEval& hcpe, Position& pos) {
-                setPosition(pos, hcpe.hcp);
-            };
-            setpos(hcpe, pos);
-            const Color rootColor = pos.turn();
-            pos.searcher()->alpha = -ScoreMaxEvaluate;
-            pos.searcher()->beta  =  ScoreMaxEvaluate;
-            if (!qsearch<false>(pos, hcpe.bestMove16)) // 末端の局面に移動する。
-                continue;
-            // pv を辿って評価値を返す。pos は pv を辿る為に状態が変わる。
-            auto pvEval = [&ss, &rootColor](Position& pos) {
-                ss[0].staticEvalRaw.p[0][0] = ss[1].staticEvalRaw.p[0][0] = ScoreNotEvaluated;
-                // evaluate() は手番側から見た点数なので、eval は rootColor から見た点数。
-                const Score eval = (rootColor == pos.turn() ? evaluate(pos, ss+1) : -evaluate(pos, ss+1));
-                return eval;
-            };
-            const Score eval = pvEval(pos);
-            const Score teacherEval = static_cast<Score>(hcpe.eval); // root から見た評価値が入っている。
-            const Color leafColor = pos.turn(); // pos は末端の局面になっている。
-            // x を浅い読みの評価値、y を深い読みの評価値として、
-            // 目的関数 f(x, y) は、勝率の誤差の最小化を目指す以下の式とする。
-            // また、** 2 は 2 乗を表すとする。
-            // f(x,y) = (sigmoidWinningRate(x) - sigmoidWinningRate(y)) ** 2
-            //        = sigmoidWinningRate(x)**2 - 2*sigmoidWinningRate(x)*sigmoidWinningRate(y) + sigmoidWinningRate(y)**2
-            // 浅い読みの点数を修正したいので、x について微分すると。
-            // df(x,y)/dx = 2*sigmoidWinningRate(x)*dsigmoidWinningRate(x)-2*sigmoidWinningRate(y)*dsigmoidWinningRate(x)
-            //            = 2*dsigmoidWinningRate(x)*(sigmoidWinningRate(x) - sigmoidWinningRate(y))
-            const double dsig = 2*dsigmoidWinningRate(eval)*(sigmoidWinningRate(eval) - sigmoidWinningRate(teacherEval));
-            const double tmp = sigmoidWinningRate(eval) - sigmoidWinningRate(teacherEval);
-            loss += tmp * tmp;
-            std::array<double, 2> dT = {{(rootColor == Black ? -dsig : dsig), (rootColor == leafColor ? -dsig : dsig)}};
-            evaluatorGradient.incParam(pos, dT);
+            learnPosition(pos, ss, hcpes[batchIdx++], &evaluatorGradient, loss);
         }
-    };
+    }
 
-    auto lowerDimensionedEvaluatorGradient = std::unique_ptr<LowerDimensionedEvaluatorGradient>(new LowerDimensionedEvaluatorGradient);
-    auto meanSquareOfLowerDimensionedEvaluatorGradient = std::unique_ptr<LowerDimensionedEvaluatorGradient>(new LowerDimensionedEvaluatorGradient); // 過去の gradient の mean square (二乗総和)
-    auto evalBase = std::unique_ptr<EvalBaseType>(new EvalBaseType); // double で保持した評価関数の要素。相対位置などに分解して保持する。
-    auto averagedEvalBase = std::unique_ptr<EvalBaseType>(new EvalBaseType); // ファイル保存する際に評価ベクトルを平均化したもの。
-    auto eval = std::unique_ptr<Evaluator>(new Evaluator); // 整数化した評価関数。相対位置などに分解して保持する。
-    eval->init(pos.searcher()->options["Eval_Dir"], false);
-    copyEval(*evalBase, *eval); // 小数に直してコピー。
-    memcpy(averagedEvalBase.get(), evalBase.get(), sizeof(EvalBaseType));
-    const size_t fileSize = static_cast<size_t>(ifs.seekg(0, std::ios::end).tellg());
-    ifs.clear(); // 読み込み完了をクリアする。
-    ifs.seekg(0, std::ios::beg); // ストリームポインタを先頭に戻す。
-    const s64 MaxNodes = fileSize / sizeof(HuffmanCodedPosAndEval);
-    std::atomic<s64> nodes(0); // 今回のイテレーションで読み込んだ学習局面数。
-    auto writeEval = [&] {
-        // ファイル保存
-        copyEval(*eval, *averagedEvalBase); // 平均化した物を整数の評価値にコピー
-        //copyEval(*eval, *evalBase); // 平均化せずに整数の評価値にコピー
-        std::cout << "write eval ... " << std::flush;
-        eval->write(pos.searcher()->options["Eval_Dir"]);
-        std::cout << "done" << std::endl;
-    };
-    // 平均化していない合成後の評価関数バイナリも出力しておく。
-    auto writeSyn = [&] {
-        std::ofstream((Evaluator::addSlashIfNone(pos.searcher()->options["Eval_Dir"]) + "KPP_synthesized.bin").c_str()).write((char*)Evaluator::KPP, sizeof(Evaluator::KPP));
-        std::ofstream((Evaluator::addSlashIfNone(pos.searcher()->options["Eval_Dir"]) + "KKP_synthesized.bin").c_str()).write((char*)Evaluator::KKP, sizeof(Evaluator::KKP));
-        std::ofstream((Evaluator::addSlashIfNone(pos.searcher()->options["Eval_Dir"]) + "KK_synthesized.bin" ).c_str()).write((char*)Evaluator::KK , sizeof(Evaluator::KK ));
-    };
-    Timer t;
-    // 教師データ全てから学習した時点で終了する。
-    for (s64 iteration = 0; NodesPerIteration * iteration + nodes <= MaxNodes; ++iteration) {
-        t.restart();
+    double UseTeacherContext::computeGradients(const s64 iteration) {
+        iterationTimer.restart();
         nodes = 0;
-        std::cout << "iteration: " << iteration << ", nodes: " << NodesPerIteration * iteration + nodes << "/" << MaxNodes
-                  << " (" << std::fixed << std::setprecision(2) << static_cast<double>(NodesPerIteration * iteration + nodes) * 100 / MaxNodes << "%)" << std::endl;
+        claimedNodes = 0;
+        std::cout << "iteration: " << iteration << ", nodes: " << NodesPerIteration * iteration << "/" << maxNodes
+                  << " (" << std::fixed << std::setprecision(2) << static_cast<double>(NodesPerIteration * iteration) * 100 / maxNodes << "%)" << std::endl;
+        const bool validationIteration = (validationStream && iteration % validationInterval == 0);
+        if (validationIteration) {
+            // 検証用の局面を全て処理し終えるように、学習局面 TeacherBatchSize 局面ごとの割り当てを決める。
+            validationShare = (static_cast<s64>(validationReader.size()) * static_cast<s64>(TeacherBatchSize) + iterationNodes - 1) / iterationNodes;
+            validationNodes = 0;
+            validationMatches = 0;
+            validationLoss = 0.0;
+            validationStream->start();
+            validating = true;
+        }
         std::vector<std::thread> threads(threadNum);
         std::vector<double> losses(threadNum, 0.0);
         for (int i = 0; i < threadNum; ++i)
-            threads[i] = std::thread([&positions, i, &func, &evaluatorGradients, &losses, &nodes] { func(positions[i], *(evaluatorGradients[i]), losses[i], nodes); });
+            threads[i] = std::thread([this, i, &losses] { learnIteration(positions[i], *(evaluatorGradients[i]), losses[i]); });
         for (int i = 0; i < threadNum; ++i)
             threads[i].join();
-        if (nodes < NodesPerIteration)
-            break; // パラメータ更新するにはデータが足りなかったので、パラメータ更新せずに終了する。
+        if (leafCache.enabled())
+            std::cout << "leaf cache hit: " << std::fixed << std::setprecision(2) << leafCache.takeHitRate() * 100 << "%" << std::endl;
+        if (validationIteration) {
+            // 割り当ての端数で残った検証用の局面を処理する。評価関数を更新する前に行う。
+            if (validating) {
+                SearchStack ss[2];
+                std::vector<HuffmanCodedPosAndEval> hcpes(TeacherBatchSize);
+                while (validatePositions(positions[0], ss, hcpes, TeacherBatchSize) != 0) {}
+                validating = false;
+            }
+            validationStream->stop();
+            if (validationStream->failed()) {
+                std::cerr << "Error: cannot read validation data" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            const s64 num = std::max<s64>(validationNodes, 1);
+            std::cout << "validation loss: " << validationLoss.load() / num
+                      << ", move match: " << std::fixed << std::setprecision(2) << static_cast<double>(validationMatches) * 100 / num << "%"
+                      << " (" << validationNodes.load() << " positions)" << std::endl;
+        }
+        return std::accumulate(std::begin(losses), std::end(losses), 0.0);
+    }
 
-        for (size_t size = 1; size < (size_t)threadNum; ++size)
-            *(evaluatorGradients[0]) += *(evaluatorGradients[size]); // 複数スレッドで個別に保持していた gradients を [0] の要素に集約する。
-        lowerDimensionedEvaluatorGradient->clear();
+    void UseTeacherContext::mergeGradients() {
+        const size_t gradientBytes = std::accumulate(std::begin(evaluatorGradients), std::end(evaluatorGradients), size_t(0),
+                                                     [](const size_t sum, const std::unique_ptr<SparseEvaluatorGradient>& g) { return sum + g->allocatedBytes(); });
+        Timer mergeTimer = Timer::currentTime();
+        reduceGradients(evaluatorGradientPtrs);
+        std::cout << "gradient: " << gradientBytes / (1 << 20) << "[MB], merge elapsed: " << mergeTimer.elapsed() << "[msec]" << std::endl;
+    }
+
+    void UseTeacherContext::updateParameters(const s64 iteration) {
+        // lowerDimensionedEvaluatorGradient は前回の updateEval() で 0 に戻してある。
         lowerDimension(*lowerDimensionedEvaluatorGradient, *(evaluatorGradients[0]));
 
-        updateEval(*evalBase, *lowerDimensionedEvaluatorGradient, *meanSquareOfLowerDimensionedEvaluatorGradient);
-        averageEval(*averagedEvalBase, *evalBase); // 平均化する。
-        if (iteration < 10) // 最初は値の変動が大きいので適当に変動させないでおく。
+        // 整数の評価値が変わる要素は、平均化と一緒に集める。
+        const bool resetEvalBase = (iteration < 10); // 最初は値の変動が大きいので適当に変動させないでおく。
+        updateEval(*evalBase, *lowerDimensionedEvaluatorGradient, *meanSquareOfLowerDimensionedEvaluatorGradient,
+                   averagedEvalBase.get(), (resetEvalBase ? nullptr : eval.get()), diffEntries); // 平均化もする。
+        if (resetEvalBase) {
             memset(&(*evalBase), 0, sizeof(EvalBaseType));
-        if (iteration % 100 == 0) {
-            writeEval();
-            writeSyn();
+            diffEval(diffEntries, *eval, *evalBase);
         }
-        copyEval(*eval, *evalBase); // 整数の評価値にコピー
-        eval->init(pos.searcher()->options["Eval_Dir"], false, false); // 探索で使う評価関数の更新
+    }
+
+    void UseTeacherContext::finishIteration(const s64 iteration, const double loss, const Timer& updateTimer) {
+        resynthesizer.apply(*eval, diffEntries); // 整数の評価値と探索で使う評価関数の更新
+        std::cout << "update elapsed: " << updateTimer.elapsed() << "[msec]"
+                  << ", changed: " << diffEntries[0].size() + diffEntries[1].size() + diffEntries[2].size() << std::endl;
+        if (snapshotWriter.poll())
+            waitEval();
+        if (iteration % 100 == 0)
+            writeEval();
         g_evalTable.clear(); // 評価関数のハッシュテーブルも更新しないと、これまで探索した評価値と矛盾が生じる。
-        std::cout << "iteration elapsed: " << t.elapsed() / 1000 << "[sec]" << std::endl;
-        std::cout << "loss: " << std::accumulate(std::begin(losses), std::end(losses), 0.0) << std::endl;
+        std::cout << "iteration elapsed: " << iterationTimer.elapsed() / 1000 << "[sec]" << std::endl;
+        std::cout << "loss: " << loss << std::endl;
         printEvalTable(SQ88, f_gold + SQ78, f_gold, false);
+        if ((iteration + 1) % CheckpointInterval == 0)
+            writeCheckpoint(iteration + 1, NodesPerIteration * (iteration + 1));
+    }
+
+    void UseTeacherContext::writeEval() {
+        // 平均化した物を整数の評価値にして書き出す。平均化していない合成後の評価関数バイナリも書き出しておく。
+        // 裏で書き出す場合は子プロセスの eval を書き換えるだけなので、学習に使っている eval は変わらない。
+        std::cout << "write eval ... started" << std::endl;
+        snapshotWriter.start([this] {
+            // 書き出しに使わない配列は、親が書き換えた時に複製されないように手放しておく。
+            snapshotWriter.release(lowerDimensionedEvaluatorGradient.get(), sizeof(LowerDimensionedEvaluatorGradient));
+            snapshotWriter.release(meanSquareOfLowerDimensionedEvaluatorGradient.get(), sizeof(MeanSquareType));
+            snapshotWriter.release(evalBase.get(), sizeof(EvalBaseType));
+            snapshotWriter.release(leafCache.data(), leafCache.bytes());
+            copyEvalSerially(*eval, *averagedEvalBase);
+            //copyEvalSerially(*eval, *evalBase); // 平均化せずに整数の評価値にコピー (evalBase を手放さないこと)
+            snapshotWriter.release(averagedEvalBase.get(), sizeof(EvalBaseType));
+            const bool ok = eval->write(evalDir);
+            return Evaluator::writeSynthesized(evalDir, Evaluator::table()) && ok;
+        });
+        if (!snapshotWriter.running())
+            copyEval(*eval, *evalBase); // その場で書き出して平均化した物に書き換えたので戻す。
+    }
+
+    void UseTeacherContext::waitEval() {
+        std::cout << "write eval ... " << (snapshotWriter.wait() ? "done" : "failed") << std::endl;
+    }
+
+    void UseTeacherContext::writeCheckpoint(const s64 nextIteration, const s64 nodesUsed) {
+        LearnerCheckpointHeader header = {};
+        header.iteration = nextIteration;
+        header.usedNodes = nodesUsed;
+        header.recordNum = reader.size();
+        Timer checkpointTimer = Timer::currentTime();
+        std::cout << "write checkpoint ... " << std::flush;
+        // 書き出しに失敗しても学習は続ける。
+        if (writeLearnerCheckpoint(checkpointFileName, header, checkpointSections()))
+            std::cout << "done (" << checkpointTimer.elapsed() << "[msec])" << std::endl;
+        writeLeafCache();
+    }
+
+    void UseTeacherContext::writeLeafCache() {
+        if (leafCacheFileName.empty())
+            return;
+        LearnerCheckpointHeader header = {};
+        header.recordNum = reader.size();
+        writeLearnerCheckpoint(leafCacheFileName, header, {{leafCache.data(), leafCache.bytes()}});
+    }
+
+    // 1 プロセスで同期的に学習する。教師データ全てから学習した時点で終了する。
+    void useTeacherSync(UseTeacherContext& ctx) {
+        ctx.start(0, 1);
+        for (s64 iteration = ctx.startIteration; NodesPerIteration * iteration + ctx.nodes <= ctx.maxNodes; ++iteration) {
+            const double loss = ctx.computeGradients(iteration);
+            if (ctx.nodes < NodesPerIteration)
+                break; // パラメータ更新するにはデータが足りなかったので、パラメータ更新せずに終了する。
+            ctx.mergeGradients();
+            const Timer updateTimer = Timer::currentTime();
+            ctx.updateParameters(iteration);
+            ctx.finishIteration(iteration, loss, updateTimer);
+        }
+        ctx.writeLeafCache();
+        ctx.writeEval();
+        ctx.waitEval();
+    }
+
+    // 非同期学習。
+    // 各スレッドは gradient を 1 つ借りて AsyncMiniBatchSize 局面分を計算し、キューに積んで次の gradient を借りる。
+    // このスレッドはキューから gradient を取り出して、触れた要素だけパラメータを更新し、
+    // 関係する合成後の要素に差分を足し込む。探索中のスレッドは止めないので、更新途中の値を読む事がある。
+    // 最初のイテレーションでパラメータを 0 にする処理は、同期的な学習の為のものなので行わない。
+    void useTeacherAsync(UseTeacherContext& ctx) {
+        ctx.start(0, 1);
+        struct Job {
+            SparseEvaluatorGradient* gradient;
+            s64 nodes;
+            double loss;
+            u64 version; // 計算を始めた時点で適用済みだった更新の回数
+        };
+        Mutex mutex;
+        ConditionVariable cond;
+        // 更新待ちの gradient の分も確保してあるので、この数で gradient の古さの上限が決まる。
+        std::deque<SparseEvaluatorGradient*> freeGradients(std::begin(ctx.evaluatorGradientPtrs), std::end(ctx.evaluatorGradientPtrs));
+        std::deque<Job> jobs;
+        int runningWorkers = ctx.threadNum;
+        std::atomic<u64> appliedVersion(0);
+        auto worker = [&](Position& pos) {
+            SearchStack ss[2];
+            std::vector<HuffmanCodedPosAndEval> hcpes(TeacherBatchSize);
+            s64 nodesSinceClear = 0;
+            while (true) {
+                SparseEvaluatorGradient* gradient;
+                {
+                    std::unique_lock<Mutex> lock(mutex);
+                    cond.wait(lock, [&] { return !freeGradients.empty(); });
+                    gradient = freeGradients.front();
+                    freeGradients.pop_front();
+                }
+                gradient->clear();
+                if (NodesPerIteration / ctx.threadNum <= nodesSinceClear) {
+                    // 置換表には古い評価関数での探索結果が残っているので、たまにクリアする。
+                    pos.searcher()->tt.clear();
+                    nodesSinceClear = 0;
+                }
+                Job job = {gradient, 0, 0.0, appliedVersion};
+                size_t num;
+                while (job.nodes < AsyncMiniBatchSize
+                       && (num = ctx.stream.take(&hcpes[0], static_cast<size_t>(std::min<s64>(TeacherBatchSize, AsyncMiniBatchSize - job.nodes)))) != 0)
+                {
+                    for (size_t i = 0; i < num; ++i)
+                        ctx.learnPosition(pos, ss, hcpes[i], gradient, job.loss);
+                    job.nodes += num;
+                }
+                nodesSinceClear += job.nodes;
+                const bool finished = (job.nodes < AsyncMiniBatchSize);
+                {
+                    std::unique_lock<Mutex> lock(mutex);
+                    if (job.nodes != 0)
+                        jobs.push_back(job);
+                    else
+                        freeGradients.push_back(gradient);
+                    if (finished)
+                        --runningWorkers;
+                }
+                cond.notify_all();
+                if (finished)
+                    return;
+            }
+        };
+
+        TouchedBaseIndices touched(ctx.evalBase->kpps_end_index(), ctx.evalBase->kkps_end_index());
+        std::vector<std::thread> threads(ctx.threadNum);
+        for (int i = 0; i < ctx.threadNum; ++i)
+            threads[i] = std::thread([&worker, &ctx, i] { worker(ctx.positions[i]); });
+        s64 appliedNodes = ctx.usedNodes;
+        s64 iteration = ctx.startIteration;
+        double loss = 0.0;
+        u64 staleness = 0;
+        u64 maxStaleness = 0;
+        u64 updates = 0;
+        u64 pendingKKUpdates = 0; // KK の gradient を溜めている mini batch の数
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<Mutex> lock(mutex);
+                cond.wait(lock, [&] { return !jobs.empty() || runningWorkers == 0; });
+                if (jobs.empty())
+                    break;
+                job = jobs.front();
+                jobs.pop_front();
+            }
+            applyAsyncUpdate(*ctx.eval, *ctx.evalBase, *ctx.lowerDimensionedEvaluatorGradient, *ctx.meanSquareOfLowerDimensionedEvaluatorGradient,
+                             *job.gradient, touched, ctx.resynthesizer);
+            if (++pendingKKUpdates == AsyncKKUpdateInterval) {
+                applyAsyncKKUpdate(*ctx.eval, *ctx.evalBase, *ctx.lowerDimensionedEvaluatorGradient, *ctx.meanSquareOfLowerDimensionedEvaluatorGradient, ctx.resynthesizer);
+                pendingKKUpdates = 0;
+            }
+            // 評価関数のハッシュテーブルも更新しないと、これまで探索した評価値と矛盾が生じる。
+            // 探索中のスレッドが読み書きしているので、テーブルは消さずに世代を進めて古い要素を使わないようにする。
+            g_evalTable.invalidate();
+            const u64 jobStaleness = appliedVersion - job.version;
+            ++appliedVersion;
+            {
+                std::unique_lock<Mutex> lock(mutex);
+                freeGradients.push_back(job.gradient);
+            }
+            cond.notify_all();
+            staleness += jobStaleness;
+            maxStaleness = std::max(maxStaleness, jobStaleness);
+            ++updates;
+            loss += job.loss;
+            appliedNodes += job.nodes;
+            if (NodesPerIteration * (iteration + 1) <= appliedNodes) {
+                averageEval(*ctx.averagedEvalBase, *ctx.evalBase); // 平均化する。
+                std::cout << "iteration: " << iteration << ", nodes: " << appliedNodes << "/" << ctx.maxNodes
+                          << " (" << std::fixed << std::setprecision(2) << static_cast<double>(appliedNodes) * 100 / ctx.maxNodes << "%)" << std::endl;
+                std::cout << "iteration elapsed: " << ctx.iterationTimer.elapsed() / 1000 << "[sec]" << std::endl;
+                std::cout << "loss: " << loss << std::endl;
+                std::cout << "staleness average: " << std::fixed << std::setprecision(2) << static_cast<double>(staleness) / updates
+                          << ", max: " << maxStaleness << std::endl;
+                if (ctx.leafCache.enabled())
+                    std::cout << "leaf cache hit: " << std::fixed << std::setprecision(2) << ctx.leafCache.takeHitRate() * 100 << "%" << std::endl;
+                printEvalTable(SQ88, f_gold + SQ78, f_gold, false);
+                if (ctx.snapshotWriter.poll())
+                    ctx.waitEval();
+                if (iteration % 100 == 0)
+                    ctx.writeEval();
+                // 取り出したがまだ更新に使っていない局面があるので、再開すると前後の数局面が重複したり抜けたりする。
+                if ((iteration + 1) % CheckpointInterval == 0)
+                    ctx.writeCheckpoint(iteration + 1, appliedNodes);
+                ctx.iterationTimer.restart();
+                loss = 0.0;
+                staleness = maxStaleness = updates = 0;
+                ++iteration;
+            }
+        }
+        for (auto& th : threads)
+            th.join();
+        if (pendingKKUpdates != 0)
+            applyAsyncKKUpdate(*ctx.eval, *ctx.evalBase, *ctx.lowerDimensionedEvaluatorGradient, *ctx.meanSquareOfLowerDimensionedEvaluatorGradient, ctx.resynthesizer);
+        ctx.writeLeafCache();
+        ctx.writeEval();
+        ctx.waitEval();
+    }
+
+    // 複数プロセスでの学習の server。
+    // 各プロセスの gradient を集約してパラメータを更新し、変化した評価関数の要素を client に送り返す。
+    // どれかのプロセスの教師データが足りなくなった時点で client に終了を伝える。
+    void useTeacherServer(UseTeacherContext& ctx, const std::string& bindAddress, const int port, const int processNum) {
+        std::vector<std::unique_ptr<LearnerConnection> > clients;
+        {
+            LearnerListener listener;
+            if (!listener.listen(bindAddress, static_cast<u16>(port)))
+                exit(EXIT_FAILURE);
+            std::cout << "waiting for " << processNum - 1 << " clients on " << bindAddress << ":" << port << std::endl;
+            const u32 checksum = evalChecksum(*ctx.eval);
+            for (int i = 1; i < processNum; ++i) {
+                clients.emplace_back(new LearnerConnection);
+                const LearnerHelloMessage hello = {static_cast<u32>(i), static_cast<u32>(processNum), ctx.reader.size(), checksum, 0, ctx.startIteration};
+                if (!listener.accept(*clients.back()) || !clients.back()->sendMessage(LearnerHello, &hello, sizeof(hello)))
+                    exit(EXIT_FAILURE);
+                // 途中から再開する場合は、Eval_Dir の評価関数ではなくチェックポイントから復元した評価関数を送る。
+                if (ctx.startIteration != 0 && !clients.back()->sendMessage(LearnerEval, ctx.eval->oneArrayKPP(0), evalBytes(*ctx.eval)))
+                    exit(EXIT_FAILURE);
+                std::cout << "client " << i << " connected" << std::endl;
+            }
+        }
+        ctx.start(0, processNum);
+        std::vector<u8> message;
+        u32 messageType;
+        for (s64 iteration = ctx.startIteration; processNum != 1 || NodesPerIteration * iteration + ctx.nodes <= ctx.maxNodes; ++iteration) {
+            double loss = ctx.computeGradients(iteration);
+            if (processNum == 1 && ctx.nodes < NodesPerIteration)
+                break; // パラメータ更新するにはデータが足りなかったので、パラメータ更新せずに終了する。
+            ctx.mergeGradients();
+            // 全ての client から gradient を受け取って集約する。
+            bool enoughNodes = (ctx.nodes == ctx.iterationNodes);
+            for (size_t i = 0; i < clients.size(); ++i) {
+                LearnerGradientMessage header;
+                if (!clients[i]->recvMessage(messageType, message, maxGradientMessageBytes()) || messageType != LearnerGradient || message.size() < sizeof(header)
+                    || !ctx.evaluatorGradients[0]->addSerialized(message.data() + sizeof(header), message.size() - sizeof(header)))
+                {
+                    std::cerr << "Error: invalid message from client " << i + 1 << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                memcpy(&header, message.data(), sizeof(header));
+                const int clientRank = static_cast<int>(i) + 1;
+                if (header.nodes != NodesPerIteration * (clientRank + 1) / processNum - NodesPerIteration * clientRank / processNum)
+                    enoughNodes = false;
+                ctx.nodes += header.nodes;
+                loss += header.loss;
+            }
+            if (!enoughNodes) {
+                for (auto& client : clients)
+                    client->sendMessage(LearnerFinish, nullptr, 0);
+                break; // パラメータ更新するにはデータが足りなかったので、パラメータ更新せずに終了する。
+            }
+            const Timer updateTimer = Timer::currentTime();
+            ctx.updateParameters(iteration);
+            // eval にはまだ前回の整数の評価値が入っているので、それとの差分を client に送る。
+            serializeEvalDiff(message, ctx.diffEntries);
+            for (size_t i = 0; i < clients.size(); ++i) {
+                if (!clients[i]->sendMessage(LearnerUpdate, message)) {
+                    std::cerr << "Error: lost connection to client " << i + 1 << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+            }
+            ctx.finishIteration(iteration, loss, updateTimer);
+        }
+        ctx.writeLeafCache();
+        ctx.writeEval();
+        ctx.waitEval();
+    }
+
+    // 複数プロセスでの学習の client。
+    // gradient を server に送り、更新後の評価関数の差分を受け取る。server から終了を伝えられるまで続ける。
+    void useTeacherClient(UseTeacherContext& ctx, const std::string& host, const int port) {
+        LearnerConnection server;
+        std::vector<u8> message;
+        u32 messageType;
+        if (!server.connect(host, static_cast<u16>(port)))
+            exit(EXIT_FAILURE);
+        LearnerHelloMessage hello;
+        if (!server.recvMessage(messageType, message, sizeof(hello)) || messageType != LearnerHello || message.size() != sizeof(hello)) {
+            std::cerr << "Error: invalid message from server" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        memcpy(&hello, message.data(), sizeof(hello));
+        if (hello.iteration != 0) {
+            if (!server.recvMessage(messageType, message, evalBytes(*ctx.eval)) || messageType != LearnerEval || message.size() != evalBytes(*ctx.eval)) {
+                std::cerr << "Error: invalid message from server" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            memcpy(ctx.eval->oneArrayKPP(0), message.data(), message.size());
+            ctx.eval->init(ctx.evalDir, false, false); // 探索で使う評価関数の更新
+        }
+        if (hello.recordNum != ctx.reader.size() || hello.evalChecksum != evalChecksum(*ctx.eval)) {
+            std::cerr << "Error: teacher data or eval differs from server's" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        const int rank = static_cast<int>(hello.rank);
+        const int processNum = static_cast<int>(hello.processNum);
+        ctx.startIteration = hello.iteration;
+        std::cout << "connected as client " << rank << "/" << processNum << std::endl;
+        ctx.start(rank, processNum);
+        for (s64 iteration = ctx.startIteration; ; ++iteration) {
+            const double loss = ctx.computeGradients(iteration);
+            ctx.mergeGradients();
+            const LearnerGradientMessage header = {ctx.nodes.load(), loss};
+            ctx.evaluatorGradients[0]->serialize(message);
+            message.insert(std::begin(message), reinterpret_cast<const u8*>(&header), reinterpret_cast<const u8*>(&header) + sizeof(header));
+            if (!server.sendMessage(LearnerGradient, message) || !server.recvMessage(messageType, message, maxEvalDiffBytes(*ctx.eval))) {
+                std::cerr << "Error: lost connection to server" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            if (messageType == LearnerFinish)
+                break;
+            if (messageType != LearnerUpdate || !deserializeEvalDiff(ctx.diffEntries, *ctx.eval, message)) {
+                std::cerr << "Error: invalid message from server" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            ctx.resynthesizer.apply(*ctx.eval, ctx.diffEntries); // 探索で使う評価関数の更新
+            g_evalTable.clear();
+            std::cout << "iteration elapsed: " << ctx.iterationTimer.elapsed() / 1000 << "[sec]" << std::endl;
+            std::cout << "loss: " << loss << std::endl;
+        }
+        ctx.writeLeafCache(); // 評価関数のファイルは server が書き出す。
+    }
+}
+
+// use_teacher <teacher_file> <threads> [async | server <port> <processes> | client <host> <port>] [bind <address>] [checkpoint <file>] [resume]
+//             [validation <file> <interval>] [leaf_cache <MB> <uses> <file|->]
+// async を指定すると、各スレッドが AsyncMiniBatchSize 局面ずつ gradient を計算して渡し、
+// 他のスレッドの計算を待たずにパラメータ更新を行う。(Hogwild! 風の非同期 SGD)
+// 探索中の合成後の評価関数を差分で書き換えるので、RESYNTHESIZE_INCREMENTALLY の時だけ使える。
+// server, client を指定すると、processes 個のプロセスで教師データを等分して学習する。
+// 各プロセスは 1 イテレーション分の gradient を server に送り、server が集約してパラメータを更新し、
+// 変化した評価関数の要素を client に送り返す。Eval_Dir の評価関数は全てのプロセスで同じものを使うこと。
+// server は bind で指定したアドレス (既定は 127.0.0.1) で待ち受ける。他のマシンから接続させる場合は 0.0.0.0 などを指定する。
+// CheckpointInterval イテレーションごとに、パラメータ更新の状態と教師データの読み込み位置をチェックポイントに書き出す。
+// チェックポイントのファイル名は checkpoint で指定し、省略すると Eval_Dir/use_teacher.ckpt とする。
+// resume を指定すると、チェックポイントから学習を再開する。複数プロセスの場合は server に指定する。
+// validation を指定すると、interval イテレーションごとに学習に使わない教師データで loss と指し手の一致率を求める。
+// 検証用の局面は学習中の各スレッドが学習局面の合間に少しずつ処理するので、学習を止めずに済む。
+// 同期的な学習の時だけ使える。複数プロセスの場合は server だけが検証する。
+// leaf_cache を指定すると、教師局面ごとに qsearch で辿った末端の局面を MB [MB] の表に覚えておき、
+// uses 回までは qsearch せずにその局面を評価する。教師データは 1 回の学習で 1 度ずつしか使わないので、
+// file を指定して学習の終わりとチェックポイントごとに表を保存し、次に同じ教師データで学習する時に読み込む。
+void use_teacher(Position& pos, std::istringstream& ssCmd) {
+    std::string teacherFileName;
+    int threadNum;
+    ssCmd >> teacherFileName;
+    ssCmd >> threadNum;
+    if (threadNum <= 0)
+        exit(EXIT_FAILURE);
+    bool asyncMode = false;
+    bool isServer = false;
+    bool isClient = false;
+    bool resume = false;
+    std::string checkpointFileName = Evaluator::addSlashIfNone(pos.searcher()->options["Eval_Dir"]) + "use_teacher.ckpt";
+    std::string host;
+    std::string bindAddress = "127.0.0.1";
+    bool bindSpecified = false;
+    int port = 0;
+    int processNum = 1;
+    std::string validationFileName;
+    s64 validationInterval = 0;
+    size_t leafCacheMB = 0;
+    u32 leafCacheUses = 0;
+    std::string leafCacheFileName;
+    std::string token;
+    while (ssCmd >> token) {
+        if (token == "async")
+            asyncMode = true;
+        else if (token == "server") {
+            isServer = true;
+            ssCmd >> port >> processNum;
+        }
+        else if (token == "client") {
+            isClient = true;
+            ssCmd >> host >> port;
+        }
+        else if (token == "bind") {
+            bindSpecified = true;
+            ssCmd >> bindAddress;
+        }
+        else if (token == "checkpoint")
+            ssCmd >> checkpointFileName;
+        else if (token == "resume")
+            resume = true;
+        else if (token == "validation")
+            ssCmd >> validationFileName >> validationInterval;
+        else if (token == "leaf_cache") {
+            // ファイル名が "-" ならファイルに保存しない。
+            ssCmd >> leafCacheMB >> leafCacheUses >> leafCacheFileName;
+            if (leafCacheFileName == "-")
+                leafCacheFileName.clear();
+        }
+        else {
+            std::cerr << "Error: unknown option " << token << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (asyncMode + isServer + isClient > 1 || (isClient && resume) || ((asyncMode || isClient) && !validationFileName.empty())
+        || (bindSpecified && !isServer))
+    {
+        std::cerr << "Error: conflicting options" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+#if !defined RESYNTHESIZE_INCREMENTALLY
+    if (asyncMode) {
+        // 合成し直す度に探索中のテーブルを作り直す事になるので、非同期学習は出来ない。
+        std::cerr << "Error: async needs EVAL_ONLINE without EVAL_PHASE1-4" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+#endif
+    if ((isServer || isClient) && (port <= 0 || 65536 <= port || processNum <= 0)) {
+        std::cerr << "Error: invalid port or number of processes" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (!validationFileName.empty() && validationInterval <= 0) {
+        std::cerr << "Error: invalid validation interval" << std::endl;
+        exit(EXIT_FAILURE);
     }
-    writeEval();
-    writeSyn();
+    if (leafCacheMB != 0 && leafCacheUses == 0) {
+        std::cerr << "Error: invalid leaf cache uses" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    // 非同期学習では、更新待ちの gradient の分も確保しておく。
+    UseTeacherContext ctx(pos.searcher()->options["Eval_Dir"], threadNum, (asyncMode ? 2 * threadNum : threadNum), checkpointFileName);
+    if (!ctx.open(teacherFileName, validationFileName, validationInterval)
+        || !ctx.initLeafCache(leafCacheMB, leafCacheUses, leafCacheFileName))
+    {
+        exit(EXIT_FAILURE);
+    }
+    ctx.initEval(!isClient);
+    if (resume && !ctx.readCheckpoint())
+        exit(EXIT_FAILURE);
+
+    if (asyncMode)
+        useTeacherAsync(ctx);
+    else if (isServer)
+        useTeacherServer(ctx, bindAddress, port, processNum);
+    else if (isClient)
+        useTeacherClient(ctx, host, port);
+    else
+        useTeacherSync(ctx);
 }
 
 // 教師データが壊れていないかチェックする。
@@ -795,26 +2037,25 @@ void check_teacher(std::istringstream& ssCmd) {
     ssCmd >> threadNum;
     if (threadNum <= 0)
         exit(EXIT_FAILURE);
+    constexpr size_t BatchSize = 256; // 1 回にまとめて復号する局面数
     std::vector<Searcher> searchers(threadNum);
-    std::vector<Position> positions;
-    for (auto& s : searchers) {
-        s.init();
-        positions.emplace_back(DefaultStartPositionSFEN, s.threads.main(), s.thisptr);
+    std::vector<std::vector<Position> > positions(threadNum);
+    for (int i = 0; i < threadNum; ++i) {
+        searchers[i].init();
+        positions[i].assign(BatchSize, Position(DefaultStartPositionSFEN, searchers[i].threads.main(), searchers[i].thisptr));
     }
-    std::ifstream ifs(teacherFileName.c_str(), std::ios::binary);
-    if (!ifs)
+    TeacherFileReader reader; // チャンク形式ならチェックサムも確認される。
+    if (!reader.open(teacherFileName, sizeof(HuffmanCodedPosAndEval)))
         exit(EXIT_FAILURE);
-    Mutex mutex;
-    auto func = [&mutex, &ifs](Position& pos) {
-        HuffmanCodedPosAndEval hcpe;
+    TeacherStream stream(reader);
+    stream.start();
+    auto func = [&stream](std::vector<Position>& batch) {
+        std::vector<HuffmanCodedPosAndEval> hcpes(batch.size());
         while (true) {
-            {
-                std::unique_lock<Mutex> lock(mutex);
-                ifs.read(reinterpret_cast<char*>(&hcpe), sizeof(hcpe));
-                if (ifs.eof())
-                    return;
-            }
-            if (!setPosition(pos, hcpe.hcp))
+            const size_t num = stream.take(hcpes.data(), hcpes.size());
+            if (num == 0)
+                return;
+            if (setPositions(batch.data(), hcpes.data(), num, batch[0].searcher()->threads.main()) != num)
                 exit(EXIT_FAILURE);
         }
     };
@@ -823,7 +2064,73 @@ void check_teacher(std::istringstream& ssCmd) {
         threads[i] = std::thread([&positions, i, &func] { func(positions[i]); });
     for (int i = 0; i < threadNum; ++i)
         threads[i].join();
-    exit(EXIT_SUCCESS);
+    exit(stream.failed() ? EXIT_FAILURE : EXIT_SUCCESS); // 途中のチャンクが読めなかった。
+}
+
+// 教師データの局面の静的評価値と教師の評価値を比べて、評価関数の当てはまりを調べる。
+// eval_teacher <input> <threads>
+void eval_teacher(std::istringstream& ssCmd) {
+    std::string teacherFileName;
+    int threadNum = 0;
+    ssCmd >> teacherFileName;
+    ssCmd >> threadNum;
+    if (threadNum <= 0) {
+        std::cerr << "Error: thread num = " << threadNum << std::endl;
+        return;
+    }
+    constexpr size_t BatchSize = 1024; // 1 回にまとめて評価する局面数
+    std::vector<Searcher> searchers(threadNum);
+    std::vector<std::vector<Position> > positions(threadNum);
+    for (int i = 0; i < threadNum; ++i) {
+        searchers[i].init();
+        positions[i].assign(BatchSize, Position(DefaultStartPositionSFEN, searchers[i].threads.main(), searchers[i].thisptr));
+    }
+    TeacherFileReader reader;
+    if (!reader.open(teacherFileName, sizeof(HuffmanCodedPosAndEval)))
+        return;
+    TeacherStream stream(reader);
+    stream.start();
+    std::atomic<s64> evaluatedNum(0);
+    std::atomic<double> absDiffSum(0.0);
+    std::atomic<double> lossSum(0.0); // 勝率の誤差の二乗和。use_teacher の loss と同じもの。
+    auto func = [&](std::vector<Position>& batch) {
+        std::vector<HuffmanCodedPosAndEval> hcpes(batch.size());
+        std::vector<EvalSum> sums(batch.size());
+        double absDiff = 0.0;
+        double loss = 0.0;
+        s64 num = 0;
+        while (const size_t takenNum = stream.take(hcpes.data(), hcpes.size())) {
+            if (setPositions(batch.data(), hcpes.data(), takenNum, batch[0].searcher()->threads.main()) != takenNum) {
+                std::cerr << "Error: incorrect teacher data" << std::endl;
+                break;
+            }
+            evaluateBatch(batch.data(), takenNum, sums.data());
+            for (size_t i = 0; i < takenNum; ++i) {
+                const Score eval = static_cast<Score>(sums[i].sum(batch[i].turn()) / FVScale);
+                const Score teacherEval = static_cast<Score>(hcpes[i].eval); // 手番側から見た評価値が入っている。
+                absDiff += abs(eval - teacherEval);
+                const double tmp = sigmoidWinningRate(eval) - sigmoidWinningRate(teacherEval);
+                loss += tmp * tmp;
+            }
+            num += takenNum;
+        }
+        evaluatedNum += num;
+        atomicAdd(absDiffSum, absDiff);
+        atomicAdd(lossSum, loss);
+    };
+    Timer t = Timer::currentTime();
+    std::vector<std::thread> threads(threadNum);
+    for (int i = 0; i < threadNum; ++i)
+        threads[i] = std::thread([&positions, i, &func] { func(positions[i]); });
+    for (int i = 0; i < threadNum; ++i)
+        threads[i].join();
+    if (stream.failed())
+        std::cerr << "Error: cannot read " << teacherFileName << std::endl;
+    const s64 num = evaluatedNum;
+    std::cout << "positions: " << num << "\n"
+              << "mean abs diff: " << (num == 0 ? 0.0 : absDiffSum.load() / num) << "\n"
+              << "loss: " << lossSum.load() << "\n"
+              << "elapsed: " << t.elapsed() / 1000 << "[sec]" << std::endl;
 }
 #endif
 
@@ -1036,9 +2343,104 @@ void measureGenerateMoves(const Position& pos) {
 }
 #endif
 
+// Eval_Dir の評価関数の KPP を 1 byte に量子化して KPP_int8.bin, KPP_int8_shift.bin に書き出す。
+// 元の s16 のテーブルとの誤差を、要素ごとと、初期局面から無作為に指し進めた局面の評価値で表示する。
+// quantize_eval [positions]
+void quantizeEval(Position& pos, std::istringstream& ssCmd) {
+    s64 positionNum = 100000;
+    ssCmd >> positionNum;
+    const std::string dirName = pos.searcher()->options["Eval_Dir"];
+    std::unique_ptr<SynthesizedEvalTable> synthesized(new SynthesizedEvalTable);
+    if (!std::unique_ptr<Evaluator>(new Evaluator)->synthesize(dirName, *synthesized, true, true)) {
+        std::cerr << "Error: cannot read eval files in " << dirName << std::endl;
+        return;
+    }
+    std::unique_ptr<QuantizedKPPTable> quantized(new QuantizedKPPTable);
+    quantized->quantize(synthesized->KPP);
+    if (!quantized->write(dirName)) {
+        std::cerr << "Error: cannot write quantized KPP to " << dirName << std::endl;
+        return;
+    }
+    std::cout << "KPP size: " << sizeof(synthesized->KPP) / (1024 * 1024) << " MB -> "
+              << (sizeof(quantized->KPP) + sizeof(quantized->KPPShift)) / (1024 * 1024) << " MB" << std::endl;
+
+    // 要素ごとの誤差
+    double elementSquareSum = 0.0;
+    int elementMaxError = 0;
+    for (Square ksq = SQ11; ksq < SquareNum; ++ksq) {
+        for (int i = 0; i < fe_end; ++i) {
+            for (int j = 0; j < fe_end; ++j) {
+                for (int c = 0; c < 2; ++c) {
+                    const int error = quantized->KPP[ksq][i][j][c] * (1 << quantized->KPPShift[ksq][i][c]) - synthesized->KPP[ksq][i][j][c];
+                    elementSquareSum += static_cast<double>(error) * error;
+                    elementMaxError = std::max(elementMaxError, std::abs(error));
+                }
+            }
+        }
+    }
+    const double elementNum = static_cast<double>(SquareNum) * fe_end * fe_end * 2;
+    std::cout << "element error: rms " << std::sqrt(elementSquareSum / elementNum) / FVScale
+              << ", max " << static_cast<double>(elementMaxError) / FVScale << std::endl;
+
+    // 局面の評価値の誤差。KKP, KK は量子化していないので KPP の和だけ比べる。
+    auto kppSumError = [&](const Square ksq, const int* list, const int nlist) {
+        std::array<s64, 2> error = {{0, 0}};
+        for (int i = 1; i < nlist; ++i) {
+            std::array<s32, 2> rowSum = {{0, 0}};
+            std::array<s32, 2> quantizedRowSum = {{0, 0}};
+            for (int j = 0; j < i; ++j) {
+                rowSum += synthesized->KPP[ksq][list[i]][list[j]];
+                quantizedRowSum += quantized->KPP[ksq][list[i]][list[j]];
+            }
+            for (int c = 0; c < 2; ++c)
+                error[c] += quantizedRowSum[c] * (1 << quantized->KPPShift[ksq][list[i]][c]) - rowSum[c];
+        }
+        return error;
+    };
+    std::mt19937_64 mt(0);
+    Position p(DefaultStartPositionSFEN, pos.searcher()->threads.main(), pos.searcher());
+    std::unique_ptr<StateInfo[]> states(new StateInfo[MaxPly]);
+    double squareSum = 0.0;
+    double absSum = 0.0;
+    double maxError = 0.0;
+    s64 num = 0;
+    while (num < positionNum) {
+        p.set(DefaultStartPositionSFEN, pos.searcher()->threads.main());
+        for (int ply = 0; ply < MaxPly && num < positionNum; ++ply) {
+            MoveList<Legal> ml(p);
+            if (ml.size() == 0)
+                break;
+            p.doMove((ml.begin() + mt() % ml.size())->move, states[ply]);
+            const auto errorB = kppSumError(p.kingSquare(Black), p.cplist0(), p.nlist());
+            const auto errorW = kppSumError(inverse(p.kingSquare(White)), p.cplist1(), p.nlist());
+            const s64 board = errorB[0] - errorW[0];
+            const double error = static_cast<double>((p.turn() == Black ? board : -board) + errorB[1] + errorW[1]) / FVScale;
+            squareSum += error * error;
+            absSum += std::abs(error);
+            maxError = std::max(maxError, std::abs(error));
+            ++num;
+        }
+    }
+    if (num != 0)
+        std::cout << "eval error (" << num << " positions): rms " << std::sqrt(squareSum / num)
+                  << ", mean abs " << absSum / num << ", max " << maxError << std::endl;
+}
+
 void Searcher::doUSICommandLoop(int argc, char* argv[]) {
     bool evalTableIsRead = false;
     Position pos(DefaultStartPositionSFEN, threads.main(), thisptr);
+    // 探索していない時に、探索で使うテーブルの評価関数を使える状態にする。
+    // load_eval で読み込んだものがあればそれに切り替え、まだ何も読み込んでいなければ Eval_Dir から読み込む。
+    auto prepareEvalTable = [&] {
+        if (Evaluator::switchTable())
+            evalTableIsRead = true;
+        else if (!evalTableIsRead) {
+            // 一時オブジェクトを生成して Evaluator::init() を呼んだ直後にオブジェクトを破棄する。
+            // 評価関数の次元下げをしたデータを格納する分のメモリが無駄な為、
+            std::unique_ptr<Evaluator>(new Evaluator)->init(options["Eval_Dir"], true);
+            evalTableIsRead = true;
+        }
+    };
 
     std::string cmd;
     std::string token;
@@ -1064,7 +2466,11 @@ void Searcher::doUSICommandLoop(int argc, char* argv[]) {
             if (token == "ponderhit" && limits.moveTime != 0)
                 limits.moveTime += timeManager.elapsed();
         }
-        else if (token == "go"       ) go(pos, ssCmd);
+        else if (token == "go"       ) {
+            if (Evaluator::switchTable()) // startThinking() でも切り替えるが、読み込み済みである事をここで覚えておく。
+                evalTableIsRead = true;
+            go(pos, ssCmd);
+        }
         else if (token == "position" ) setPosition(pos, ssCmd);
         else if (token == "usinewgame"); // isready で準備は出来たので、対局開始時に特にする事はない。
         else if (token == "usi"      ) SYNCCOUT << "id name " << std::string(options["Engine_Name"])
@@ -1074,19 +2480,34 @@ void Searcher::doUSICommandLoop(int argc, char* argv[]) {
         else if (token == "isready"  ) { // 対局開始前の準備。
             tt.clear();
             threads.main()->previousScore = ScoreInfinite;
-            if (!evalTableIsRead) {
-                // 一時オブジェクトを生成して Evaluator::init() を呼んだ直後にオブジェクトを破棄する。
-                // 評価関数の次元下げをしたデータを格納する分のメモリが無駄な為、
-                std::unique_ptr<Evaluator>(new Evaluator)->init(options["Eval_Dir"], true);
-                evalTableIsRead = true;
-            }
+            prepareEvalTable();
+            if (options["OwnBook"] && options["Book_Mmap"])
+                book.load(options["Book_File"]);
+            else
+                book.unload(); // 以前の isready でマップしたものが残っていれば、ファイルから読む方に戻す。
             SYNCCOUT << "readyok" << SYNCENDL;
         }
         else if (token == "setoption") setOption(ssCmd);
+        else if (token == "load_eval") { // 探索を止めずに評価関数を読み込み、次の go から使う。ディレクトリを省略すると Eval_Dir から読み込む。
+            // 探索で使うテーブルはまだ切り替わっていないので、evalTableIsRead は prepareEvalTable() か go で切り替えた時に立てる。
+            std::string dirName = options["Eval_Dir"];
+            ssCmd >> dirName;
+            if (Evaluator::loadSpareTable(dirName)) {
+                options["Eval_Dir"] = dirName;
+                SYNCCOUT << "info string loaded eval " << dirName << SYNCENDL;
+            }
+            else
+                SYNCCOUT << "info string failed to load eval " << dirName << SYNCENDL;
+        }
         else if (token == "write_eval") { // 対局で使う為の評価関数バイナリをファイルに書き出す。
-            if (!evalTableIsRead)
-                std::unique_ptr<Evaluator>(new Evaluator)->init(options["Eval_Dir"], true);
-            Evaluator::writeSynthesized(options["Eval_Dir"]);
+            prepareEvalTable();
+            Evaluator::writeSynthesized(options["Eval_Dir"], Evaluator::table());
+        }
+        else if (token == "quantize_eval") {
+            // Eval_Dir のファイルから量子化するので読み込みはしないが、load_eval したテーブルがあれば切り替えておく。
+            if (Evaluator::switchTable())
+                evalTableIsRead = true;
+            quantizeEval(pos, ssCmd);
         }
 #if defined LEARN
         else if (token == "l"        ) {
@@ -1094,40 +2515,42 @@ void Searcher::doUSICommandLoop(int argc, char* argv[]) {
             learner->learn(pos, ssCmd);
         }
         else if (token == "make_teacher") {
-            if (!evalTableIsRead) {
-                std::unique_ptr<Evaluator>(new Evaluator)->init(options["Eval_Dir"], true);
-                evalTableIsRead = true;
-            }
+            prepareEvalTable();
             make_teacher(ssCmd);
         }
         else if (token == "use_teacher") {
-            if (!evalTableIsRead) {
-                std::unique_ptr<Evaluator>(new Evaluator)->init(options["Eval_Dir"], true);
-                evalTableIsRead = true;
-            }
+            prepareEvalTable();
             use_teacher(pos, ssCmd);
         }
         else if (token == "check_teacher") {
             check_teacher(ssCmd);
         }
+        else if (token == "eval_teacher") {
+            prepareEvalTable();
+            eval_teacher(ssCmd);
+        }
+        else if (token == "pack_teacher"  ) packTeacher(ssCmd);
+        else if (token == "unpack_teacher") unpackTeacher(ssCmd);
+        else if (token == "shuffle_teacher") shuffleTeacher(ssCmd);
         else if (token == "print"    ) printEvalTable(SQ88, f_gold + SQ78, f_gold, false);
 #endif
 #if !defined MINIMUL
         // 以下、デバッグ用
         else if (token == "bench"    ) {
-            if (!evalTableIsRead) {
-                std::unique_ptr<Evaluator>(new Evaluator)->init(options["Eval_Dir"], true);
-                evalTableIsRead = true;
-            }
+            prepareEvalTable();
             benchmark(pos);
         }
         else if (token == "key"      ) SYNCCOUT << pos.getKey() << SYNCENDL;
         else if (token == "tosfen"   ) SYNCCOUT << pos.toSFEN() << SYNCENDL;
-        else if (token == "eval"     ) std::cout << evaluateUnUseDiff(pos) / FVScale << std::endl;
+        else if (token == "eval"     ) {
+            prepareEvalTable();
+            std::cout << evaluateUnUseDiff(pos) / FVScale << std::endl;
+        }
         else if (token == "d"        ) pos.print();
         else if (token == "s"        ) measureGenerateMoves(pos);
         else if (token == "t"        ) std::cout << pos.mateMoveIn1Ply().toCSA() << std::endl;
         else if (token == "b"        ) makeBook(pos, ssCmd);
+        else if (token == "merge_book") mergeBook(ssCmd);
 #endif
         else                           SYNCCOUT << "unknown command: " << cmd << SYNCENDL;
     } while (token != "quit" && argc == 1);